@@ -0,0 +1,25 @@
+# - Try to find liburing
+# Once done, this will define
+#
+#  URING_FOUND - system has liburing
+#  URING_INCLUDE_DIR - the liburing include directory
+#  URING_LIBRARY - link these to use liburing
+
+include(FindPackageHandleStandardArgs)
+
+find_path(URING_INCLUDE_DIR liburing.h
+PATHS /usr/include
+ /usr/local/include
+ /opt/liburing/include
+)
+
+find_library(URING_LIBRARY uring
+PATHS /usr/lib
+ /usr/local/lib
+ /opt/liburing/lib
+)
+
+find_package_handle_standard_args(URING DEFAULT_MSG
+                                  URING_INCLUDE_DIR URING_LIBRARY)
+
+mark_as_advanced(URING_LIBRARY URING_INCLUDE_DIR)
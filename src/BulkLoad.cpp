@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <deque>
+#include <algorithm>
+#include <sstream>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include "include/version.h"
+#include "include/MemoryAccount.h"
+#include "include/BulkLoad.h"
+
+namespace MPool {
+
+/// Letters, digits, _ and $, quoted with backticks;
+static bool quoteName(const std::string &name, std::string &out) {
+	if (name.empty()) {
+		return false;
+	}
+	for (size_t i = 0; i < name.size(); i++) {
+		if (!isalnum((unsigned char) name[i]) && '_' != name[i]
+				&& '$' != name[i]) {
+			return false;
+		}
+	}
+	out.append("`").append(name).append("`");
+	return true;
+}
+
+/// Names separated by sep, spaces around them ignored;
+static bool quoteList(const std::string &list, char sep, const char *join,
+		std::string &out) {
+	size_t start = 0;
+	while (true) {
+		size_t end = list.find(sep, start);
+		std::string name = list.substr(start,
+				std::string::npos == end ? std::string::npos : end - start);
+		name.erase(0, name.find_first_not_of(" \t"));
+		name.erase(name.find_last_not_of(" \t") + 1);
+		if (!quoteName(name, out)) {
+			return false;
+		}
+		if (std::string::npos == end) {
+			return true;
+		}
+		out.append(join);
+		start = end + 1;
+	}
+}
+
+BulkLoad::BulkLoad(size_t window, unsigned long timeout,
+		MemoryAccount *memory) {
+	this->offset = 0;
+	this->buffered = 0;
+	this->window = window ? window : MPOOL_BULK_WINDOW;
+	this->deadline = timeout ? time(0) + timeout : 0;
+	this->memory = memory;
+	this->ended = false;
+	this->aborted = false;
+	this->closed = false;
+	this->bytes = 0;
+	pthread_mutex_init(&this->mutex, NULL);
+	pthread_cond_init(&this->cond, NULL);
+}
+
+BulkLoad::~BulkLoad() {
+	if (this->memory && this->buffered) {
+		this->memory->sub(MemoryAccount::QUEUED, this->buffered);
+	}
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->mutex);
+}
+
+bool BulkLoad::push(const std::string &data) {
+	pthread_mutex_lock(&this->mutex);
+	if (this->closed || this->ended || this->aborted) {
+		pthread_mutex_unlock(&this->mutex);
+		return false;
+	}
+	if (this->buffered + data.size() > this->window) {
+		// The client did not wait for the replies;
+		this->aborted = true;
+		this->error = "Bulk load window exceeded";
+		pthread_cond_broadcast(&this->cond);
+		pthread_mutex_unlock(&this->mutex);
+		return false;
+	}
+	this->frames.push_back(data);
+	this->buffered += data.size();
+	if (this->memory) {
+		this->memory->add(MemoryAccount::QUEUED, data.size());
+	}
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+	return true;
+}
+
+void BulkLoad::finish() {
+	pthread_mutex_lock(&this->mutex);
+	this->ended = true;
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void BulkLoad::abort(const std::string &error) {
+	pthread_mutex_lock(&this->mutex);
+	if (!this->aborted && !this->closed) {
+		this->aborted = true;
+		this->error = error;
+		pthread_cond_broadcast(&this->cond);
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+int BulkLoad::read(char *buffer, unsigned int length,
+		unsigned long &completed) {
+	completed = 0;
+	pthread_mutex_lock(&this->mutex);
+	while (!this->aborted) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if (this->deadline && ts.tv_sec >= this->deadline) {
+			// However steady the frames, e.g. a client trickling bytes;
+			this->aborted = true;
+			this->error = "Bulk load exceeded bulk_timeout";
+			break;
+		}
+		if (this->ended || !this->frames.empty()) {
+			break;
+		}
+		ts.tv_sec += MPOOL_BULK_TIMEOUT;
+		if (this->deadline && ts.tv_sec > this->deadline) {
+			ts.tv_sec = this->deadline;
+		}
+		if (ETIMEDOUT
+				== pthread_cond_timedwait(&this->cond, &this->mutex, &ts)
+				&& this->frames.empty() && !this->ended
+				&& (!this->deadline || ts.tv_sec < this->deadline)) {
+			this->aborted = true;
+			this->error = "Bulk load timed out waiting for data";
+		}
+	}
+	if (this->aborted) {
+		pthread_mutex_unlock(&this->mutex);
+		return -1;
+	}
+	size_t copied = 0;
+	while (copied < length && !this->frames.empty()) {
+		std::string &frame = this->frames.front();
+		size_t n = frame.size() - this->offset;
+		if (n > length - copied) {
+			n = length - copied;
+		}
+		memcpy(buffer + copied, frame.data() + this->offset, n);
+		copied += n;
+		this->offset += n;
+		if (this->offset == frame.size()) {
+			this->buffered -= frame.size();
+			if (this->memory) {
+				this->memory->sub(MemoryAccount::QUEUED, frame.size());
+			}
+			this->frames.pop_front();
+			this->offset = 0;
+			completed++;
+		}
+	}
+	this->bytes += copied;
+	pthread_mutex_unlock(&this->mutex);
+	return copied;
+}
+
+unsigned long BulkLoad::close() {
+	pthread_mutex_lock(&this->mutex);
+	this->closed = true;
+	unsigned long dropped = this->frames.size();
+	if (this->memory && this->buffered) {
+		this->memory->sub(MemoryAccount::QUEUED, this->buffered);
+	}
+	this->frames.clear();
+	this->buffered = 0;
+	this->offset = 0;
+	pthread_mutex_unlock(&this->mutex);
+	return dropped;
+}
+
+bool BulkLoad::isClosed() {
+	pthread_mutex_lock(&this->mutex);
+	bool closed = this->closed;
+	pthread_mutex_unlock(&this->mutex);
+	return closed;
+}
+
+bool BulkLoad::isOpen() {
+	pthread_mutex_lock(&this->mutex);
+	bool open = !this->closed && !this->ended && !this->aborted;
+	pthread_mutex_unlock(&this->mutex);
+	return open;
+}
+
+std::string BulkLoad::getError() {
+	pthread_mutex_lock(&this->mutex);
+	std::string error = this->error;
+	pthread_mutex_unlock(&this->mutex);
+	return error;
+}
+
+unsigned long long BulkLoad::getBytes() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long bytes = this->bytes;
+	pthread_mutex_unlock(&this->mutex);
+	return bytes;
+}
+
+bool BulkLoad::buildStatement(const std::string &table,
+		const std::string &columns, const std::string &format,
+		unsigned long ignore_lines, std::string &sql) {
+	// The file name is only shown to the handler, which ignores it;
+	sql = "LOAD DATA LOCAL INFILE 'mpool' INTO TABLE ";
+	if (!quoteList(table, '.', ".", sql)
+			|| std::count(table.begin(), table.end(), '.') > 1) {
+		return false;
+	}
+	sql.append(" CHARACTER SET utf8");
+	if (format.empty() || !strcasecmp(format.c_str(), "csv")) {
+		sql.append(" FIELDS TERMINATED BY ',' OPTIONALLY ENCLOSED BY '\"'"
+				" ESCAPED BY '' LINES TERMINATED BY '\\n'");
+	} else if (strcasecmp(format.c_str(), "tsv")) {
+		return false;
+	}
+	if (ignore_lines) {
+		std::stringstream ss;
+		ss << " IGNORE " << ignore_lines << " LINES";
+		sql.append(ss.str());
+	}
+	if (!columns.empty()) {
+		sql.append(" (");
+		if (!quoteList(columns, ',', ",", sql)) {
+			return false;
+		}
+		sql.append(")");
+	}
+	return true;
+}
+
+}
@@ -24,13 +24,21 @@
 
 #include <string>
 #include <queue>
+#include <list>
+#include <deque>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
@@ -40,26 +48,214 @@
 #include <mysql.h>
 #include "include/version.h"
 #include "include/DBPool.h"
+#include "include/ConcurrencyLimiter.h"
+#include "include/MySQLProtocol.h"
+#include "include/MemoryAccount.h"
+#include "include/SpillBuffer.h"
+#include "include/IOUring.h"
+#include "include/TimerWheel.h"
+#include "include/ShmChannel.h"
+#include "include/Cursor.h"
+#include "include/RateLimiter.h"
+#include "include/ShardRouter.h"
+#include "include/ReplicaSet.h"
+#include "include/InsertBatcher.h"
+#include "include/WriteSpool.h"
+#include "include/BulkLoad.h"
+#include "include/FrameCompressor.h"
+#include "include/FnvHash.h"
 #include "include/Client.h"
 
 namespace MPool {
 
+static pthread_key_t writer_key;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+static void freeWriter(void *writer) {
+	delete (Json::FastWriter*) writer;
+}
+
+static void createWriterKey() {
+	pthread_key_create(&writer_key, freeWriter);
+}
+
+/// One serializer per worker thread instead of one per client;
+static Json::FastWriter* getWriter() {
+	pthread_once(&writer_once, createWriterKey);
+	Json::FastWriter *writer = (Json::FastWriter*) pthread_getspecific(
+			writer_key);
+	if (!writer) {
+		writer = new Json::FastWriter();
+		pthread_setspecific(writer_key, writer);
+	}
+	return writer;
+}
+
+/// Source of Client::readBulk();
+class BulkFeed {
+public:
+	Client *client;
+	time_t *heartbeat; /// NULL for none
+};
+
+Statement::Statement(unsigned char type) {
+	this->rejected = NULL;
+	this->type = type;
+	this->cursor = 0;
+	this->rows = 0;
+	this->retry = 0;
+	this->limited = false;
+	this->shard = NO_SHARD;
+	this->descending = false;
+	this->batch = NULL;
+	this->row = 0;
+	this->conditional = false;
+	this->codec = FrameCompressor::NONE;
+}
+
+void Statement::swap(Statement &other) {
+	this->sql.swap(other.sql);
+	std::swap(this->rejected, other.rejected);
+	std::swap(this->type, other.type);
+	std::swap(this->cursor, other.cursor);
+	std::swap(this->rows, other.rows);
+	std::swap(this->retry, other.retry);
+	std::swap(this->limited, other.limited);
+	std::swap(this->shard, other.shard);
+	this->order_by.swap(other.order_by);
+	std::swap(this->descending, other.descending);
+	this->gtid.swap(other.gtid);
+	std::swap(this->batch, other.batch);
+	std::swap(this->row, other.row);
+	std::swap(this->conditional, other.conditional);
+	std::swap(this->codec, other.codec);
+	this->hash.swap(other.hash);
+}
+
+/// Drop the reference of a statement that never runs;
+static void releaseBatch(Statement &statement, Client *client) {
+	if (statement.batch) {
+		statement.batch->unpark(client);
+	}
+	if (statement.batch && statement.batch->release()) {
+		delete statement.batch;
+	}
+}
+
+/**
+ * @brief Column order of the rows as written by Json::FastWriter
+ * Keys are sorted by name, the last column wins on duplicated names.
+ * */
+static void sortColumns(MYSQL_FIELD *field_list, unsigned int fields,
+		std::vector<unsigned int> &order, std::vector<std::string> &keys) {
+	std::map<std::string, unsigned int> columns;
+	for (unsigned int i = 0; i < fields; i++) {
+		columns[field_list[i].name] = i;
+	}
+	for (std::map<std::string, unsigned int>::iterator it = columns.begin();
+			it != columns.end(); it++) {
+		order.push_back(it->second);
+		keys.push_back(Json::valueToQuotedString(it->first.c_str()) + ":");
+	}
+}
+
+/// Header placeholder & the fields before data;
+static void beginRows(SpillBuffer &frame) {
+	frame.append(std::string(16, ' '));
+	frame.append("{\"code\":\"T001\",\"data\":");
+}
+
+static void appendRow(SpillBuffer &frame, std::vector<unsigned int> &order,
+		std::vector<std::string> &keys, char **row, unsigned long index) {
+	frame.append(index ? ",{" : "[{");
+	for (size_t k = 0; k < order.size(); k++) {
+		if (k) {
+			frame.append(",", 1);
+		}
+		frame.append(keys[k]);
+		frame.append(
+				Json::valueToQuotedString(
+						row[order[k]] ? row[order[k]] : ""));
+	}
+	frame.append("}", 1);
+}
+
+/**
+ * @brief Fold a row into the hash of a result
+ * Each value goes in with its length first, NULL as ~0 without bytes.
+ * */
+static void hashRow(unsigned long long &hash,
+		std::vector<unsigned int> &order, char **row, unsigned long *lengths) {
+	for (size_t k = 0; k < order.size(); k++) {
+		unsigned long long length =
+				row[order[k]] ? lengths[order[k]] : ~0ULL;
+		FnvHash::hash64(hash, &length, sizeof(length));
+		if (row[order[k]]) {
+			FnvHash::hash64(hash, row[order[k]], lengths[order[k]]);
+		}
+	}
+}
+
+/// The fields after data & the data length, hash is left out when empty;
+static void endRows(SpillBuffer &frame, unsigned long rows,
+		const char *message, const std::string &hash = "") {
+	frame.append(rows ? "]" : "null");
+	if (!hash.empty()) {
+		frame.append(",\"hash\":\"");
+		frame.append(hash);
+		frame.append("\"", 1);
+	}
+	frame.append(",\"message\":");
+	frame.append(Json::valueToQuotedString(message));
+	frame.append(",\"protocol_version\":\"");
+	frame.append(MPOOL_PROTOCOL_VERSION "\",\"status\":\"SUCCESS\"}\n");
+	char header[32];
+	snprintf(header, sizeof(header), "%16lu",
+			(unsigned long) frame.length() - 16);
+	frame.patch(0, header);
+}
+
 Client::Client(std::string username) {
-	time_t now = time(0);
-	this->connect_time = now;
-	this->last_hb_time = now;
+	this->connect_time = time(0);
+	this->last_hb_time = TimerWheel::now();
 	this->username = username;
 	this->token = "";
-	pthread_mutex_init(&this->work_mutex, NULL);
-	pthread_mutex_init(&this->sql_mutex, NULL);
-	this->jsonReader = new Json::Reader(Json::Features::strictMode());
-	this->jsonWriter = new Json::FastWriter();
+	pthread_mutex_init(&this->mutex, NULL);
+	this->working = false;
 	this->failed_queries = 0;
 	this->success_queries = 0;
 	this->queries = 0;
 	this->db_con = NULL;
+	this->db_pool = NULL;
 	this->socket = 0;
 	this->works = 0;
+	this->limited_works = 0;
+	this->limited = false;
+	this->uring = NULL;
+	this->shm = NULL;
+	this->wire = MPOOL_WIRE_JSON;
+	this->wheel = NULL;
+	this->spill_threshold = 0;
+	this->spill_dir = NULL;
+	this->max_result_size = 0;
+	this->cursors = NULL;
+	this->last_cursor = 0;
+	this->cursor_count = 0;
+	this->max_cursors = MPOOL_MAX_CURSORS;
+	this->priority = MPOOL_PRIORITY_NORMAL;
+	this->user_priority = MPOOL_PRIORITY_NORMAL;
+	this->weight = 1;
+	this->rate_limiter = NULL;
+	this->router = NULL;
+	this->route_shard = Statement::NO_SHARD;
+	this->route_descending = false;
+	this->route_conditional = false;
+	this->replicas = NULL;
+	this->open_batch = NULL;
+	this->spool = NULL;
+	this->bulk = NULL;
+	this->compressor = NULL;
+	this->codec = FrameCompressor::NONE;
 }
 
 int Client::getSocket() {
@@ -67,23 +263,149 @@ int Client::getSocket() {
 }
 
 Client::~Client() {
-	pthread_mutex_destroy(&this->work_mutex);
-	pthread_mutex_destroy(&this->sql_mutex);
-	delete this->jsonWriter;
-	delete this->jsonReader;
+	if (this->wheel) {
+		this->wheel->cancel(&this->timer);
+		this->wheel->cancel(&this->cursor_timer);
+	}
+	while (this->cursors) {
+		this->closeCursor(this->cursors);
+	}
+	if (this->limited_works) {
+		// Dropped unanswered, e.g. on a timeout;
+		this->rate_limiter->leave(this->limited_works);
+	}
+	if (this->open_batch) {
+		this->open_batch->forget(this);
+	}
+	for (std::list<Statement>::iterator it = this->sqls.begin();
+			it != this->sqls.end(); it++) {
+		releaseBatch(*it, this);
+	}
+	delete this->shm;
+	delete this->bulk;
+	pthread_mutex_destroy(&this->mutex);
 }
 
 void Client::setSocket(int s) {
 	this->socket = s;
 }
 
+void Client::detach(time_t grace) {
+	this->socket = 0;
+	if (this->wheel) {
+		this->wheel->schedule(&this->timer, TimerWheel::now() + grace);
+	}
+}
+
+void Client::setUring(IOUring *uring) {
+	this->uring = uring;
+}
+
+void Client::setShm(ShmChannel *shm) {
+	if (this->shm != shm) {
+		delete this->shm;
+	}
+	this->shm = shm;
+}
+
+ShmChannel* Client::getShm() {
+	return this->shm;
+}
+
 time_t Client::getConnectTime() {
 	return this->connect_time;
 }
 
 void Client::lastActive() {
-	time_t now = time(0);
+	time_t now = TimerWheel::now();
 	this->last_hb_time = now;
+	if (this->wheel) {
+		this->wheel->schedule(&this->timer, now + MPOOL_CLIENT_TIMEOUT);
+	}
+}
+
+void Client::setTimerWheel(TimerWheel *wheel) {
+	if (this->wheel) {
+		this->wheel->cancel(&this->timer);
+		this->wheel->cancel(&this->cursor_timer);
+	}
+	this->wheel = wheel;
+	this->timer.data = this;
+	this->cursor_timer.data = this;
+}
+
+void Client::touchCursors(time_t timeout) {
+	// Not pushed back by each request, a busy cursor would keep the
+	// unused ones of the client open;
+	if (this->wheel && !this->cursor_timer.isLinked()) {
+		this->wheel->schedule(&this->cursor_timer,
+				TimerWheel::now() + timeout);
+	}
+}
+
+bool Client::isCursorTimer(TimerNode *node) {
+	return node == &this->cursor_timer;
+}
+
+unsigned int Client::getCursorCount() {
+	return __atomic_load_n(&this->cursor_count, __ATOMIC_RELAXED);
+}
+
+void Client::setCursorLimit(unsigned int max_cursors) {
+	this->max_cursors = max_cursors;
+}
+
+void Client::setSchedule(unsigned char priority, unsigned int weight) {
+	this->priority = priority;
+	this->user_priority = priority;
+	this->weight = weight ? weight : 1;
+}
+
+void Client::setPriority(unsigned char priority) {
+	// Larger is lower;
+	this->priority =
+			priority > this->user_priority ? priority : this->user_priority;
+}
+
+unsigned char Client::getPriority() {
+	return this->priority;
+}
+
+unsigned int Client::getWeight() {
+	return this->weight;
+}
+
+void Client::setRateLimiter(RateLimiter *rate_limiter) {
+	this->rate_limiter = rate_limiter;
+}
+
+RateLimiter* Client::getRateLimiter() {
+	return this->rate_limiter;
+}
+
+void Client::setShardRouter(ShardRouter *router) {
+	this->router = router;
+}
+
+void Client::setRoute(int shard, const std::string &order_by,
+		bool descending) {
+	this->route_shard = shard;
+	this->route_order_by = order_by;
+	this->route_descending = descending;
+}
+
+void Client::setReplicaSet(ReplicaSet *replicas) {
+	this->replicas = replicas;
+}
+
+void Client::setReplicaRoute(const std::string &gtid) {
+	this->route_shard = Statement::REPLICA;
+	this->route_gtid = gtid;
+}
+
+void Client::setIfNoneMatch(bool conditional, const std::string &hash) {
+	this->route_conditional = conditional;
+	this->route_hash = hash;
 }
 
 time_t Client::getLastHbTime() {
@@ -95,35 +417,23 @@ std::string Client::getToken() {
 }
 
 std::string Client::generateToken() {
+	static const char hex[] = "0123456789abcdef";
+	unsigned char bytes[MPOOL_TOKEN_BYTES];
 	this->token = "";
-	srandom(time(0));
-	for (int i = 0; i < 64; i++) {
-		char c = 0;
-		unsigned char seed = random() % 4;
-		unsigned char n = 0;
-		switch (seed) {
-		case 0:
-			//Number;
-			n = random() % 10;
-			c = 0x30 + n;
-			break;
-		case 1:
-			//Upper case;
-			n = random() % 26;
-			c = 0x41 + n;
-			break;
-		case 2:
-			//Lower case;
-			n = random() % 26;
-			c = 0x61 + n;
-			break;
-		case 3:
-			c = '=';
-			break;
-		}
-		this->token += c;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (-1 == fd) {
+		return this->token;
+	}
+	ssize_t n = read(fd, bytes, sizeof(bytes));
+	close(fd);
+	if (n != (ssize_t) sizeof(bytes)) {
+		return this->token;
+	}
+	this->token.reserve(sizeof(bytes) * 2);
+	for (size_t i = 0; i < sizeof(bytes); i++) {
+		this->token += hex[bytes[i] >> 4];
+		this->token += hex[bytes[i] & 0x0f];
 	}
-	this->token = token;
 	return this->token;
 }
 
@@ -139,88 +449,908 @@ DB* Client::getDBConnection() {
 	return this->db_con;
 }
 
-void Client::pushSQL(std::string sql) {
+void Client::setDBPool(DBPool *db_pool) {
+	this->db_pool = db_pool;
+}
+
+DBPool* Client::getDBPool() {
+	return this->db_pool;
+}
+
+void Client::pushSQL(std::string sql, unsigned char type) {
 	this->lastActive();
-	pthread_mutex_lock(&this->sql_mutex);
-	this->sqls.push(sql);
-	this->works++;
+	this->memory.add(MemoryAccount::QUEUED, sql.size());
+	Statement statement(type);
+	statement.sql.swap(sql);
+	statement.shard = this->route_shard;
+	statement.order_by.swap(this->route_order_by);
+	statement.descending = this->route_descending;
+	statement.gtid.swap(this->route_gtid);
+	statement.conditional = this->route_conditional;
+	statement.hash.swap(this->route_hash);
+	statement.codec = this->codec;
+	// Heartbeats & framed replies are not queries of the user;
+	statement.limited = Statement::FRAME != type
+			&& std::string::npos != statement.sql.find_first_not_of(" \n\r\t");
+	this->route_shard = Statement::NO_SHARD;
+	this->route_conditional = false;
+	pthread_mutex_lock(&this->mutex);
+	this->enqueue(statement);
 #ifdef DEBUG
-	std::cout<<"Pushed SQL:"<<sql<<", works:"<<this->works<<std::endl;
+	std::cout<<"Pushed SQL:"<<this->sqls.back().sql<<", works:"<<this->works<<std::endl;
 #endif
-	pthread_mutex_unlock(&this->sql_mutex);
+	pthread_mutex_unlock(&this->mutex);
 }
 
-void Client::doWork() {
+void Client::pushCursor(unsigned char type, unsigned long cursor,
+		unsigned long rows, std::string sql) {
+	if (Statement::EXPIRE_CURSORS != type) {
+		this->lastActive();
+	}
+	this->memory.add(MemoryAccount::QUEUED, sql.size());
+	Statement statement(type);
+	statement.sql.swap(sql);
+	statement.cursor = cursor;
+	statement.rows = rows;
+	statement.codec = this->codec;
+	statement.limited = Statement::CURSOR == type || Statement::FETCH == type;
+	pthread_mutex_lock(&this->mutex);
+	this->enqueue(statement);
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void Client::reject(const char *status, const std::string &message,
+		unsigned long retry) {
+	this->lastActive();
+	Statement statement;
+	statement.sql = message;
+	statement.rejected = status;
+	statement.retry = retry;
+	statement.codec = this->codec;
+	pthread_mutex_lock(&this->mutex);
+	this->enqueue(statement);
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void Client::pushBatch(InsertBatch *batch, unsigned int row) {
+	this->lastActive();
+	Statement statement(Statement::BATCH);
+	statement.batch = batch;
+	statement.row = row;
+	statement.limited = true;
+	pthread_mutex_lock(&this->mutex);
+	this->enqueue(statement);
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void Client::enqueue(Statement &statement) {
+	if (statement.limited && this->rate_limiter) {
+		this->rate_limiter->enter();
+		this->limited_works++;
+	} else {
+		statement.limited = false;
+	}
+	this->sqls.push_back(Statement());
+	this->sqls.back().swap(statement);
+	this->works++;
+}
+
+void Client::setOpenBatch(InsertBatch *batch) {
+	this->open_batch = batch;
+}
+
+InsertBatch* Client::getOpenBatch() {
+	return this->open_batch;
+}
+
+void Client::setWriteSpool(WriteSpool *spool) {
+	this->spool = spool;
+}
+
+void Client::setBulkLoad(BulkLoad *bulk) {
+	if (this->bulk != bulk) {
+		delete this->bulk;
+	}
+	this->bulk = bulk;
+}
+
+BulkLoad* Client::getBulkLoad() {
+	return this->bulk;
+}
+
+void Client::setCompressor(FrameCompressor *compressor) {
+	this->compressor = compressor;
+}
+
+void Client::setCodec(unsigned char codec) {
+	this->codec = codec;
+}
+
+void Client::doWork(time_t *heartbeat) {
+	pthread_mutex_lock(&this->mutex);
 	if (this->sqls.empty()) {
+		this->working = false;
+		pthread_mutex_unlock(&this->mutex);
 		return;
 	}
 #ifdef DEBUG
 	std::cout<<"Starting work"<<std::endl;
 #endif
-	//pthread_mutex_lock(&this->work_mutex);
-	pthread_mutex_lock(&this->sql_mutex);
-	std::string sql = this->sqls.front();
-	this->sqls.pop();
-	pthread_mutex_unlock(&this->sql_mutex);
-	Json::Value root;
-	Json::Value data;
-	Json::Value row;
+	this->working = true;
+	Statement statement;
+	statement.swap(this->sqls.front());
+	this->sqls.pop_front();
+	this->limited = statement.limited;
+	pthread_mutex_unlock(&this->mutex);
+	std::string sql;
+	sql.swap(statement.sql);
+	const char *rejected = statement.rejected;
+	if (!rejected) {
+		this->memory.sub(MemoryAccount::QUEUED, sql.size());
+	}
+	if (Statement::BATCH == statement.type) {
+		if (!this->doBatchWork(statement)) {
+			// Parked, back at the head until the runner of the batch wakes
+			// the client, its worker is free meanwhile;
+			pthread_mutex_lock(&this->mutex);
+			this->sqls.push_front(Statement());
+			this->sqls.front().swap(statement);
+			this->limited = false;
+			this->working = false;
+			pthread_mutex_unlock(&this->mutex);
+			return;
+		}
+		this->done();
+		return;
+	}
+	if (!rejected && Statement::SPOOL == statement.type) {
+		this->doSpoolWork(sql);
+		this->done();
+		return;
+	}
+	if (!rejected && Statement::BULK == statement.type) {
+		this->doBulkWork(sql, heartbeat);
+		this->done();
+		return;
+	}
+	if (!rejected && Statement::FRAME == statement.type) {
+		// Rendered when it was requested, e.g. a snapshot or the status;
+		this->sendData(sql);
+		this->done();
+		return;
+	}
+	if (!rejected && Statement::QUERY != statement.type) {
+		statement.sql.swap(sql);
+		this->doCursorWork(statement);
+		this->done();
+		return;
+	}
+	if (!rejected && Statement::ALL_SHARDS == statement.shard) {
+		this->doScatterWork(sql, statement);
+		this->done();
+		return;
+	}
+	if (MPOOL_WIRE_MYSQL == this->wire) {
+		if (rejected) {
+			std::string out;
+			unsigned char seq = 1;
+			// ER_CON_COUNT_ERROR when shed, ER_USER_LIMIT_REACHED when
+			// rate limited, ER_OUT_OF_RESOURCES otherwise;
+			if (!strcmp(rejected, "OVERLOADED")) {
+				MySQLProtocol::appendPacket(out, seq,
+						MySQLProtocol::error(1040, "08004", sql));
+			} else if (!strcmp(rejected, "RATE_LIMITED")) {
+				MySQLProtocol::appendPacket(out, seq,
+						MySQLProtocol::error(1226, "42000", sql));
+			} else {
+				MySQLProtocol::appendPacket(out, seq,
+						MySQLProtocol::error(1041, "HY000", sql));
+			}
+			this->sendData(out);
+		} else {
+			this->doMySQLWork(sql);
+		}
+		this->done();
+		return;
+	}
 	std::string status = "SUCCESS";
 	std::string code = "T001";
 	std::string message = "";
+	std::string data = "";
+	std::string gtid = "";
+	std::string hash = "";
 	bool hasResult = false;
-	this->queries++;
+	if (rejected) {
+		// Refused when queued, e.g. past the memory limits;
+		status = rejected;
+		code = "F001";
+		message.swap(sql);
+		if (statement.retry) {
+			std::stringstream ss;
+			ss << statement.retry;
+			data = ss.str();
+		}
+	}
 	// Left trim;
 	sql.erase(0, sql.find_first_not_of(" \n\r\t"));
-	if (sql.empty()) {
-		pthread_mutex_unlock(&this->work_mutex);
-		this->works--;
-		return;
+	if (!sql.empty()) {
+		this->queries++;
 	}
-	DBResult *result = this->db_con->query(sql);
-	if (result) {
-		hasResult = true;
-		for (DBDataSet::iterator it = result->data.begin();
-				it != result->data.end(); it++) {
-			if (!row.empty()) {
-				row.clear();
-			}
-			DBDataRow dRow = *it;
-			for (DBDataRow::iterator rit = dRow.begin(); rit != dRow.end();
-					rit++) {
-				row[rit->first] = rit->second;
-#ifdef DEBUG
-				//std::cout<<"(Client)Query Result, "<<rit->first<<"->"<<rit->second<<std::endl;
-#endif
-			}
-			data.append(row);
+	// Routed statements always borrow from the pool of their shard;
+	DBPool *db_pool =
+			statement.shard >= 0 && this->router ?
+					this->router->getShard(statement.shard) : this->db_pool;
+	bool entered = false;
+	bool overloaded = false;
+	DB *db_con = NULL;
+	if (Statement::REPLICA == statement.shard && !sql.empty()) {
+		db_con = this->openReplica(statement.gtid, db_pool, entered);
+	}
+	if (!db_con) {
+		overloaded = !sql.empty() && !this->enterBackend(db_pool, entered);
+		db_con = db_pool == this->db_pool ? this->db_con : NULL;
+	}
+	if (!db_con && db_pool && !sql.empty()) {
+		// Shared mode, borrow a connection for this statement only;
+		db_con = db_pool->allocDB();
+	}
+	MYSQL_RES *res = NULL;
+	SpillBuffer frame(this->spill_threshold, this->spill_dir, &this->memory);
+	if (rejected) {
+		// Replied with the status of the rejection;
+	} else if (sql.empty()) {
+		// Heartbeat queued behind pending queries, replied in order;
+		message = "Heartbeat";
+	} else if (overloaded) {
+		status = "OVERLOADED";
+		code = "F001";
+		message = "Backend at its concurrency limit";
+		this->failed_queries++;
+	} else if (!db_con) {
+		code = "F001";
+		message = "Fail to get connection from the pool";
+		this->failed_queries++;
+	} else if (db_con->execute(sql, &res, true)) {
+		if (!res && !db_con->getGtid().empty()) {
+			// Consistency token of the write, replica reads wait for it;
+			this->last_gtid = db_con->getGtid();
+			gtid = this->last_gtid;
+		}
+		// Rows are fetched one by one, never all held in memory;
+		hasResult = res
+				&& this->encodeResult(res, frame,
+						statement.conditional ? &hash : NULL)
+				&& !db_con->checkFetch();
+		if (res && !hasResult && this->max_result_size
+				&& frame.length() > this->max_result_size) {
+			// Stopped at the limit, kill the rest rather than drain it;
+			db_pool->killQuery(db_con);
+		}
+		if (res) {
+			mysql_free_result(res);
+		}
+		if (!res || hasResult) {
+			this->success_queries++;
+		} else if (this->max_result_size
+				&& frame.length() > this->max_result_size) {
+			status = "RESULT_TOO_LARGE";
+			code = "F001";
+			message = "Result exceeds max_result_size";
+			this->failed_queries++;
+		} else if (db_con->checkFetch()) {
+			code = "F001";
+			message = db_con->getError();
+			this->failed_queries++;
+		} else {
+			code = "F001";
+			message = "Fail to spill the result";
+			this->failed_queries++;
 		}
-		this->db_con->freeResult(result);
-		this->success_queries++;
 	} else {
-		if (0 != this->db_con->getErrno()) {
+		if (0 != db_con->getErrno()) {
 			// Log error;
 			code = "F001";
-			message = this->db_con->getError();
+			message = db_con->getError();
 			this->failed_queries++;
 #ifdef DEBUG
-			std::cout<<"(Client)Query error:"<<this->db_con->getError()<<std::endl;
+			std::cout<<"(Client)Query error:"<<db_con->getError()<<std::endl;
 #endif
 		} else {
 			this->success_queries++;
 		}
 	}
+	// Only the execute, not the wait for the connection nor the encoding;
+	unsigned long long rtt =
+			db_con && !rejected && !sql.empty() ? db_con->getRtt() : 0;
+	if (db_con && db_con != this->db_con) {
+		db_pool->freeDB(db_con);
+	}
+	this->leaveBackend(db_pool, entered, rtt);
+	if (hasResult && statement.conditional
+			&& !hash.compare(statement.hash)) {
+		// The client holds these rows already, the frame is dropped;
+		this->sendMessage("NOT_MODIFIED", "T001", "", hash);
+		this->done();
+		return;
+	}
+	if (hasResult) {
+		this->sendFrame(frame, statement.codec);
+		this->done();
+		return;
+	}
 	// Send result to client;
+	this->sendMessage(status, code, message, data, gtid);
+	this->done();
+#ifdef DEBUG
+	std::cout<<"(Client)Work done"<<std::endl;
+	std::cout<<"[Client]Pending Works:"<<this->works<<std::endl;
+	std::cout<<"[Client]Queries:"<<this->queries<<std::endl;
+	std::cout<<"[Client]Success:"<<this->success_queries<<std::endl;
+	std::cout<<"[Client]Fail:"<<this->failed_queries<<std::endl;
+#endif
+}
+
+bool Client::doBatchWork(Statement &statement) {
+	InsertBatch *batch = statement.batch;
+	unsigned char state = batch->claim(this);
+	if (InsertBatch::OPEN == state) {
+		return false;
+	}
+	this->queries++;
+	if (InsertBatch::RUNNING == state) {
+		// First member to run, inserts the rows of all the members. Only
+		// shared clients batch, they have no session of their own;
+		DBPool *db_pool = batch->getPool();
+		bool entered;
+		this->enterBackend(db_pool, entered);
+		DB *db_con = db_pool->allocDB();
+		batch->execute(db_con);
+		unsigned long long rtt = 0;
+		if (db_con) {
+			rtt = db_con->getRtt();
+			db_pool->freeDB(db_con);
+		}
+		this->leaveBackend(db_pool, entered, rtt);
+	}
+	const std::string &error = batch->getError(statement.row);
+	if (error.empty()) {
+		this->success_queries++;
+		if (!batch->getGtid(statement.row).empty()) {
+			this->last_gtid = batch->getGtid(statement.row);
+		}
+		this->sendMessage("SUCCESS", "T001", "", "",
+				batch->getGtid(statement.row));
+	} else {
+		this->failed_queries++;
+		this->sendMessage("SUCCESS", "F001", error);
+	}
+	releaseBatch(statement, this);
+	return true;
+}
+
+void Client::doSpoolWork(const std::string &sql) {
+	std::string error;
+	this->queries++;
+	if (this->spool && this->spool->append(this->username, sql, error)) {
+		// Applied later by the drainer, errors only go to the log;
+		this->success_queries++;
+		this->sendMessage("SUCCESS", "T001", "Spooled");
+	} else {
+		this->failed_queries++;
+		this->sendMessage("FAILED", "F001",
+				this->spool ? error : "No write spool configured");
+	}
+}
+
+void Client::doBulkWork(const std::string &sql, time_t *heartbeat) {
+	std::string code = "T001";
+	std::string message = "Loaded";
+	std::string data = "";
+	this->queries++;
+	// Aborted before it ran, e.g. the connection dropped meanwhile;
+	std::string error = this->bulk->getError();
+	bool entered = false;
+	if (error.empty() && !this->enterBackend(this->db_pool, entered)) {
+		error = "Backend at its concurrency limit";
+	}
+	// In the session of the client when pinned, e.g. inside its transaction;
+	DB *db_con = NULL;
+	if (error.empty()) {
+		db_con = this->db_con ? this->db_con : this->db_pool->allocDB();
+	}
+	BulkFeed feed;
+	feed.client = this;
+	feed.heartbeat = heartbeat;
+	if (!error.empty()) {
+		code = "F001";
+		message = error;
+		this->failed_queries++;
+	} else if (!db_con) {
+		code = "F001";
+		message = "Fail to get connection from the pool";
+		this->failed_queries++;
+	} else if (db_con->loadLocal(sql, Client::readBulk, &feed)) {
+		std::stringstream ss;
+		ss << db_con->getAffectedRows();
+		data = ss.str();
+		this->success_queries++;
+	} else {
+		// Aborted by the client, the window or a timeout, else by MySQL;
+		error = this->bulk->getError();
+		code = "F001";
+		message = error.empty() ? db_con->getError() : error;
+		this->failed_queries++;
+	}
+	if (db_con && db_con != this->db_con) {
+		this->db_pool->freeDB(db_con);
+	}
+	// Paced by the upload of the client, not a sample of the backend;
+	this->leaveBackend(this->db_pool, entered, 0);
+	for (unsigned long dropped = this->bulk->close(); dropped; dropped--) {
+		this->sendMessage("FAILED", "F001", "Bulk load ended");
+	}
+	this->sendMessage("SUCCESS", code, message, data);
+}
+
+int Client::readBulk(void *feed, char *buffer, unsigned int length) {
+	Client *self = ((BulkFeed*) feed)->client;
+	time_t *heartbeat = ((BulkFeed*) feed)->heartbeat;
+	unsigned long completed;
+	int copied = self->bulk->read(buffer, length, completed);
+	if (heartbeat) {
+		// Waited at most MPOOL_BULK_TIMEOUT, the load is not stuck;
+		*heartbeat = time(0);
+	}
+	if (completed) {
+		// Each frame read lets the client send one more;
+		std::stringstream ss;
+		ss << self->bulk->getBytes();
+		for (; completed; completed--) {
+			self->sendMessage("SUCCESS", "T001", "Frame loaded", ss.str());
+		}
+	}
+	return copied;
+}
+
+bool Client::encodeResult(MYSQL_RES *res, SpillBuffer &frame,
+		std::string *hash) {
+	// Same output as Json::FastWriter, keys sorted, without building the
+	// rows as Json::Value;
+	beginRows(frame);
+	std::vector<unsigned int> order;
+	std::vector<std::string> keys;
+	sortColumns(mysql_fetch_fields(res), mysql_num_fields(res), order, keys);
+	// Column names are part of the hash, a renamed column changes it;
+	unsigned long long value = FnvHash::OFFSET64;
+	for (size_t k = 0; hash && k < keys.size(); k++) {
+		FnvHash::hash64(value, keys[k].data(), keys[k].size());
+	}
+	MYSQL_ROW row;
+	unsigned long rows = 0;
+	while ((row = mysql_fetch_row(res))) {
+		appendRow(frame, order, keys, row, rows++);
+		if (hash) {
+			hashRow(value, order, row, mysql_fetch_lengths(res));
+		}
+		if ((this->max_result_size && frame.length() > this->max_result_size)
+				|| frame.isFailed()) {
+			// The rest is drained by mysql_free_result();
+			return false;
+		}
+	}
+	if (hash) {
+		char hex[17];
+		snprintf(hex, sizeof(hex), "%016llx", value);
+		*hash = hex;
+	}
+	endRows(frame, rows, "", hash ? *hash : "");
+	return !frame.isFailed();
+}
+
+bool Client::sameColumns(MYSQL_RES *res, MYSQL_RES *other) {
+	unsigned int columns = mysql_num_fields(res);
+	if (columns != mysql_num_fields(other)) {
+		return false;
+	}
+	MYSQL_FIELD *fields = mysql_fetch_fields(res);
+	MYSQL_FIELD *others = mysql_fetch_fields(other);
+	for (unsigned int i = 0; i < columns; i++) {
+		if (strcmp(fields[i].name, others[i].name)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Client::doScatterWork(const std::string &sql, Statement &statement) {
+	this->queries++;
+	std::vector<ShardResult> results;
+	if (this->router) {
+		this->router->scatter(sql, results);
+	}
+	std::string status = "SUCCESS";
+	std::string message = results.empty() ? "No shards configured" : "";
+	MYSQL_RES *first = NULL;
+	for (size_t i = 0; i < results.size(); i++) {
+		if (results[i].failed && message.empty()) {
+			std::stringstream ss;
+			ss << "Shard " << i << ": " << results[i].error;
+			message = ss.str();
+		} else if (results[i].res && !first) {
+			first = results[i].res;
+		} else if (results[i].res && message.empty()
+				&& !this->sameColumns(results[i].res, first)) {
+			message = "The shards returned different columns";
+		}
+	}
+	int column = -1;
+	if (first && message.empty() && !statement.order_by.empty()) {
+		MYSQL_FIELD *fields = mysql_fetch_fields(first);
+		for (unsigned int i = 0; i < mysql_num_fields(first); i++) {
+			if (!statement.order_by.compare(fields[i].name)) {
+				column = i;
+				break;
+			}
+		}
+		if (column < 0) {
+			message = "Unknown column in order_by";
+		}
+	}
+	SpillBuffer frame(this->spill_threshold, this->spill_dir, &this->memory);
+	std::string hash;
+	bool hasResult = first && message.empty()
+			&& this->encodeShards(results, column, statement.descending,
+					frame, statement.conditional ? &hash : NULL);
+	if (first && message.empty() && !hasResult) {
+		if (this->max_result_size && frame.length() > this->max_result_size) {
+			status = "RESULT_TOO_LARGE";
+			message = "Result exceeds max_result_size";
+		} else {
+			message = "Fail to spill the result";
+		}
+	}
+	for (size_t i = 0; i < results.size(); i++) {
+		if (results[i].res) {
+			mysql_free_result(results[i].res);
+		}
+	}
+	if (hasResult && statement.conditional
+			&& !hash.compare(statement.hash)) {
+		this->success_queries++;
+		this->sendMessage("NOT_MODIFIED", "T001", "", hash);
+	} else if (hasResult) {
+		this->success_queries++;
+		this->sendFrame(frame, statement.codec);
+	} else if (message.empty()) {
+		// Statements without rows on all the shards;
+		this->success_queries++;
+		this->sendMessage(status, "T001", message);
+	} else {
+		this->failed_queries++;
+		this->sendMessage(status, "F001", message);
+	}
+}
+
+/// Order of two values of a merge, NULL first, numbers by value;
+static int compareValues(const char *a, const char *b) {
+	if (!a || !b) {
+		return a ? 1 : (b ? -1 : 0);
+	}
+	char *a_end = NULL;
+	char *b_end = NULL;
+	double a_number = strtod(a, &a_end);
+	double b_number = strtod(b, &b_end);
+	if (*a && *b && !*a_end && !*b_end) {
+		return a_number < b_number ? -1 : (a_number > b_number ? 1 : 0);
+	}
+	return strcmp(a, b);
+}
+
+bool Client::encodeShards(std::vector<ShardResult> &results, int column,
+		bool descending, SpillBuffer &frame, std::string *hash) {
+	MYSQL_RES *first = NULL;
+	std::vector<MYSQL_ROW> heads(results.size());
+	for (size_t i = 0; i < results.size(); i++) {
+		heads[i] = results[i].res ? mysql_fetch_row(results[i].res) : NULL;
+		if (results[i].res && !first) {
+			first = results[i].res;
+		}
+	}
+	beginRows(frame);
+	std::vector<unsigned int> order;
+	std::vector<std::string> keys;
+	sortColumns(mysql_fetch_fields(first), mysql_num_fields(first), order,
+			keys);
+	// Hashed like one result with the rows in the order sent;
+	unsigned long long value = FnvHash::OFFSET64;
+	for (size_t k = 0; hash && k < keys.size(); k++) {
+		FnvHash::hash64(value, keys[k].data(), keys[k].size());
+	}
+	unsigned long rows = 0;
+	while (true) {
+		// The first shard with rows left, or the head that comes first;
+		int pick = -1;
+		for (size_t i = 0; i < heads.size(); i++) {
+			if (!heads[i]) {
+				continue;
+			}
+			if (pick < 0) {
+				pick = i;
+				if (column < 0) {
+					break;
+				}
+				continue;
+			}
+			int cmp = compareValues(heads[i][column], heads[pick][column]);
+			if (descending ? cmp > 0 : cmp < 0) {
+				pick = i;
+			}
+		}
+		if (pick < 0) {
+			break;
+		}
+		appendRow(frame, order, keys, heads[pick], rows++);
+		if (hash) {
+			hashRow(value, order, heads[pick],
+					mysql_fetch_lengths(results[pick].res));
+		}
+		if ((this->max_result_size && frame.length() > this->max_result_size)
+				|| frame.isFailed()) {
+			return false;
+		}
+		heads[pick] = mysql_fetch_row(results[pick].res);
+	}
+	if (hash) {
+		char hex[17];
+		snprintf(hex, sizeof(hex), "%016llx", value);
+		*hash = hex;
+	}
+	endRows(frame, rows, "", hash ? *hash : "");
+	return !frame.isFailed();
+}
+
+bool Client::encodeCursor(Cursor *cursor, unsigned long rows,
+		SpillBuffer &frame, bool &end) {
+	beginRows(frame);
+	std::vector<unsigned int> order;
+	std::vector<std::string> keys;
+	sortColumns(cursor->getFields(), cursor->getFieldCount(), order, keys);
+	char **row;
+	unsigned long fetched = 0;
+	end = false;
+	while (fetched < rows) {
+		if (!(row = cursor->fetch())) {
+			end = !cursor->isFailed();
+			break;
+		}
+		appendRow(frame, order, keys, row, fetched++);
+		if ((this->max_result_size && frame.length() > this->max_result_size)
+				|| frame.isFailed()) {
+			return false;
+		}
+	}
+	if (cursor->isFailed()) {
+		return false;
+	}
+	endRows(frame, fetched, end ? "End of cursor" : "");
+	return !frame.isFailed();
+}
+
+void Client::doCursorWork(Statement &statement) {
+	std::string status = "SUCCESS";
+	std::string code = "T001";
+	std::string message = "";
+	std::string data = "";
+	Cursor *cursor = NULL;
+	if (Statement::EXPIRE_CURSORS == statement.type) {
+		// Unused for rows seconds, nobody waits for a reply;
+		time_t expired = TimerWheel::now() - (time_t) statement.rows;
+		cursor = this->cursors;
+		while (cursor) {
+			Cursor *next = cursor->next;
+			if (cursor->getUsed() <= expired) {
+				this->closeCursor(cursor);
+			}
+			cursor = next;
+		}
+		return;
+	}
+	if (Statement::CURSOR == statement.type) {
+		this->queries++;
+		DB *db_con = this->db_con;
+		MYSQL_STMT *stmt = NULL;
+		bool entered = false;
+		bool overloaded = false;
+		if (this->cursor_count >= this->max_cursors) {
+			message = "Too many open cursors";
+		} else if (!this->enterBackend(this->db_pool, entered)) {
+			overloaded = true;
+			message = "Backend at its concurrency limit";
+		} else {
+			if (!db_con && this->db_pool) {
+				// Shared mode, the cursor keeps the connection until closed;
+				db_con = this->db_pool->allocHeldDB();
+			}
+		}
+		if (!message.empty()) {
+			// Refused before borrowing a connection;
+		} else if (!db_con) {
+			message = "No connection of the pool left for cursors";
+		} else if (!(stmt = db_con->openCursor(statement.sql,
+				MPOOL_CURSOR_PREFETCH))) {
+			message = db_con->getError();
+		} else {
+			cursor = new Cursor(++this->last_cursor, db_con, stmt,
+					&this->memory);
+			if (cursor->bind()) {
+				cursor->touch(TimerWheel::now());
+				cursor->next = this->cursors;
+				this->cursors = cursor;
+				__atomic_add_fetch(&this->cursor_count, 1, __ATOMIC_RELAXED);
+				std::stringstream ss;
+				ss << cursor->getId();
+				data = ss.str();
+				message = "Cursor opened";
+			} else {
+				message = cursor->getError();
+				delete cursor;
+				cursor = NULL;
+			}
+		}
+		unsigned long long rtt = db_con && entered ? db_con->getRtt() : 0;
+		if (cursor) {
+			this->success_queries++;
+		} else {
+			status = overloaded ? "OVERLOADED" : "FAILED";
+			code = "F001";
+			this->failed_queries++;
+			if (db_con && db_con != this->db_con) {
+				this->db_pool->freeHeldDB(db_con);
+			}
+		}
+		this->leaveBackend(this->db_pool, entered, rtt);
+		this->sendMessage(status, code, message, data);
+		return;
+	}
+	cursor = this->findCursor(statement.cursor);
+	if (!cursor) {
+		this->sendMessage("FAILED", "F001", "Unknown cursor");
+		return;
+	}
+	if (Statement::CLOSE_CURSOR == statement.type) {
+		this->closeCursor(cursor);
+		this->sendMessage(status, code, "Cursor closed");
+		return;
+	}
+	SpillBuffer frame(this->spill_threshold, this->spill_dir, &this->memory);
+	bool end = false;
+	cursor->touch(TimerWheel::now());
+	bool entered;
+	if (!this->enterBackend(this->db_pool, entered)) {
+		// Nothing fetched, the cursor stays where it was;
+		this->sendMessage("OVERLOADED", "F001",
+				"Backend at its concurrency limit");
+		return;
+	}
+	bool encoded = this->encodeCursor(cursor, statement.rows, frame, end);
+	// The fetches are interleaved with the encoding, no sample;
+	this->leaveBackend(this->db_pool, entered, 0);
+	if (encoded) {
+		if (end) {
+			// Exhausted, closed without waiting for cursor_close;
+			this->closeCursor(cursor);
+		}
+		this->sendFrame(frame, statement.codec);
+		return;
+	}
+	// The rows fetched are lost, the cursor cannot be resumed;
+	code = "F001";
+	if (this->max_result_size && frame.length() > this->max_result_size) {
+		status = "RESULT_TOO_LARGE";
+		message = "Result exceeds max_result_size";
+	} else if (cursor->isFailed()) {
+		status = "FAILED";
+		message = cursor->getError();
+	} else {
+		status = "FAILED";
+		message = "Fail to spill the result";
+	}
+	this->closeCursor(cursor);
+	this->sendMessage(status, code, message);
+}
+
+Cursor* Client::findCursor(unsigned long id) {
+	for (Cursor *cursor = this->cursors; cursor; cursor = cursor->next) {
+		if (cursor->getId() == id) {
+			return cursor;
+		}
+	}
+	return NULL;
+}
+
+void Client::closeCursor(Cursor *cursor) {
+	Cursor **link = &this->cursors;
+	while (*link && *link != cursor) {
+		link = &(*link)->next;
+	}
+	if (!*link) {
+		return;
+	}
+	*link = cursor->next;
+	__atomic_sub_fetch(&this->cursor_count, 1, __ATOMIC_RELAXED);
+	DB *db_con = cursor->getDB();
+	delete cursor;
+	if (db_con != this->db_con && this->db_pool) {
+		this->db_pool->freeHeldDB(db_con);
+	}
+}
+
+DB* Client::openReplica(const std::string &gtid, DBPool *&db_pool,
+		bool &entered) {
+	// Without a token the client reads its own last write;
+	const std::string &wait = gtid.empty() ? this->last_gtid : gtid;
+	size_t tries = this->replicas ? this->replicas->size() : 0;
+	for (size_t i = 0; i < tries; i++) {
+		DBPool *replica = this->replicas->pick();
+		if (!replica) {
+			break;
+		}
+		bool begun;
+		this->enterBackend(replica, begun);
+		DB *db_con = replica->allocDB();
+		if (db_con
+				&& (wait.empty()
+						|| this->replicas->waitFor(db_con, wait,
+								i + 1 == tries))) {
+			this->replicas->record(true);
+			db_pool = replica;
+			entered = begun;
+			return db_con;
+		}
+		if (db_con) {
+			replica->freeDB(db_con);
+		}
+		// A probe may wait up to gtid_wait, no sample;
+		this->leaveBackend(replica, begun, 0);
+	}
+	if (this->replicas) {
+		this->replicas->record(false);
+	}
+	return NULL;
+}
+
+bool Client::enterBackend(DBPool *db_pool, bool &entered) {
+	entered = false;
+	if (!db_pool) {
+		return true;
+	}
+	// Other pools are borrowed per statement, their slots hold no locks of
+	// this client;
+	bool session = this->db_con && db_pool == this->db_pool;
+	entered = db_pool->getLimiter()->acquire(session ? MPOOL_LIMIT_WAIT : 0);
+	return entered;
+}
+
+void Client::leaveBackend(DBPool *db_pool, bool entered,
+		unsigned long long rtt) {
+	if (entered) {
+		db_pool->getLimiter()->release(rtt);
+	}
+}
+
+void Client::sendMessage(const std::string &status, const std::string &code,
+		const std::string &message, const std::string &data,
+		const std::string &gtid) {
+	Json::Value root;
 	root["protocol_version"] = MPOOL_PROTOCOL_VERSION;
 	root["status"] = status;
 	root["code"] = code;
 	root["message"] = message;
-	if (!hasResult) {
-		root["data"] = "";
-	} else {
-		root["data"] = data;
+	root["data"] = data;
+	if (!gtid.empty()) {
+		root["gtid"] = gtid;
 	}
-	std::string str = this->jsonWriter->write(root);
+	std::string str = getWriter()->write(root);
 	//Append data length;
 	std::stringstream ss;
 	ss.width(16);
@@ -231,6 +1361,202 @@ void Client::doWork() {
 #ifdef DEBUG
 	std::cout<<str<<std::endl;
 #endif
+	this->sendData(str);
+}
+
+void Client::sendFrame(SpillBuffer &frame, unsigned char codec) {
+	if (this->compressor && this->compressor->accepts(codec, frame)) {
+		// Most frames go as they are, without a buffer for the output;
+		SpillBuffer compressed(this->spill_threshold, this->spill_dir,
+				&this->memory);
+		if (this->compressor->compress(codec, frame, compressed)) {
+			this->sendFrame(compressed, FrameCompressor::NONE);
+			return;
+		}
+	}
+	if (!frame.isSpilled()) {
+		this->sendData(frame.getData());
+	} else if (frame.flush()) {
+		this->sendFile(frame.release(), frame.length());
+	} else {
+		// Lost part of the rows, the client cannot resync the stream;
+		shutdown(this->socket, SHUT_RDWR);
+	}
+}
+
+void Client::doMySQLWork(const std::string &sql) {
+	std::string payload;
+	unsigned char seq = 1;
+	this->queries++;
+	bool entered = false;
+	bool overloaded = sql.find_first_not_of(" \n\r\t") != std::string::npos
+			&& !this->enterBackend(this->db_pool, entered);
+	DB *db_con = this->db_con;
+	if (!db_con && this->db_pool) {
+		db_con = this->db_pool->allocDB();
+	}
+	MYSQL_RES *res = NULL;
+	SpillBuffer frame(this->spill_threshold, this->spill_dir, &this->memory);
+	bool hasResult = false;
+	if (sql.find_first_not_of(" \n\r\t") == std::string::npos) {
+		payload = MySQLProtocol::error(1065, "42000", "Query was empty");
+		this->failed_queries++;
+	} else if (overloaded) {
+		payload = MySQLProtocol::error(1040, "08004",
+				"Backend at its concurrency limit");
+		this->failed_queries++;
+	} else if (!db_con) {
+		payload = MySQLProtocol::error(1040, "08004",
+				"Fail to get connection from the pool");
+		this->failed_queries++;
+	} else if (!db_con->execute(sql, &res, true)) {
+		payload = MySQLProtocol::error(db_con->getErrno(), "HY000",
+				db_con->getError());
+		this->failed_queries++;
+	} else if (!res) {
+		payload = MySQLProtocol::ok(db_con->getAffectedRows(),
+				db_con->getInsertId());
+		this->success_queries++;
+	} else {
+		// Rows are fetched one by one, never all held in memory;
+		hasResult = this->encodeMySQLResult(res, seq, frame)
+				&& !db_con->checkFetch();
+		if (!hasResult && this->max_result_size
+				&& frame.length() > this->max_result_size) {
+			// Stopped at the limit, kill the rest rather than drain it;
+			this->db_pool->killQuery(db_con);
+		}
+		mysql_free_result(res);
+		if (hasResult) {
+			this->success_queries++;
+		} else if (this->max_result_size
+				&& frame.length() > this->max_result_size) {
+			payload = MySQLProtocol::error(1104, "42000",
+					"Result exceeds max_result_size");
+			this->failed_queries++;
+		} else if (db_con->checkFetch()) {
+			payload = MySQLProtocol::error(db_con->getErrno(), "HY000",
+					db_con->getError());
+			this->failed_queries++;
+		} else {
+			payload = MySQLProtocol::error(1041, "HY000",
+					"Fail to spill the result");
+			this->failed_queries++;
+		}
+	}
+	unsigned long long rtt = db_con && entered ? db_con->getRtt() : 0;
+	if (db_con && db_con != this->db_con) {
+		this->db_pool->freeDB(db_con);
+	}
+	this->leaveBackend(this->db_pool, entered, rtt);
+	if (hasResult) {
+		this->sendFrame(frame, FrameCompressor::NONE);
+		return;
+	}
+	// The rows encoded so far are dropped, the error starts the reply;
+	std::string out;
+	seq = 1;
+	MySQLProtocol::appendPacket(out, seq, payload);
+	this->sendData(out);
+}
+
+bool Client::encodeMySQLResult(MYSQL_RES *res, unsigned char &seq,
+		SpillBuffer &frame) {
+	std::string packet;
+	MySQLProtocol::appendColumns(packet, seq, res);
+	frame.append(packet);
+	MYSQL_ROW row;
+	while ((row = mysql_fetch_row(res))) {
+		packet.clear();
+		MySQLProtocol::appendRow(packet, seq, res, row);
+		frame.append(packet);
+		if ((this->max_result_size && frame.length() > this->max_result_size)
+				|| frame.isFailed()) {
+			// The rest is killed or drained by mysql_free_result();
+			return false;
+		}
+	}
+	packet.clear();
+	MySQLProtocol::appendPacket(packet, seq, MySQLProtocol::eof());
+	frame.append(packet);
+	return !frame.isFailed();
+}
+
+void Client::setWire(unsigned char wire) {
+	this->wire = wire;
+}
+
+void Client::setSpill(size_t threshold, const char *dir) {
+	this->spill_threshold = threshold;
+	this->spill_dir = dir;
+}
+
+void Client::setResultLimit(size_t limit) {
+	this->max_result_size = limit;
+}
+
+MemoryAccount* Client::getMemory() {
+	return &this->memory;
+}
+
+void Client::sendFile(int file_fd, size_t length) {
+	if (this->shm) {
+		// The rings live in memory anyway, copy chunk by chunk;
+		std::string chunk;
+		off_t offset = 0;
+		while ((size_t) offset < length) {
+			chunk.resize(
+					length - offset > MPOOL_SPILL_CHUNK ?
+					MPOOL_SPILL_CHUNK : length - offset);
+			ssize_t rv = pread(file_fd, &chunk[0], chunk.size(), offset);
+			if (rv <= 0 || !this->shm->send(chunk.substr(0, rv))) {
+				shutdown(this->socket, SHUT_RDWR);
+				break;
+			}
+			offset += rv;
+		}
+		close(file_fd);
+		return;
+	}
+	if (this->uring) {
+		// Closed by the reactor when sent;
+		this->uring->sendFile(this->socket, file_fd, length);
+		return;
+	}
+	off_t offset = 0;
+	while ((size_t) offset < length) {
+		ssize_t psent = sendfile(this->socket, file_fd, &offset,
+				length - offset);
+		if (-1 == psent) {
+			if ( EAGAIN == errno) {
+				//Sleep a while and try again;
+				usleep(50);
+				continue;
+			}
+			std::cout << "(Client) Send File Error: " << strerror(errno)
+					<< std::endl;
+			shutdown(this->socket, SHUT_RDWR);
+			break;
+		} else if (0 == psent) {
+			break;
+		}
+	}
+	close(file_fd);
+}
+
+void Client::sendData(const std::string &str) {
+	if (this->shm) {
+		if (!this->shm->send(str)) {
+			// The client stopped reading, the reactor closes it;
+			shutdown(this->socket, SHUT_RDWR);
+		}
+		return;
+	}
+	if (this->uring) {
+		// Sent by the reactor in batches;
+		this->uring->send(this->socket, str);
+		return;
+	}
 	ssize_t sent = 0;
 	while (sent < (ssize_t) str.length()) {
 		ssize_t psent = write(this->socket, str.substr(sent).c_str(),
@@ -243,7 +1569,8 @@ void Client::doWork() {
 			} else {
 				std::cout << "(Client) Send Data Error: " << strerror(errno)
 						<< std::endl;
-				close(this->socket);
+				// The reactor closes it, the fd stays reserved until then;
+				shutdown(this->socket, SHUT_RDWR);
 				break;
 			}
 		}
@@ -252,52 +1579,43 @@ void Client::doWork() {
 #ifdef DEBUG
 	std::cout<<"(Client) "<<sent<<"/"<<str.length()<<" has been sent"<<std::endl;
 #endif
-	this->works--;
-	//pthread_mutex_unlock(&this->work_mutex);
-#ifdef DEBUG
-	std::cout<<"(Client)Work done"<<std::endl;
-	std::cout<<"[Client]Pending Works:"<<this->works<<std::endl;
-	std::cout<<"[Client]Queries:"<<this->queries<<std::endl;
-	std::cout<<"[Client]Success:"<<this->success_queries<<std::endl;
-	std::cout<<"[Client]Fail:"<<this->failed_queries<<std::endl;
-#endif
-}
-
-void Client::wait() {
-	pthread_mutex_lock(&this->work_mutex);
-	pthread_mutex_unlock(&this->work_mutex);
 }
 
-bool Client::isTimeout() {
-	time_t now = time(0);
-	if (now - this->last_hb_time > MPOOL_CLIENT_TIMEOUT) {
-		this->setTimeout();
-		return true;
+void Client::done() {
+	pthread_mutex_lock(&this->mutex);
+	this->working = false;
+	this->works--;
+	if (this->limited) {
+		this->rate_limiter->leave();
+		this->limited_works--;
+		this->limited = false;
 	}
-	return false;
+	pthread_mutex_unlock(&this->mutex);
 }
 
-void Client::setTimeout() {
-	if (!this->isBusy()) {
-		pthread_mutex_lock(&this->sql_mutex);
-		while (!this->sqls.empty()) {
-			this->sqls.pop();
-		}
-		pthread_mutex_unlock(&this->sql_mutex);
-		this->last_hb_time = 0;
-	}
+bool Client::isBusy() {
+	pthread_mutex_lock(&this->mutex);
+	bool working = this->working;
+	pthread_mutex_unlock(&this->mutex);
+	return working;
 }
 
-bool Client::isBusy() {
-	if (0 == pthread_mutex_trylock(&this->work_mutex)) {
-		pthread_mutex_unlock(&this->work_mutex);
+bool Client::acquire() {
+	pthread_mutex_lock(&this->mutex);
+	if (this->working) {
+		pthread_mutex_unlock(&this->mutex);
 		return false;
 	}
+	this->working = true;
+	pthread_mutex_unlock(&this->mutex);
 	return true;
 }
 
 unsigned long Client::getWorks() {
-	return this->works;
+	pthread_mutex_lock(&this->mutex);
+	unsigned long works = this->works;
+	pthread_mutex_unlock(&this->mutex);
+	return works;
 }
 
 }
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "include/version.h"
+#include "include/MonotonicClock.h"
+#include "include/ConcurrencyLimiter.h"
+
+namespace MPool {
+
+ConcurrencyLimiter::ConcurrencyLimiter() {
+	this->adaptive = false;
+	this->min_limit = 1;
+	this->max_limit = MPOOL_LIMIT_MAX;
+	this->limit = this->max_limit;
+	this->inflight = 0;
+	this->rtt = 0;
+	this->min_rtt = 0;
+	this->probe_rtt = 0;
+	this->samples = 0;
+	this->waits = 0;
+	pthread_mutex_init(&this->mutex, NULL);
+	pthread_cond_init(&this->cond, NULL);
+}
+
+ConcurrencyLimiter::~ConcurrencyLimiter() {
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->mutex);
+}
+
+void ConcurrencyLimiter::setLimits(bool adaptive, unsigned int min_limit,
+		unsigned int max_limit) {
+	pthread_mutex_lock(&this->mutex);
+	this->adaptive = adaptive;
+	this->min_limit = min_limit ? min_limit : 1;
+	this->max_limit = max_limit < this->min_limit ? this->min_limit : max_limit;
+	// Start wide open, the first samples bring it down when needed;
+	this->limit = this->max_limit;
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+}
+
+bool ConcurrencyLimiter::acquire(unsigned long timeout) {
+	pthread_mutex_lock(&this->mutex);
+	if (this->adaptive && this->inflight >= (unsigned int) this->limit) {
+		this->waits++;
+	}
+	unsigned long long deadline = MonotonicClock::millis() + timeout;
+	while (this->adaptive && this->inflight >= (unsigned int) this->limit) {
+		if (!timeout) {
+			pthread_cond_wait(&this->cond, &this->mutex);
+			continue;
+		}
+		unsigned long long now = MonotonicClock::millis();
+		if (now >= deadline) {
+			pthread_mutex_unlock(&this->mutex);
+			return false;
+		}
+		MonotonicClock::waitFor(&this->cond, &this->mutex, deadline - now);
+	}
+	this->inflight++;
+	pthread_mutex_unlock(&this->mutex);
+	return true;
+}
+
+void ConcurrencyLimiter::release(unsigned long long sample) {
+	pthread_mutex_lock(&this->mutex);
+	unsigned int used = this->inflight--;
+	if (!sample) {
+		// e.g. the statement never reached MySQL;
+		pthread_cond_broadcast(&this->cond);
+		pthread_mutex_unlock(&this->mutex);
+		return;
+	}
+	this->rtt = this->rtt ? this->rtt * 0.9 + sample * 0.1 : sample;
+	if (!this->min_rtt || sample < this->min_rtt) {
+		this->min_rtt = sample;
+	}
+	if (!this->probe_rtt || sample < this->probe_rtt) {
+		this->probe_rtt = sample;
+	}
+	if (++this->samples >= MPOOL_LIMIT_PROBE) {
+		// The backend may have become faster or slower for good;
+		this->min_rtt = this->probe_rtt;
+		this->probe_rtt = 0;
+		this->samples = 0;
+	}
+	if (this->adaptive) {
+		double gradient = MPOOL_LIMIT_TOLERANCE * this->min_rtt / this->rtt;
+		gradient = gradient > 1.0 ? 1.0 : (gradient < 0.5 ? 0.5 : gradient);
+		double target = this->limit * gradient + sqrt(this->limit);
+		if (target > this->limit && used * 2 < this->limit) {
+			// Not using the limit, no evidence that more would help;
+			target = this->limit;
+		}
+		this->limit = this->limit * 0.8 + target * 0.2;
+		if (this->limit < this->min_limit) {
+			this->limit = this->min_limit;
+		} else if (this->limit > this->max_limit) {
+			this->limit = this->max_limit;
+		}
+	}
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+}
+
+unsigned int ConcurrencyLimiter::getLimit() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned int limit = (unsigned int) this->limit;
+	pthread_mutex_unlock(&this->mutex);
+	return limit;
+}
+
+unsigned int ConcurrencyLimiter::getInflight() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned int inflight = this->inflight;
+	pthread_mutex_unlock(&this->mutex);
+	return inflight;
+}
+
+unsigned long long ConcurrencyLimiter::getWaits() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long waits = this->waits;
+	pthread_mutex_unlock(&this->mutex);
+	return waits;
+}
+
+unsigned long long ConcurrencyLimiter::getMinRtt() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long min_rtt = this->min_rtt;
+	pthread_mutex_unlock(&this->mutex);
+	return min_rtt;
+}
+
+unsigned long long ConcurrencyLimiter::getRtt() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long rtt = (unsigned long long) this->rtt;
+	pthread_mutex_unlock(&this->mutex);
+	return rtt;
+}
+
+unsigned long long ConcurrencyLimiter::now() {
+	return MonotonicClock::micros();
+}
+
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <queue>
+#include <list>
+#include <deque>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jsoncpp/json/json.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/IOUring.h"
+#include "include/TimerWheel.h"
+#include "include/ShmChannel.h"
+#include "include/MemoryAccount.h"
+#include "include/Client.h"
+#include "include/ConnectionTable.h"
+
+namespace MPool {
+
+ConnectionTable::ConnectionTable(unsigned long capacity) {
+	this->nslots = capacity ? capacity : 1024;
+	this->slots = (Connection*) calloc(this->nslots, sizeof(Connection));
+	if (!this->slots) {
+		this->nslots = 0;
+	}
+	this->count = 0;
+	this->buffered = 0;
+}
+
+ConnectionTable::~ConnectionTable() {
+	for (unsigned long i = 0; i < this->nslots; i++) {
+		delete this->slots[i].buffer;
+	}
+	free(this->slots);
+}
+
+bool ConnectionTable::grow(int fd) {
+	if (fd < 0) {
+		return false;
+	}
+	if ((unsigned long) fd < this->nslots) {
+		return true;
+	}
+	unsigned long n = this->nslots ? this->nslots : 1024;
+	while (n <= (unsigned long) fd) {
+		n <<= 1;
+	}
+	Connection *slots = (Connection*) realloc(this->slots,
+			n * sizeof(Connection));
+	if (!slots) {
+		return false;
+	}
+	memset(slots + this->nslots, 0, (n - this->nslots) * sizeof(Connection));
+	this->slots = slots;
+	this->nslots = n;
+	return true;
+}
+
+unsigned long long ConnectionTable::open(int fd, unsigned char wire) {
+	if (!this->grow(fd)) {
+		return makeHandle(fd, 0);
+	}
+	Connection *c = &this->slots[fd];
+	if (c->client) {
+		// Should have been closed, forget the stale client;
+		c->client = NULL;
+		this->count--;
+	}
+	this->dropBuffer(c);
+	c->wire = wire;
+	c->generation = (c->generation + 1) & MPOOL_GENERATION_MASK;
+	return makeHandle(fd, c->generation);
+}
+
+void ConnectionTable::close(int fd) {
+	if (fd < 0 || (unsigned long) fd >= this->nslots) {
+		return;
+	}
+	Connection *c = &this->slots[fd];
+	if (c->client) {
+		c->client = NULL;
+		this->count--;
+	}
+	this->dropBuffer(c);
+	c->generation = (c->generation + 1) & MPOOL_GENERATION_MASK;
+}
+
+bool ConnectionTable::isValid(unsigned long long handle) {
+	int fd = getHandleFd(handle);
+	if (fd < 0 || (unsigned long) fd >= this->nslots) {
+		return false;
+	}
+	return this->slots[fd].generation == getHandleGeneration(handle);
+}
+
+Client* ConnectionTable::get(int fd) {
+	if (fd < 0 || (unsigned long) fd >= this->nslots) {
+		return NULL;
+	}
+	return this->slots[fd].client;
+}
+
+void ConnectionTable::attach(int fd, Client *client) {
+	if (!this->grow(fd)) {
+		return;
+	}
+	Connection *c = &this->slots[fd];
+	if (!c->client && client) {
+		this->count++;
+	} else if (c->client && !client) {
+		this->count--;
+	}
+	c->client = client;
+}
+
+unsigned int ConnectionTable::getGeneration(int fd) {
+	if (fd < 0 || (unsigned long) fd >= this->nslots) {
+		return 0;
+	}
+	return this->slots[fd].generation;
+}
+
+unsigned char ConnectionTable::getWire(int fd) {
+	if (fd < 0 || (unsigned long) fd >= this->nslots) {
+		return MPOOL_WIRE_JSON;
+	}
+	return this->slots[fd].wire;
+}
+
+void ConnectionTable::takeBuffer(int fd, std::string &data) {
+	if (fd < 0 || (unsigned long) fd >= this->nslots
+			|| !this->slots[fd].buffer) {
+		return;
+	}
+	Connection *c = &this->slots[fd];
+	this->buffered -= c->buffer->size();
+	c->buffer->append(data);
+	data.swap(*c->buffer);
+	delete c->buffer;
+	c->buffer = NULL;
+}
+
+void ConnectionTable::keepBuffer(int fd, const std::string &data,
+		size_t offset) {
+	if (!this->grow(fd)) {
+		return;
+	}
+	Connection *c = &this->slots[fd];
+	if (!c->buffer) {
+		c->buffer = new std::string();
+	}
+	this->buffered -= c->buffer->size();
+	c->buffer->assign(data, offset, std::string::npos);
+	this->buffered += c->buffer->size();
+}
+
+void ConnectionTable::dropBuffer(Connection *c) {
+	if (c->buffer) {
+		this->buffered -= c->buffer->size();
+		delete c->buffer;
+		c->buffer = NULL;
+	}
+}
+
+unsigned long long ConnectionTable::getBuffered() {
+	return this->buffered;
+}
+
+unsigned long ConnectionTable::size() {
+	return this->count;
+}
+
+unsigned long ConnectionTable::capacity() {
+	return this->nslots;
+}
+
+unsigned long long ConnectionTable::makeHandle(int fd,
+		unsigned int generation) {
+	return ((unsigned long long) generation << 32) | (unsigned int) fd;
+}
+
+int ConnectionTable::getHandleFd(unsigned long long handle) {
+	return (int) (handle & 0xffffffff);
+}
+
+unsigned int ConnectionTable::getHandleGeneration(unsigned long long handle) {
+	return (unsigned int) (handle >> 32);
+}
+
+}
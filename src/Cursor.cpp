@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <iostream>
+#include <string.h>
+#include <pthread.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/MemoryAccount.h"
+#include "include/Cursor.h"
+
+namespace MPool {
+
+Cursor::Cursor(unsigned long id, DB *db, MYSQL_STMT *stmt,
+		MemoryAccount *account) {
+	this->id = id;
+	this->db = db;
+	this->stmt = stmt;
+	this->meta = NULL;
+	this->account = account;
+	this->held = 0;
+	this->failed = false;
+	this->used = 0;
+	this->next = NULL;
+}
+
+Cursor::~Cursor() {
+	if (this->meta) {
+		mysql_free_result(this->meta);
+	}
+	if (this->stmt) {
+		// The server drops the rows left, nothing is read back;
+		mysql_stmt_close(this->stmt);
+	}
+	if (this->account) {
+		this->account->sub(MemoryAccount::RESULT, this->held);
+	}
+}
+
+bool Cursor::bind() {
+	this->meta = mysql_stmt_result_metadata(this->stmt);
+	if (!this->meta) {
+		this->error = "Statement returns no rows";
+		return false;
+	}
+	unsigned int fields = mysql_num_fields(this->meta);
+	MYSQL_FIELD *field_list = mysql_fetch_fields(this->meta);
+	this->binds.resize(fields);
+	this->buffers.resize(fields);
+	this->lengths.resize(fields);
+	this->nulls.resize(fields);
+	this->row.resize(fields);
+	memset(&this->binds[0], 0, fields * sizeof(MYSQL_BIND));
+	for (unsigned int i = 0; i < fields; i++) {
+		// Sized for the column, TEXT & BLOB grow when a value is truncated;
+		size_t size = field_list[i].length + 1;
+		if (size > MPOOL_CURSOR_BUFFER) {
+			size = MPOOL_CURSOR_BUFFER;
+		}
+		this->resize(i, size);
+		this->binds[i].buffer_type = MYSQL_TYPE_STRING;
+		this->binds[i].length = &this->lengths[i];
+		this->binds[i].is_null = &this->nulls[i];
+	}
+	if (mysql_stmt_bind_result(this->stmt, &this->binds[0])) {
+		this->error = mysql_stmt_error(this->stmt);
+		return false;
+	}
+	return true;
+}
+
+void Cursor::resize(unsigned int column, size_t size) {
+	if (this->account) {
+		this->account->add(MemoryAccount::RESULT, size);
+		this->account->sub(MemoryAccount::RESULT,
+				this->buffers[column].size());
+	}
+	this->held += size;
+	this->held -= this->buffers[column].size();
+	this->buffers[column].resize(size);
+	// One byte is kept for the terminating NUL;
+	this->binds[column].buffer = &this->buffers[column][0];
+	this->binds[column].buffer_length = size - 1;
+}
+
+char** Cursor::fetch() {
+	int rv = mysql_stmt_fetch(this->stmt);
+	if (MYSQL_NO_DATA == rv) {
+		return NULL;
+	}
+	if (0 != rv && MYSQL_DATA_TRUNCATED != rv) {
+		this->failed = true;
+		this->error = mysql_stmt_error(this->stmt);
+		return NULL;
+	}
+	bool rebind = false;
+	for (unsigned int i = 0; i < this->binds.size(); i++) {
+		if (this->nulls[i]) {
+			this->row[i] = NULL;
+			continue;
+		}
+		if (this->lengths[i] > this->binds[i].buffer_length) {
+			// Truncated, read the whole value into a larger buffer;
+			this->resize(i, this->lengths[i] + 1);
+			if (mysql_stmt_fetch_column(this->stmt, &this->binds[i], i, 0)) {
+				this->failed = true;
+				this->error = mysql_stmt_error(this->stmt);
+				return NULL;
+			}
+			rebind = true;
+		}
+		this->buffers[i][this->lengths[i]] = '\0';
+		this->row[i] = &this->buffers[i][0];
+	}
+	if (rebind && mysql_stmt_bind_result(this->stmt, &this->binds[0])) {
+		this->failed = true;
+		this->error = mysql_stmt_error(this->stmt);
+		return NULL;
+	}
+	return &this->row[0];
+}
+
+bool Cursor::isFailed() {
+	return this->failed;
+}
+
+std::string Cursor::getError() {
+	return this->error;
+}
+
+MYSQL_FIELD* Cursor::getFields() {
+	return mysql_fetch_fields(this->meta);
+}
+
+unsigned int Cursor::getFieldCount() {
+	return mysql_num_fields(this->meta);
+}
+
+unsigned long Cursor::getId() {
+	return this->id;
+}
+
+DB* Cursor::getDB() {
+	return this->db;
+}
+
+void Cursor::touch(time_t now) {
+	this->used = now;
+}
+
+time_t Cursor::getUsed() {
+	return this->used;
+}
+
+}
@@ -29,20 +29,57 @@
 #include <vector>
 #include <map>
 #include <exception>
+#include <stdio.h>
 #include <pthread.h>
+#include <syslog.h>
 #include <my_global.h>
 #include <mysql.h>
+#include <errmsg.h>
 #include "include/version.h"
 #include "include/DBPool.h"
+#include "include/ConcurrencyLimiter.h"
 
 namespace MPool {
+/**
+ * @brief Local infile handler of every connection
+ * Only a loadLocal() source is read, a LOAD DATA LOCAL INFILE sent as a
+ * query must not read the files of the proxy.
+ * */
+static int localInit(void **ptr, const char *filename, void *db) {
+	*ptr = db;
+	return 0;
+}
+
+static int localRead(void *ptr, char *buffer, unsigned int length) {
+	return ((DB*) ptr)->readLocal(buffer, length);
+}
+
+static void localEnd(void *ptr) {
+}
+
+static int localError(void *ptr, char *message, unsigned int length) {
+	snprintf(message, length, "%s",
+			((DB*) ptr)->hasLocal() ?
+					"Bulk load aborted" :
+					"LOAD DATA LOCAL is only allowed through bulk_load");
+	return CR_UNKNOWN_ERROR;
+}
+
 DB::DB(unsigned long id, MYSQL *conn) {
 	this->real_conn = conn;
 	this->db_errno = 0;
 	this->db_error = "";
 	this->affected_rows = 0;
+	this->insert_id = 0;
+	this->rtt = 0;
+	this->local_read = NULL;
+	this->local_source = NULL;
 	this->id = id;
 	pthread_mutex_init(&this->mutex, NULL);
+	if (conn) {
+		mysql_set_local_infile_handler(conn, localInit, localRead, localEnd,
+				localError, this);
+	}
 }
 DB::~DB() {
 	mysql_close(this->real_conn);
@@ -121,6 +158,149 @@ DBResult* DB::query(std::string sql) {
 	pthread_mutex_unlock(&this->mutex);
 	return result;
 }
+bool DB::loadLocal(const std::string &sql,
+		int (*read)(void *source, char *buffer, unsigned int length),
+		void *source) {
+	MYSQL_RES *res = NULL;
+	this->local_read = read;
+	this->local_source = source;
+	bool loaded = this->execute(sql, &res);
+	this->local_read = NULL;
+	this->local_source = NULL;
+	if (res) {
+		mysql_free_result(res);
+	}
+	return loaded;
+}
+
+bool DB::hasLocal() {
+	return NULL != this->local_read;
+}
+
+int DB::readLocal(char *buffer, unsigned int length) {
+	return this->local_read ?
+			this->local_read(this->local_source, buffer, length) : -1;
+}
+
+bool DB::execute(const std::string &sql, MYSQL_RES **res, bool stream) {
+	*res = NULL;
+	if (!this->real_conn) {
+		return false;
+	}
+	pthread_mutex_lock(&this->mutex);
+	this->db_errno = 0;
+	this->db_error = "";
+	this->rtt = 0;
+	if (0 != mysql_ping(this->real_conn)) {
+		this->db_errno = mysql_errno(this->real_conn);
+		this->db_error = mysql_error(this->real_conn);
+		pthread_mutex_unlock(&this->mutex);
+		return false;
+	}
+	unsigned long long sent = ConcurrencyLimiter::now();
+	if (0 != mysql_real_query(this->real_conn, sql.data(), sql.length())) {
+		this->db_errno = mysql_errno(this->real_conn);
+		this->db_error = mysql_error(this->real_conn);
+		pthread_mutex_unlock(&this->mutex);
+		return false;
+	}
+	*res = stream ?
+			mysql_use_result(this->real_conn) :
+			mysql_store_result(this->real_conn);
+	this->rtt = ConcurrencyLimiter::now() - sent + 1;
+	if (!*res && 0 != mysql_field_count(this->real_conn)) {
+		// Should have returned rows;
+		this->db_errno = mysql_errno(this->real_conn);
+		this->db_error = mysql_error(this->real_conn);
+		pthread_mutex_unlock(&this->mutex);
+		return false;
+	}
+	this->affected_rows = mysql_affected_rows(this->real_conn);
+	this->insert_id = mysql_insert_id(this->real_conn);
+	// Set by the OK packet of a commit when session_track_gtids is on;
+	const char *data = NULL;
+	size_t length = 0;
+	this->gtid.clear();
+	if (!*res
+			&& 0 == mysql_session_track_get_first(this->real_conn,
+					SESSION_TRACK_GTIDS, &data, &length)) {
+		this->gtid.assign(data, length);
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return true;
+}
+
+std::string DB::getGtid() {
+	return this->gtid;
+}
+
+bool DB::trackGtids() {
+	static const char sql[] = "SET SESSION session_track_gtids = OWN_GTID";
+	pthread_mutex_lock(&this->mutex);
+	bool ok = 0 == mysql_real_query(this->real_conn, sql, sizeof(sql) - 1);
+	pthread_mutex_unlock(&this->mutex);
+	return ok;
+}
+
+MYSQL_STMT* DB::openCursor(const std::string &sql, unsigned long prefetch) {
+	if (!this->real_conn) {
+		return NULL;
+	}
+	pthread_mutex_lock(&this->mutex);
+	this->db_errno = 0;
+	this->db_error = "";
+	this->rtt = 0;
+	unsigned long long sent = ConcurrencyLimiter::now();
+	MYSQL_STMT *stmt = NULL;
+	// No mysql_ping(), a reconnect would silently drop the other
+	// statements of the connection, e.g. cursors already open;
+	if (!(stmt = mysql_stmt_init(this->real_conn))) {
+		this->db_errno = mysql_errno(this->real_conn);
+		this->db_error = mysql_error(this->real_conn);
+		pthread_mutex_unlock(&this->mutex);
+		return NULL;
+	}
+	unsigned long type = CURSOR_TYPE_READ_ONLY;
+	if (0 != mysql_stmt_prepare(stmt, sql.data(), sql.length())
+			|| mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &type)
+			|| mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &prefetch)
+			|| 0 != mysql_stmt_execute(stmt)) {
+		this->db_errno = mysql_stmt_errno(stmt);
+		this->db_error = mysql_stmt_error(stmt);
+		mysql_stmt_close(stmt);
+		pthread_mutex_unlock(&this->mutex);
+		return NULL;
+	}
+	this->rtt = ConcurrencyLimiter::now() - sent + 1;
+	pthread_mutex_unlock(&this->mutex);
+	return stmt;
+}
+
+unsigned long long DB::getRtt() {
+	return this->rtt;
+}
+
+unsigned long DB::getThreadId() {
+	return this->real_conn ? mysql_thread_id(this->real_conn) : 0;
+}
+
+bool DB::checkFetch() {
+	this->db_errno = mysql_errno(this->real_conn);
+	if (!this->db_errno) {
+		return false;
+	}
+	this->db_error = mysql_error(this->real_conn);
+	return true;
+}
+
+unsigned long long DB::getAffectedRows() {
+	return this->affected_rows;
+}
+
+unsigned long long DB::getInsertId() {
+	return this->insert_id;
+}
+
 void DB::freeResult(DBResult *result) {
 	if (!result) {
 		return;
@@ -135,6 +315,11 @@ DBPool::DBPool() {
 	this->port = 0;
 	this->min_alives = 4;
 	this->current_id = 0;
+	this->limiter = new ConcurrencyLimiter();
+	this->hits = 0;
+	this->misses = 0;
+	this->track_gtids = false;
+	this->held = 0;
 	pthread_mutex_init(&this->mutex, NULL);
 	if (-1 == mysql_library_init(0, NULL, NULL)) {
 		//Throw Exception;
@@ -144,6 +329,7 @@ DBPool::~DBPool() {
 	this->doCleanWorks();
 	mysql_thread_end();
 	mysql_library_end();
+	delete this->limiter;
 	pthread_mutex_destroy(&this->mutex);
 }
 void DBPool::doCleanWorks() {
@@ -164,24 +350,26 @@ void DBPool::doCleanWorks() {
 	}
 }
 DB* DBPool::allocDB() {
+	// Workers borrow connections concurrently in shared mode;
+	pthread_mutex_lock(&this->mutex);
 	if (!this->idle.empty()) {
-		pthread_mutex_lock(&this->mutex);
-		DB *db = this->idle.front();
-		this->idle.erase(this->idle.begin());
-		this->busy.push_back(db);
-		pthread_mutex_unlock(&this->mutex);
-		return db;
-	} else {
-		DB *db = this->newDB();
-		if (!db) {
-			return NULL;
-		}
-		pthread_mutex_lock(&this->mutex);
+		DB *db = this->idle.back();
+		this->idle.pop_back();
 		this->busy.push_back(db);
+		this->hits++;
 		pthread_mutex_unlock(&this->mutex);
 		return db;
 	}
-	return NULL;
+	this->misses++;
+	pthread_mutex_unlock(&this->mutex);
+	DB *db = this->newDB();
+	if (!db) {
+		return NULL;
+	}
+	pthread_mutex_lock(&this->mutex);
+	this->busy.push_back(db);
+	pthread_mutex_unlock(&this->mutex);
+	return db;
 }
 void DBPool::freeDB(DB *db) {
 	if (!db) {
@@ -190,48 +378,67 @@ void DBPool::freeDB(DB *db) {
 #ifdef DEBUG
 	std::cout<<"(DB Pool)Starting free DB:"<<db->getId()<<std::endl;
 #endif
-	if (!this->busy.empty()) {
-		for (std::vector<MPool::DB*>::iterator it = this->busy.begin();
-				it != this->busy.end(); it++) {
-			if (db->getId() == (*it)->getId()) {
-				pthread_mutex_lock(&this->mutex);
-#ifdef DEBUG
-				std::cout<<"(DB Pool)Removing DB from busy pool:"<<db->getId()<<std::endl;
-#endif
-				this->busy.erase(it);
+	pthread_mutex_lock(&this->mutex);
+	for (std::vector<MPool::DB*>::iterator it = this->busy.begin();
+			it != this->busy.end(); it++) {
+		if (db->getId() == (*it)->getId()) {
 #ifdef DEBUG
-				std::cout<<"(DB Pool)Done"<<std::endl;
+			std::cout<<"(DB Pool)Removing DB from busy pool:"<<db->getId()<<std::endl;
 #endif
-				pthread_mutex_unlock(&this->mutex);
-				break;
-			}
+			this->busy.erase(it);
+			break;
 		}
 	}
 	if (this->idle.size() < this->min_alives) {
-		pthread_mutex_lock(&this->mutex);
 #ifdef DEBUG
 		std::cout<<"(DB Pool)Put it into idle pool:"<<db->getId()<<std::endl;
 #endif
 		this->idle.push_back(db);
-#ifdef DEBUG
-		std::cout<<"(DB Pool)Done"<<std::endl;
-#endif
 		pthread_mutex_unlock(&this->mutex);
 	} else {
+		pthread_mutex_unlock(&this->mutex);
 #ifdef DEBUG
 		std::cout<<"(DB Pool)Active alive is greater than "<<this->min_alives<<", free it:"<<db->getId()<<std::endl;
 #endif
 		delete db;
+	}
 #ifdef DEBUG
-		std::cout<<"(DB Pool)Done"<<std::endl;
+	std::cout<<"(DB Pool)Done"<<std::endl;
 #endif
+}
+DB* DBPool::allocHeldDB() {
+	pthread_mutex_lock(&this->mutex);
+	if (this->held >= (this->min_alives > 1 ? this->min_alives / 2 : 1)) {
+		pthread_mutex_unlock(&this->mutex);
+		return NULL;
+	}
+	this->held++;
+	pthread_mutex_unlock(&this->mutex);
+	DB *db = this->allocDB();
+	if (!db) {
+		pthread_mutex_lock(&this->mutex);
+		this->held--;
+		pthread_mutex_unlock(&this->mutex);
 	}
+	return db;
+}
+void DBPool::freeHeldDB(DB *db) {
+	if (!db) {
+		return;
+	}
+	pthread_mutex_lock(&this->mutex);
+	this->held--;
+	pthread_mutex_unlock(&this->mutex);
+	this->freeDB(db);
 }
 DB* DBPool::newDB() {
 	MYSQL *conn = mysql_init(NULL);
 	if (!conn) {
 		return NULL;
 	}
+	// Guarded by the local infile handler of DB, before the handshake;
+	unsigned int local_infile = 1;
+	mysql_options(conn, MYSQL_OPT_LOCAL_INFILE, &local_infile);
 	if (!mysql_real_connect(conn, this->host.c_str(), this->user.c_str(),
 			this->pass.c_str(), this->database.c_str(), this->port,
 			NULL, 0)) {
@@ -255,6 +462,11 @@ DB* DBPool::newDB() {
 		return NULL;
 	}
 	db->setId((unsigned long) db);
+	if (this->track_gtids && !db->trackGtids()) {
+		// e.g. before MySQL 5.7.6, writes then return no token;
+		syslog(LOG_WARNING, "Cannot enable session_track_gtids on %s",
+				this->host.c_str());
+	}
 	return db;
 }
 bool DBPool::start(std::string host, std::string user, std::string pass,
@@ -277,8 +489,36 @@ bool DBPool::start(std::string host, std::string user, std::string pass,
 void DBPool::setMinAlives(unsigned int ma) {
 	this->min_alives = ma;
 }
+void DBPool::setTrackGtids(bool track_gtids) {
+	this->track_gtids = track_gtids;
+}
 unsigned int DBPool::getMinAlives() {
 	return this->min_alives;
 }
+ConcurrencyLimiter* DBPool::getLimiter() {
+	return this->limiter;
+}
+unsigned long long DBPool::getHits() {
+	return this->hits;
+}
+unsigned long long DBPool::getMisses() {
+	return this->misses;
+}
+bool DBPool::killQuery(DB *db) {
+	unsigned long thread_id = db->getThreadId();
+	DB *killer = thread_id ? this->allocDB() : NULL;
+	if (!killer) {
+		return false;
+	}
+	std::stringstream ss;
+	ss << "KILL QUERY " << thread_id;
+	MYSQL_RES *res = NULL;
+	bool killed = killer->execute(ss.str(), &res);
+	if (res) {
+		mysql_free_result(res);
+	}
+	this->freeDB(killer);
+	return killed;
+}
 }
 
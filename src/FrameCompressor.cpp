@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "include/version.h"
+#include "include/MemoryAccount.h"
+#include "include/SpillBuffer.h"
+#include "include/MonotonicClock.h"
+#include "include/FrameCompressor.h"
+
+namespace MPool {
+
+/// Bytes of the length header of a frame;
+static const size_t header_size = 16;
+
+FrameCompressor::FrameCompressor() {
+	this->threshold = MPOOL_COMPRESS_THRESHOLD;
+	this->level = MPOOL_COMPRESS_LEVEL;
+	this->frames = 0;
+	this->bytes_in = 0;
+	this->bytes_out = 0;
+	this->time = 0;
+	pthread_mutex_init(&this->mutex, NULL);
+}
+
+FrameCompressor::~FrameCompressor() {
+	pthread_mutex_destroy(&this->mutex);
+}
+
+void FrameCompressor::setLimits(size_t threshold, int level) {
+	this->threshold = threshold;
+	this->level = level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION ?
+			MPOOL_COMPRESS_LEVEL : level;
+}
+
+unsigned char FrameCompressor::parseCodec(const std::string &name) {
+	// No LZ4 in the build, those clients get the frames as they are;
+	return strcasecmp(name.c_str(), "zlib") ?
+			FrameCompressor::NONE : FrameCompressor::ZLIB;
+}
+
+bool FrameCompressor::accepts(unsigned char codec, SpillBuffer &frame) {
+	return FrameCompressor::ZLIB == codec && !frame.isFailed()
+			&& frame.length() >= header_size + this->threshold;
+}
+
+bool FrameCompressor::compress(unsigned char codec, SpillBuffer &frame,
+		SpillBuffer &out) {
+	if (!this->accepts(codec, frame)) {
+		return false;
+	}
+	unsigned long long started = MonotonicClock::micros();
+	bool done = this->deflateFrame(frame, out);
+	unsigned long long spent = MonotonicClock::micros() - started;
+	pthread_mutex_lock(&this->mutex);
+	this->time += spent;
+	if (done) {
+		this->frames++;
+		this->bytes_in += frame.length() - header_size;
+		this->bytes_out += out.length() - header_size;
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return done;
+}
+
+bool FrameCompressor::deflateFrame(SpillBuffer &frame, SpillBuffer &out) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (Z_OK != deflateInit(&stream, this->level)) {
+		return false;
+	}
+	std::string input(MPOOL_COMPRESS_CHUNK, '\0');
+	std::string output(MPOOL_COMPRESS_CHUNK, '\0');
+	out.append(std::string(header_size, ' '));
+	size_t offset = header_size;
+	int flush = Z_NO_FLUSH;
+	int rv = Z_OK;
+	while (Z_STREAM_END != rv) {
+		if (!stream.avail_in && Z_FINISH != flush) {
+			size_t length = frame.read(offset, &input[0], input.size());
+			if (!length) {
+				// I/O error on the spill file;
+				break;
+			}
+			offset += length;
+			stream.next_in = (Bytef*) &input[0];
+			stream.avail_in = length;
+			flush = offset < frame.length() ? Z_NO_FLUSH : Z_FINISH;
+		}
+		stream.next_out = (Bytef*) &output[0];
+		stream.avail_out = output.size();
+		rv = deflate(&stream, flush);
+		if (Z_STREAM_ERROR == rv) {
+			break;
+		}
+		out.append(output.data(), output.size() - stream.avail_out);
+		if (out.isFailed() || out.length() >= frame.length()) {
+			// Not worth it, e.g. already compressed blobs;
+			break;
+		}
+	}
+	deflateEnd(&stream);
+	if (Z_STREAM_END != rv) {
+		return false;
+	}
+	char header[32];
+	snprintf(header, sizeof(header), "z%15lu",
+			(unsigned long) (out.length() - header_size));
+	return out.patch(0, header) && !out.isFailed();
+}
+
+unsigned long long FrameCompressor::getFrames() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long frames = this->frames;
+	pthread_mutex_unlock(&this->mutex);
+	return frames;
+}
+
+unsigned long long FrameCompressor::getBytesIn() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long bytes = this->bytes_in;
+	pthread_mutex_unlock(&this->mutex);
+	return bytes;
+}
+
+unsigned long long FrameCompressor::getBytesOut() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long bytes = this->bytes_out;
+	pthread_mutex_unlock(&this->mutex);
+	return bytes;
+}
+
+unsigned long long FrameCompressor::getTime() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long spent = this->time;
+	pthread_mutex_unlock(&this->mutex);
+	return spent;
+}
+
+}
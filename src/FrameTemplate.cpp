@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include "include/FrameTemplate.h"
+
+#define MPOOL_SLOT_MARKER "@mpool_slot_"
+
+namespace MPool {
+
+std::string FrameTemplate::slot(unsigned int i) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), MPOOL_SLOT_MARKER "%u@", i);
+	return buf;
+}
+
+std::string FrameTemplate::frame(const std::string &json) {
+	char head[32];
+	snprintf(head, sizeof(head), "%16lu", (unsigned long) json.length());
+	std::string str;
+	str.reserve(16 + json.length());
+	str += head;
+	str += json;
+	return str;
+}
+
+void FrameTemplate::compile(const std::string &json) {
+	this->segments.clear();
+	this->slots.clear();
+	const std::string marker = MPOOL_SLOT_MARKER;
+	size_t start = 0;
+	size_t pos = 0;
+	while (std::string::npos != (pos = json.find(marker, pos))) {
+		size_t end = json.find('@', pos + marker.length());
+		if (std::string::npos == end) {
+			break;
+		}
+		unsigned int i = atoi(
+				json.substr(pos + marker.length(),
+						end - pos - marker.length()).c_str());
+		// Drop the quotes, escaped when nested in a string value;
+		size_t from = pos;
+		size_t to = end + 1;
+		if (from >= 2 && !json.compare(from - 2, 2, "\\\"")
+				&& !json.compare(to, 2, "\\\"")) {
+			from -= 2;
+			to += 2;
+		} else if (from >= 1 && '"' == json[from - 1] && '"' == json[to]) {
+			from -= 1;
+			to += 1;
+		}
+		this->segments.push_back(json.substr(start, from - start));
+		this->slots.push_back(i);
+		start = to;
+		pos = to;
+	}
+	this->segments.push_back(json.substr(start));
+}
+
+std::string FrameTemplate::render(
+		const std::vector<unsigned long long> &values) {
+	std::string json;
+	json.reserve(this->segments.front().length() * 2);
+	for (size_t i = 0; i < this->segments.size(); i++) {
+		json += this->segments[i];
+		if (i < this->slots.size()) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%llu",
+					this->slots[i] < values.size() ?
+							values[this->slots[i]] : 0ULL);
+			json += buf;
+		}
+	}
+	return frame(json);
+}
+
+bool FrameTemplate::isEmpty() {
+	return this->segments.empty();
+}
+
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#ifdef MPOOL_HAVE_URING
+#include <liburing.h>
+#endif
+#include "include/version.h"
+#include "include/IOUring.h"
+
+namespace MPool {
+
+/**
+ * @brief A queued or in flight send
+ * The SQE references data until the completion arrives, so it is kept out of
+ * the outbound queue. user_data is the pointer itself, its low bits are 0.
+ * */
+class SendOp {
+public:
+	SendOp(int fd);
+	~SendOp();
+	/// Read the next chunk of the file into data, false when it fails
+	bool fill();
+	int fd; /// -1 when the socket has been forgotten
+	std::string data;
+	size_t sent;
+	int file_fd; /// Spill file sent in chunks, -1 for plain data
+	size_t file_length;
+	size_t file_offset;
+};
+
+SendOp::SendOp(int fd) {
+	this->fd = fd;
+	this->sent = 0;
+	this->file_fd = -1;
+	this->file_length = 0;
+	this->file_offset = 0;
+}
+
+SendOp::~SendOp() {
+	if (-1 != this->file_fd) {
+		close(this->file_fd);
+	}
+}
+
+bool SendOp::fill() {
+	size_t length = this->file_length - this->file_offset;
+	if (length > MPOOL_SPILL_CHUNK) {
+		length = MPOOL_SPILL_CHUNK;
+	}
+	this->data.resize(length);
+	this->sent = 0;
+	ssize_t rv = pread(this->file_fd, &this->data[0], length,
+			this->file_offset);
+	if (rv <= 0) {
+		this->data.clear();
+		return false;
+	}
+	this->data.resize(rv);
+	this->file_offset += rv;
+	return true;
+}
+
+#ifdef MPOOL_HAVE_URING
+/// Operation tags, stored in the low 3 bits of user_data
+#define MPOOL_URING_OP_ACCEPT 0x01
+#define MPOOL_URING_OP_RECV 0x02
+#define MPOOL_URING_OP_WAKE 0x03
+#define MPOOL_URING_OP_CANCEL 0x04
+#define MPOOL_URING_OP_POLL 0x05
+#define MPOOL_URING_BUFFER_GROUP 0x01
+
+/// | generation (29 bits) | fd (32 bits) | op (3 bits) |
+static unsigned long long makeUserData(int op, int fd,
+		unsigned int generation = 0) {
+	return ((unsigned long long) (generation & 0x1fffffff) << 35)
+			| ((unsigned long long) (unsigned int) fd << 3) | op;
+}
+#endif
+
+IOUring::IOUring() {
+	this->ring = NULL;
+	this->buf_ring = NULL;
+	this->buffers = NULL;
+	this->nbuffers = 0;
+	this->buffer_size = 0;
+	this->wake_fd = -1;
+	this->wake_value = 0;
+	this->pending = 0;
+	pthread_mutex_init(&this->mutex, NULL);
+}
+
+IOUring::~IOUring() {
+#ifdef MPOOL_HAVE_URING
+	if (this->ring) {
+		if (this->buf_ring) {
+			io_uring_free_buf_ring(this->ring, this->buf_ring, this->nbuffers,
+			MPOOL_URING_BUFFER_GROUP);
+		}
+		io_uring_queue_exit(this->ring);
+		delete this->ring;
+	}
+	for (std::map<int, SendOp*>::iterator it = this->inflight.begin();
+			it != this->inflight.end(); it++) {
+		delete it->second;
+	}
+#endif
+	for (std::map<int, std::deque<SendOp*> >::iterator it =
+			this->outbound.begin(); it != this->outbound.end(); it++) {
+		for (std::deque<SendOp*>::iterator dit = it->second.begin();
+				dit != it->second.end(); dit++) {
+			delete *dit;
+		}
+	}
+	for (std::vector<int>::iterator it = this->lingering.begin();
+			it != this->lingering.end(); it++) {
+		close(*it);
+	}
+	if (-1 != this->wake_fd) {
+		close(this->wake_fd);
+	}
+	free(this->buffers);
+	pthread_mutex_destroy(&this->mutex);
+}
+
+bool IOUring::isSupported() {
+#ifdef MPOOL_HAVE_URING
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IOUring::init(unsigned int entries, unsigned int buffers,
+		unsigned int buffer_size) {
+#ifdef MPOOL_HAVE_URING
+	// The buffer ring size must be a power of 2;
+	if (!buffers || (buffers & (buffers - 1)) || buffers > 32768
+			|| !buffer_size) {
+		return false;
+	}
+	this->ring = new struct io_uring;
+	memset(this->ring, 0, sizeof(struct io_uring));
+	if (0 != io_uring_queue_init(entries, this->ring, 0)) {
+		delete this->ring;
+		this->ring = NULL;
+		return false;
+	}
+	this->nbuffers = buffers;
+	this->buffer_size = buffer_size;
+	this->buffers = (char*) malloc((size_t) buffers * buffer_size);
+	if (!this->buffers) {
+		return false;
+	}
+	int ret = 0;
+	// Provided buffer rings need Linux 5.19, multishot recv 6.0;
+	this->buf_ring = io_uring_setup_buf_ring(this->ring, buffers,
+	MPOOL_URING_BUFFER_GROUP, 0, &ret);
+	if (!this->buf_ring) {
+#ifdef DEBUG
+		std::cout<<"(IOUring)Cannot register buffer ring: "<<strerror(-ret)<<std::endl;
+#endif
+		return false;
+	}
+	for (unsigned int i = 0; i < buffers; i++) {
+		io_uring_buf_ring_add(this->buf_ring, this->buffers + i * buffer_size,
+				buffer_size, i, io_uring_buf_ring_mask(buffers), i);
+	}
+	io_uring_buf_ring_advance(this->buf_ring, buffers);
+	this->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (-1 == this->wake_fd) {
+		return false;
+	}
+	this->armWake();
+	return true;
+#else
+	return false;
+#endif
+}
+
+struct io_uring_sqe* IOUring::getSqe() {
+#ifdef MPOOL_HAVE_URING
+	struct io_uring_sqe *sqe = io_uring_get_sqe(this->ring);
+	if (!sqe) {
+		// Submission queue is full, flush it;
+		io_uring_submit(this->ring);
+		sqe = io_uring_get_sqe(this->ring);
+	}
+	return sqe;
+#else
+	return NULL;
+#endif
+}
+
+void IOUring::armWake() {
+#ifdef MPOOL_HAVE_URING
+	struct io_uring_sqe *sqe = this->getSqe();
+	if (!sqe) {
+		return;
+	}
+	io_uring_prep_read(sqe, this->wake_fd, &this->wake_value,
+			sizeof(this->wake_value), 0);
+	io_uring_sqe_set_data64(sqe, makeUserData(MPOOL_URING_OP_WAKE, 0));
+#endif
+}
+
+void IOUring::accept(int fd) {
+#ifdef MPOOL_HAVE_URING
+	struct io_uring_sqe *sqe = this->getSqe();
+	if (!sqe) {
+		return;
+	}
+	io_uring_prep_multishot_accept(sqe, fd, NULL, NULL, 0);
+	io_uring_sqe_set_data64(sqe, makeUserData(MPOOL_URING_OP_ACCEPT, fd));
+#endif
+}
+
+void IOUring::recv(int fd, unsigned int generation) {
+#ifdef MPOOL_HAVE_URING
+	struct io_uring_sqe *sqe = this->getSqe();
+	if (!sqe) {
+		return;
+	}
+	io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = MPOOL_URING_BUFFER_GROUP;
+	io_uring_sqe_set_data64(sqe,
+			makeUserData(MPOOL_URING_OP_RECV, fd, generation));
+#endif
+}
+
+void IOUring::poll(int polled_fd, int fd, unsigned int generation) {
+#ifdef MPOOL_HAVE_URING
+	struct io_uring_sqe *sqe = this->getSqe();
+	if (!sqe) {
+		return;
+	}
+	io_uring_prep_poll_add(sqe, polled_fd, POLLIN);
+	io_uring_sqe_set_data64(sqe,
+			makeUserData(MPOOL_URING_OP_POLL, fd, generation));
+#endif
+}
+
+void IOUring::send(int fd, const std::string &data) {
+	if (data.empty()) {
+		return;
+	}
+	SendOp *op = new SendOp(fd);
+	op->data = data;
+	this->queue(op);
+}
+
+void IOUring::sendFile(int fd, int file_fd, size_t length) {
+	SendOp *op = new SendOp(fd);
+	op->file_fd = file_fd;
+	op->file_length = length;
+	this->queue(op);
+}
+
+void IOUring::queue(SendOp *op) {
+	pthread_mutex_lock(&this->mutex);
+	this->pending += op->data.size();
+	this->outbound[op->fd].push_back(op);
+	this->dirty.push_back(op->fd);
+	pthread_mutex_unlock(&this->mutex);
+	uint64_t v = 1;
+	if (-1 != this->wake_fd) {
+		if (-1 == write(this->wake_fd, &v, sizeof(v))) {
+#ifdef DEBUG
+			std::cout<<"(IOUring)Fail to wake up the reactor: "<<strerror(errno)<<std::endl;
+#endif
+		}
+	}
+}
+
+void IOUring::forget(int fd) {
+#ifdef MPOOL_HAVE_URING
+	pthread_mutex_lock(&this->mutex);
+	this->dropQueue(fd);
+	std::map<int, SendOp*>::iterator it = this->inflight.find(fd);
+	if (it != this->inflight.end()) {
+		// The kernel still owns the data, free it on completion;
+		it->second->fd = -1;
+		this->inflight.erase(it);
+	}
+	pthread_mutex_unlock(&this->mutex);
+	struct io_uring_sqe *sqe = this->getSqe();
+	if (!sqe) {
+		return;
+	}
+	io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+	io_uring_sqe_set_data64(sqe, makeUserData(MPOOL_URING_OP_CANCEL, fd));
+	// The fd is looked up on submission, before the caller closes it;
+	io_uring_submit(this->ring);
+#endif
+}
+
+bool IOUring::linger(int fd) {
+	pthread_mutex_lock(&this->mutex);
+	bool queued = this->inflight.find(fd) != this->inflight.end()
+			|| this->outbound.find(fd) != this->outbound.end();
+	if (queued) {
+		this->lingering.push_back(fd);
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return queued;
+}
+
+void IOUring::closeSent(int fd) {
+	if (this->inflight.find(fd) != this->inflight.end()
+			|| this->outbound.find(fd) != this->outbound.end()) {
+		return;
+	}
+	std::vector<int>::iterator it = std::find(this->lingering.begin(),
+			this->lingering.end(), fd);
+	if (it == this->lingering.end()) {
+		return;
+	}
+	this->lingering.erase(it);
+	close(fd);
+}
+
+void IOUring::dropQueue(int fd) {
+	std::map<int, std::deque<SendOp*> >::iterator qit = this->outbound.find(
+			fd);
+	if (qit == this->outbound.end()) {
+		return;
+	}
+	for (std::deque<SendOp*>::iterator it = qit->second.begin();
+			it != qit->second.end(); it++) {
+		this->release(*it);
+	}
+	this->outbound.erase(qit);
+}
+
+void IOUring::release(SendOp *op) {
+	this->pending -= op->data.size();
+	delete op;
+}
+
+bool IOUring::refill(SendOp *op) {
+	this->pending -= op->data.size();
+	bool filled = op->fill();
+	this->pending += op->data.size();
+	return filled;
+}
+
+unsigned long long IOUring::getPending() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long pending = this->pending;
+	pthread_mutex_unlock(&this->mutex);
+	return pending;
+}
+
+void IOUring::submitSend(SendOp *op) {
+#ifdef MPOOL_HAVE_URING
+	struct io_uring_sqe *sqe = this->getSqe();
+	if (!sqe) {
+		return;
+	}
+	io_uring_prep_send(sqe, op->fd, op->data.data() + op->sent,
+			op->data.size() - op->sent, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, (unsigned long long) (uintptr_t) op);
+#endif
+}
+
+void IOUring::flushSends() {
+#ifdef MPOOL_HAVE_URING
+	pthread_mutex_lock(&this->mutex);
+	for (std::vector<int>::iterator it = this->dirty.begin();
+			it != this->dirty.end(); it++) {
+		int fd = *it;
+		if (this->inflight.find(fd) != this->inflight.end()) {
+			// Resubmitted when the running send completes;
+			continue;
+		}
+		std::map<int, std::deque<SendOp*> >::iterator qit =
+				this->outbound.find(fd);
+		if (qit == this->outbound.end()) {
+			continue;
+		}
+		std::deque<SendOp*> &queue = qit->second;
+		SendOp *op = queue.front();
+		queue.pop_front();
+		if (-1 == op->file_fd) {
+			// Batch the queued frames up to the next spill file into one send;
+			while (!queue.empty() && -1 == queue.front()->file_fd) {
+				op->data += queue.front()->data;
+				this->pending += queue.front()->data.size();
+				this->release(queue.front());
+				queue.pop_front();
+			}
+		} else if (!this->refill(op)) {
+			// The stream would be corrupted, the recv reports the close;
+			shutdown(fd, SHUT_RDWR);
+			this->release(op);
+			this->dropQueue(fd);
+			this->closeSent(fd);
+			continue;
+		}
+		if (queue.empty()) {
+			this->outbound.erase(qit);
+		}
+		this->inflight[fd] = op;
+		this->submitSend(op);
+	}
+	this->dirty.clear();
+	pthread_mutex_unlock(&this->mutex);
+#endif
+}
+
+void IOUring::recycleBuffer(unsigned short bid) {
+#ifdef MPOOL_HAVE_URING
+	io_uring_buf_ring_add(this->buf_ring, this->buffers + bid * this->buffer_size,
+			this->buffer_size, bid, io_uring_buf_ring_mask(this->nbuffers), 0);
+	io_uring_buf_ring_advance(this->buf_ring, 1);
+#endif
+}
+
+int IOUring::wait(std::vector<IOEvent> &events, int timeout) {
+	events.clear();
+#ifdef MPOOL_HAVE_URING
+	this->flushSends();
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	struct io_uring_cqe *cqe = NULL;
+	// One syscall submits every queued operation and waits;
+	int rv = io_uring_submit_and_wait_timeout(this->ring, &cqe, 1, &ts, NULL);
+	if (rv < 0 && -ETIME != rv && -EINTR != rv) {
+#ifdef DEBUG
+		std::cout<<"(IOUring)wait error: "<<strerror(-rv)<<std::endl;
+#endif
+		return -1;
+	}
+	struct io_uring_cqe *cqes[MPOOL_URING_BATCH];
+	unsigned int n = io_uring_peek_batch_cqe(this->ring, cqes,
+	MPOOL_URING_BATCH);
+	for (unsigned int i = 0; i < n; i++) {
+		unsigned long long user_data = io_uring_cqe_get_data64(cqes[i]);
+		int res = cqes[i]->res;
+		unsigned int flags = cqes[i]->flags;
+		if (0 == (user_data & 0x07)) {
+			// Send completion;
+			SendOp *op = (SendOp*) (uintptr_t) user_data;
+			pthread_mutex_lock(&this->mutex);
+			if (-1 == op->fd) {
+				// Socket has been closed;
+				this->release(op);
+			} else if (res >= 0 || -EAGAIN == res || -EINTR == res) {
+				op->sent += res > 0 ? res : 0;
+				if (op->sent < op->data.size()) {
+					this->submitSend(op);
+				} else if (-1 != op->file_fd
+						&& op->file_offset < op->file_length) {
+					if (this->refill(op)) {
+						this->submitSend(op);
+					} else {
+						shutdown(op->fd, SHUT_RDWR);
+						this->inflight.erase(op->fd);
+						this->dropQueue(op->fd);
+						this->closeSent(op->fd);
+						this->release(op);
+					}
+				} else {
+					this->inflight.erase(op->fd);
+					if (this->outbound.find(op->fd) != this->outbound.end()) {
+						this->dirty.push_back(op->fd);
+					}
+					this->closeSent(op->fd);
+					this->release(op);
+				}
+			} else {
+				// The multishot recv reports the broken connection;
+				this->inflight.erase(op->fd);
+				this->dropQueue(op->fd);
+				this->closeSent(op->fd);
+				this->release(op);
+			}
+			pthread_mutex_unlock(&this->mutex);
+			continue;
+		}
+		int op = user_data & 0x07;
+		int fd = (int) (unsigned int) (user_data >> 3);
+		unsigned int generation = (unsigned int) (user_data >> 35);
+		IOEvent ev;
+		ev.fd = fd;
+		ev.generation = generation;
+		ev.res = res;
+		switch (op) {
+		case MPOOL_URING_OP_ACCEPT:
+			if (res >= 0) {
+				ev.type = IOEvent::ACCEPT;
+				events.push_back(ev);
+			}
+			if (!(flags & IORING_CQE_F_MORE)) {
+				// Multishot accept terminated, rearm it;
+				this->accept(fd);
+			}
+			break;
+		case MPOOL_URING_OP_RECV:
+			if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+				unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				ev.type = IOEvent::RECV;
+				ev.data.assign(this->buffers + bid * this->buffer_size, res);
+				events.push_back(ev);
+				this->recycleBuffer(bid);
+				if (!(flags & IORING_CQE_F_MORE)) {
+					this->recv(fd, generation);
+				}
+			} else if (0 == res) {
+				ev.type = IOEvent::CLOSED;
+				events.push_back(ev);
+			} else if (-ENOBUFS == res) {
+				// All buffers are in use, the data waits in the socket;
+				this->recv(fd, generation);
+			} else if (-ECANCELED != res) {
+				ev.type = IOEvent::ERROR;
+				events.push_back(ev);
+			}
+			break;
+		case MPOOL_URING_OP_WAKE:
+			this->armWake();
+			break;
+		case MPOOL_URING_OP_POLL:
+			if (res > 0) {
+				ev.type = IOEvent::READY;
+				events.push_back(ev);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	io_uring_cq_advance(this->ring, n);
+	return events.size();
+#else
+	return -1;
+#endif
+}
+
+}
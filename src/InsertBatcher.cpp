@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/InsertBatcher.h"
+
+namespace MPool {
+
+static void skipSpaces(const std::string &sql, size_t &at) {
+	while (at < sql.size() && isspace((unsigned char) sql[at])) {
+		at++;
+	}
+}
+
+/// Case insensitive keyword at, not followed by a name character;
+static bool keyword(const std::string &sql, size_t &at, const char *word) {
+	size_t length = strlen(word);
+	if (sql.size() - at < length
+			|| strncasecmp(sql.data() + at, word, length)) {
+		return false;
+	}
+	if (at + length < sql.size()
+			&& (isalnum((unsigned char) sql[at + length])
+					|| '_' == sql[at + length])) {
+		return false;
+	}
+	at += length;
+	return true;
+}
+
+/// Plain or `quoted` name, copied to out;
+static bool name(const std::string &sql, size_t &at, std::string &out) {
+	size_t start = at;
+	if (at < sql.size() && '`' == sql[at]) {
+		size_t end = sql.find('`', at + 1);
+		if (std::string::npos == end || end == at + 1) {
+			return false;
+		}
+		at = end + 1;
+	} else {
+		while (at < sql.size()
+				&& (isalnum((unsigned char) sql[at]) || '_' == sql[at]
+						|| '$' == sql[at])) {
+			at++;
+		}
+	}
+	if (at == start) {
+		return false;
+	}
+	out.append(sql, start, at - start);
+	return true;
+}
+
+InsertBatch::InsertBatch(DBPool *pool, const std::string &prefix,
+		unsigned long long deadline,
+		void (*wake)(void *target, Client *client), void *target) {
+	this->pool = pool;
+	this->wake = wake;
+	this->target = target;
+	this->prefix = prefix;
+	this->bytes = prefix.size();
+	this->deadline = deadline;
+	this->state = InsertBatch::OPEN;
+	// Held by the batcher until closed;
+	this->refs = 1;
+	pthread_mutex_init(&this->mutex, NULL);
+}
+
+InsertBatch::~InsertBatch() {
+	pthread_mutex_destroy(&this->mutex);
+}
+
+unsigned int InsertBatch::add(const std::string &tuple, Client *client) {
+	this->tuples.push_back(tuple);
+	this->bytes += tuple.size() + 1;
+	this->members.push_back(client);
+	this->retain();
+	return this->tuples.size() - 1;
+}
+
+void InsertBatch::forget(Client *client) {
+	for (size_t i = 0; i < this->members.size(); i++) {
+		if (this->members[i] == client) {
+			this->members.erase(this->members.begin() + i);
+			return;
+		}
+	}
+}
+
+std::vector<Client*>& InsertBatch::getMembers() {
+	return this->members;
+}
+
+void InsertBatch::close() {
+	pthread_mutex_lock(&this->mutex);
+	this->state = InsertBatch::READY;
+	pthread_mutex_unlock(&this->mutex);
+}
+
+unsigned char InsertBatch::claim(Client *client) {
+	pthread_mutex_lock(&this->mutex);
+	unsigned char state = this->state;
+	if (InsertBatch::READY == state) {
+		this->state = InsertBatch::RUNNING;
+		state = InsertBatch::RUNNING;
+	} else if (InsertBatch::DONE != state) {
+		this->parked.push_back(client);
+		state = InsertBatch::OPEN;
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return state;
+}
+
+void InsertBatch::unpark(Client *client) {
+	pthread_mutex_lock(&this->mutex);
+	for (size_t i = 0; i < this->parked.size(); i++) {
+		if (this->parked[i] == client) {
+			this->parked.erase(this->parked.begin() + i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void InsertBatch::execute(DB *db_con) {
+	size_t count = this->tuples.size();
+	this->errors.assign(count, "");
+	this->gtids.assign(count, "");
+	MYSQL_RES *res = NULL;
+	std::string sql;
+	sql.reserve(this->bytes);
+	sql.append(this->prefix);
+	for (size_t i = 0; i < count; i++) {
+		if (i) {
+			sql.append(",", 1);
+		}
+		sql.append(this->tuples[i]);
+	}
+	if (!db_con) {
+		this->errors.assign(count, "Fail to get connection from the pool");
+	} else if (db_con->execute(sql, &res, false)) {
+		this->gtids.assign(count, db_con->getGtid());
+	} else if (1 == count) {
+		this->errors[0] = db_con->getError();
+	} else {
+		// One bad row fails the whole statement, find out which;
+		for (size_t i = 0; i < count; i++) {
+			if (db_con->execute(this->prefix + this->tuples[i], &res, false)) {
+				this->gtids[i] = db_con->getGtid();
+			} else {
+				this->errors[i] = db_con->getError();
+			}
+		}
+	}
+	if (res) {
+		mysql_free_result(res);
+	}
+	// Woken under the mutex, unpark() of a dropped member waits for it;
+	pthread_mutex_lock(&this->mutex);
+	this->state = InsertBatch::DONE;
+	for (size_t i = 0; i < this->parked.size(); i++) {
+		this->wake(this->target, this->parked[i]);
+	}
+	this->parked.clear();
+	pthread_mutex_unlock(&this->mutex);
+}
+
+const std::string& InsertBatch::getError(unsigned int row) {
+	return this->errors[row];
+}
+
+const std::string& InsertBatch::getGtid(unsigned int row) {
+	return this->gtids[row];
+}
+
+DBPool* InsertBatch::getPool() {
+	return this->pool;
+}
+
+const std::string& InsertBatch::getPrefix() {
+	return this->prefix;
+}
+
+unsigned long long InsertBatch::getDeadline() {
+	return this->deadline;
+}
+
+size_t InsertBatch::getRows() {
+	return this->tuples.size();
+}
+
+size_t InsertBatch::getBytes() {
+	return this->bytes;
+}
+
+void InsertBatch::retain() {
+	__atomic_add_fetch(&this->refs, 1, __ATOMIC_RELAXED);
+}
+
+bool InsertBatch::release() {
+	return 0 == __atomic_sub_fetch(&this->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+InsertBatcher::InsertBatcher() {
+	this->window = 0;
+	this->max_rows = MPOOL_BATCH_ROWS;
+	this->wake = NULL;
+	this->target = NULL;
+	this->batches = 0;
+	this->rows = 0;
+}
+
+InsertBatcher::~InsertBatcher() {
+	std::vector<Client*> ready;
+	while (!this->open.empty()) {
+		this->close(this->open.begin()->second, ready);
+	}
+}
+
+void InsertBatcher::setLimits(unsigned long window, unsigned int max_rows) {
+	this->window = window;
+	this->max_rows = max_rows ? max_rows : 1;
+}
+
+void InsertBatcher::setWake(void (*wake)(void *target, Client *client),
+		void *target) {
+	this->wake = wake;
+	this->target = target;
+}
+
+bool InsertBatcher::parse(const std::string &sql, std::string &prefix,
+		std::string &tuple) {
+	size_t at = 0;
+	std::string table;
+	std::string columns;
+	skipSpaces(sql, at);
+	if (!keyword(sql, at, "INSERT")) {
+		return false;
+	}
+	skipSpaces(sql, at);
+	keyword(sql, at, "INTO");
+	skipSpaces(sql, at);
+	if (!name(sql, at, table)) {
+		return false;
+	}
+	if (at < sql.size() && '.' == sql[at]) {
+		table.append(".");
+		at++;
+		if (!name(sql, at, table)) {
+			return false;
+		}
+	}
+	skipSpaces(sql, at);
+	if (at >= sql.size() || '(' != sql[at]) {
+		// Without a column list the rows depend on the table definition;
+		return false;
+	}
+	at++;
+	while (true) {
+		skipSpaces(sql, at);
+		if (!name(sql, at, columns)) {
+			return false;
+		}
+		skipSpaces(sql, at);
+		if (at < sql.size() && ',' == sql[at]) {
+			columns.append(",");
+			at++;
+		} else if (at < sql.size() && ')' == sql[at]) {
+			at++;
+			break;
+		} else {
+			return false;
+		}
+	}
+	skipSpaces(sql, at);
+	if (!keyword(sql, at, "VALUES") && !keyword(sql, at, "VALUE")) {
+		return false;
+	}
+	skipSpaces(sql, at);
+	if (at >= sql.size() || '(' != sql[at]) {
+		return false;
+	}
+	// One row, parentheses balanced outside of the string literals;
+	size_t start = at;
+	int depth = 0;
+	char quote = 0;
+	for (; at < sql.size(); at++) {
+		char c = sql[at];
+		if (quote) {
+			if ('\\' == c) {
+				at++;
+			} else if (quote == c) {
+				if (at + 1 < sql.size() && quote == sql[at + 1]) {
+					at++;
+				} else {
+					quote = 0;
+				}
+			}
+		} else if ('\'' == c || '"' == c || '`' == c) {
+			quote = c;
+		} else if ('(' == c) {
+			depth++;
+		} else if (')' == c && 0 == --depth) {
+			break;
+		} else if (';' == c) {
+			return false;
+		}
+	}
+	if (at >= sql.size()) {
+		return false;
+	}
+	at++;
+	tuple.assign(sql, start, at - start);
+	// Nothing else, e.g. a second row or ON DUPLICATE KEY UPDATE;
+	skipSpaces(sql, at);
+	if (at < sql.size() && ';' == sql[at]) {
+		at++;
+		skipSpaces(sql, at);
+	}
+	if (at != sql.size()) {
+		return false;
+	}
+	prefix = "INSERT INTO " + table + " (" + columns + ") VALUES ";
+	return true;
+}
+
+InsertBatch* InsertBatcher::add(DBPool *pool, const std::string &prefix,
+		const std::string &tuple, Client *client, unsigned long long now,
+		unsigned int &row, std::vector<Client*> &ready) {
+	std::pair<DBPool*, std::string> key(pool, prefix);
+	std::map<std::pair<DBPool*, std::string>, InsertBatch*>::iterator it =
+			this->open.find(key);
+	InsertBatch *batch = NULL;
+	if (it != this->open.end()
+			&& it->second->getBytes() + tuple.size() < MPOOL_BATCH_BYTES) {
+		batch = it->second;
+	} else {
+		if (it != this->open.end()) {
+			this->close(it->second, ready);
+		}
+		batch = new InsertBatch(pool, prefix, now + this->window, this->wake,
+				this->target);
+		this->open[key] = batch;
+		this->batches++;
+	}
+	row = batch->add(tuple, client);
+	this->rows++;
+	if (batch->getRows() >= this->max_rows) {
+		this->close(batch, ready);
+	}
+	return batch;
+}
+
+void InsertBatcher::close(InsertBatch *batch, std::vector<Client*> &ready) {
+	this->open.erase(
+			std::pair<DBPool*, std::string>(batch->getPool(),
+					batch->getPrefix()));
+	std::vector<Client*> &members = batch->getMembers();
+	ready.insert(ready.end(), members.begin(), members.end());
+	members.clear();
+	batch->close();
+	if (batch->release()) {
+		// All the members were dropped;
+		delete batch;
+	}
+}
+
+void InsertBatcher::expire(unsigned long long now,
+		std::vector<Client*> &ready) {
+	std::map<std::pair<DBPool*, std::string>, InsertBatch*>::iterator it =
+			this->open.begin();
+	while (it != this->open.end()) {
+		InsertBatch *batch = it->second;
+		it++;
+		if (batch->getDeadline() <= now) {
+			this->close(batch, ready);
+		}
+	}
+}
+
+int InsertBatcher::getTimeout(unsigned long long now, int def) {
+	int timeout = def;
+	for (std::map<std::pair<DBPool*, std::string>, InsertBatch*>::iterator it =
+			this->open.begin(); it != this->open.end(); it++) {
+		unsigned long long deadline = it->second->getDeadline();
+		if (deadline <= now) {
+			return 0;
+		}
+		if (deadline - now < (unsigned long long) timeout) {
+			timeout = deadline - now;
+		}
+	}
+	return timeout;
+}
+
+unsigned long long InsertBatcher::getBatches() {
+	return this->batches;
+}
+
+unsigned long long InsertBatcher::getBatchedRows() {
+	return this->rows;
+}
+
+}
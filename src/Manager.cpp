@@ -23,6 +23,9 @@
  */
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <map>
 #include <iostream>
 #include <sstream>
 #include <list>
@@ -30,6 +33,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <signal.h>
+#include <syslog.h>
 #include <time.h>
 #include <pthread.h>
 #include <jsoncpp/json/json.h>
@@ -37,23 +41,33 @@
 #include <mysql.h>
 #include "include/version.h"
 #include "include/DBPool.h"
+#include "include/IOUring.h"
+#include "include/TimerWheel.h"
+#include "include/ShmChannel.h"
+#include "include/MemoryAccount.h"
 #include "include/Client.h"
 #include "include/Manager.h"
 #include "include/ServerException.h"
 
 namespace MPool {
 
+/// Statements per round of each priority class, times the user weight;
+static const unsigned long class_weights[] = { MPOOL_WEIGHT_INTERACTIVE,
+		MPOOL_WEIGHT_NORMAL, MPOOL_WEIGHT_BATCH };
+
 Worker::Worker() {
 #ifdef DEBUG
 	std::cout<<"[Worker] Constructor Start"<<std::endl;
 #endif
 	this->status = 'N';
 	this->client = 0;
+	this->share = NULL;
 	this->tid = 0;
 #ifdef DEBUG
 	std::cout<<"[Worker] Constructor end"<<std::endl;
 #endif
 	this->last_run_time = 0;
+	this->retired = false;
 	pthread_mutex_init(&this->mutex, NULL);
 }
 
@@ -83,11 +97,15 @@ void Worker::run() {
 #ifdef DEBUG
 			std::cout<<"[Worker]Starting a work"<<std::endl;
 #endif
-			this->client->doWork();
+			this->client->doWork(&this->last_run_time);
 			// Clean works;
 			pthread_mutex_lock(&this->mutex);
+			if (this->share) {
+				__sync_sub_and_fetch(&this->share->running, 1);
+				this->share = NULL;
+			}
 			this->client = 0;
-			this->status = 'I';
+			this->status = this->retired ? 'N' : 'I';
 			pthread_mutex_unlock(&this->mutex);
 #ifdef DEBUG
 			std::cout<<"[Worker]done a work"<<std::endl;
@@ -101,10 +119,21 @@ void Worker::run() {
 #endif
 }
 
-void Worker::setClient(Client *c) {
+bool Worker::retire() {
+	pthread_mutex_lock(&this->mutex);
+	bool busy = this->status == 'B';
+	if (busy) {
+		this->retired = true;
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return busy;
+}
+
+void Worker::setClient(Client *c, UserShare *share) {
 	pthread_mutex_lock(&this->mutex);
 	this->status = 'B';
 	this->client = c;
+	this->share = share;
 	pthread_mutex_unlock(&this->mutex);
 }
 
@@ -122,7 +151,11 @@ void Worker::start() {
 #ifdef DEBUG
 	std::cout<<"[Worker] Creating new thread"<<std::endl;
 #endif
+	// Set before the thread starts, or run() may exit at once;
+	this->status = 'I';
+	this->last_run_time = time(0);
 	if (pthread_create(&this->tid, 0, MPool::Worker::threadStart, this) != 0) {
+		this->status = 'N';
 #ifdef DEBUG
 		std::cout<<"[Worker] Cannot create new thread"<<std::endl;
 #endif
@@ -132,10 +165,6 @@ void Worker::start() {
 	std::cout<<"[Worker] Switching to the new thread"<<std::endl;
 #endif
 	pthread_detach(this->tid);
-#ifdef DEBUG
-	std::cout<<"[Worker] Set idle status"<<std::endl;
-#endif
-	this->status = 'I';
 #ifdef DEBUG
 	std::cout<<"[Worker] started"<<std::endl;
 #endif
@@ -152,6 +181,7 @@ time_t Worker::getLastRunTime() {
 Manager::Manager(unsigned int workers) {
 	this->nWorkers = workers == 0 ? 4 : workers;
 	this->tid = 0;
+	this->pending = 0;
 	this->workers = new Worker*[workers]();
 	pthread_mutex_init(&this->mutex, NULL);
 	// Start workers;
@@ -176,6 +206,14 @@ Manager::Manager(unsigned int workers) {
 
 Manager::~Manager() {
 	// Stop workers;
+	for (std::map<std::string, PendingFlow*>::iterator it = this->flows.begin();
+			it != this->flows.end(); it++) {
+		delete it->second;
+	}
+	for (std::map<std::string, UserShare*>::iterator it = this->shares.begin();
+			it != this->shares.end(); it++) {
+		delete it->second;
+	}
 	pthread_mutex_destroy(&this->mutex);
 }
 
@@ -184,19 +222,167 @@ void Manager::setTid(pthread_t tid) {
 }
 
 bool Manager::push(Client *client) {
+	PendingWork work;
+	work.client = client;
+	work.queued = Manager::now();
+	unsigned char priority = client->getPriority();
+	if (priority > MPOOL_PRIORITY_BATCH) {
+		priority = MPOOL_PRIORITY_BATCH;
+	}
+	std::string key(1, (char) priority);
+	key += client->getUsername();
 	pthread_mutex_lock(&this->mutex);
-	this->pending.push(client);
+	PendingFlow *&flow = this->flows[key];
+	if (!flow) {
+		flow = new PendingFlow();
+		flow->deficit = 0;
+		flow->active = false;
+		flow->share = this->getShare(client->getUsername());
+	}
+	flow->quantum = class_weights[priority] * client->getWeight();
+	if (!flow->quantum) {
+		flow->quantum = 1;
+	}
+	work.flow = flow;
+	this->enqueue(work);
 	pthread_mutex_unlock(&this->mutex);
 	return true;
 }
 
+UserShare* Manager::getShare(const std::string &username) {
+	UserShare *&share = this->shares[username];
+	if (!share) {
+		share = new UserShare();
+		share->running = 0;
+		share->max_workers = 0;
+		share->queued = 0;
+	}
+	return share;
+}
+
+void Manager::setMaxWorkers(const std::string &username,
+		unsigned int max_workers) {
+	pthread_mutex_lock(&this->mutex);
+	this->getShare(username)->max_workers = max_workers;
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void Manager::getUserLoad(const std::string &username, unsigned long &queued,
+		unsigned int &running) {
+	pthread_mutex_lock(&this->mutex);
+	std::map<std::string, UserShare*>::iterator it = this->shares.find(
+			username);
+	queued = it == this->shares.end() ? 0 : it->second->queued;
+	running = it == this->shares.end() ? 0 : it->second->running;
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void Manager::enqueue(PendingWork &work) {
+	work.flow->share->queued++;
+	work.flow->works.push_back(work);
+	if (!work.flow->active) {
+		work.flow->active = true;
+		this->active.push_back(work.flow);
+	}
+	this->pending++;
+}
+
+bool Manager::dequeue(PendingWork &work) {
+	size_t skipped = 0;
+	while (!this->active.empty() && skipped < this->active.size()) {
+		PendingFlow *flow = this->active.front();
+		if (flow->works.empty()) {
+			flow->active = false;
+			flow->deficit = 0;
+			this->active.pop_front();
+			continue;
+		}
+		if (flow->share->max_workers
+				&& flow->share->running >= flow->share->max_workers) {
+			// Bulkhead full, the other users go first;
+			this->active.splice(this->active.end(), this->active,
+					this->active.begin());
+			skipped++;
+			continue;
+		}
+		if (!flow->deficit) {
+			// Its turn starts;
+			flow->deficit = flow->quantum;
+		}
+		work = flow->works.front();
+		flow->works.pop_front();
+		flow->share->queued--;
+		this->pending--;
+		if (flow->works.empty()) {
+			// An idle flow keeps no credit;
+			flow->active = false;
+			flow->deficit = 0;
+			this->active.pop_front();
+		} else if (!--flow->deficit) {
+			this->active.splice(this->active.end(), this->active,
+					this->active.begin());
+		}
+		return true;
+	}
+	return false;
+}
+
+unsigned char Manager::parsePriority(const std::string &name,
+		unsigned char def) {
+	if (!name.compare("interactive")) {
+		return MPOOL_PRIORITY_INTERACTIVE;
+	}
+	if (!name.compare("normal")) {
+		return MPOOL_PRIORITY_NORMAL;
+	}
+	if (!name.compare("batch")) {
+		return MPOOL_PRIORITY_BATCH;
+	}
+	return def;
+}
+
+void Manager::getLoad(size_t &pending, size_t &inflight,
+		unsigned long long &delay) {
+	unsigned long long now = Manager::now();
+	pthread_mutex_lock(&this->mutex);
+	pending = this->pending;
+	delay = 0;
+	for (std::list<PendingFlow*>::iterator it = this->active.begin();
+			it != this->active.end(); it++) {
+		if (!(*it)->works.empty() && now - (*it)->works.front().queued > delay) {
+			delay = now - (*it)->works.front().queued;
+		}
+	}
+	inflight = pending;
+	// Under the mutex, restart() replaces workers;
+	for (unsigned int i = 0; i < this->nWorkers; i++) {
+		if (this->workers[i]->getStatus() == 'B') {
+			inflight++;
+		}
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+unsigned long long Manager::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void Manager::stop() {
 #ifdef DEBUG
 	std::cout<<"Cleaning the pending quires"<<std::endl;
 #endif
-	while (!this->pending.empty()) {
-		this->pending.pop();
+	pthread_mutex_lock(&this->mutex);
+	for (std::map<std::string, PendingFlow*>::iterator it = this->flows.begin();
+			it != this->flows.end(); it++) {
+		it->second->works.clear();
+		it->second->active = false;
+		it->second->share->queued = 0;
 	}
+	this->active.clear();
+	this->pending = 0;
+	pthread_mutex_unlock(&this->mutex);
 	this->running = false;
 #ifdef DEBUG
 	std::cout<<"Stopping the workers"<<std::endl;
@@ -218,43 +404,41 @@ void Manager::stop() {
 
 void Manager::run() {
 	while (this->running) {
-		if (!this->pending.empty()) {
+		if (this->pending) {
 #ifdef DEBUG
-			std::cout<<"[Manager]Pending clients: "<<this->pending.size()<<std::endl;
+			std::cout<<"[Manager]Pending clients: "<<this->pending<<std::endl;
 #endif
 			for (unsigned int i = 0; i < this->nWorkers; i++) {
 				time_t now = time(0);
 				if (now
 						- this->workers[i]->getLastRunTime() > MPOOL_CLIENT_TIMEOUT) {
 					// Zombie worker, restart;
-					this->workers[i]->stop();
-					this->workers[i]->start();
+					pthread_mutex_lock(&this->mutex);
+					this->restart(i);
+					pthread_mutex_unlock(&this->mutex);
 				}
 				if (this->workers[i]->getStatus() == 'I') {
 					pthread_mutex_lock(&this->mutex);
-					if (0 == pthread_kill(this->tid, 0)) {
-#ifdef DEBUG
-						std::cout<<"[Manager]Worker "<<i<<" is alive, push task"<<std::endl;
-#endif
-					} else {
-#ifdef DEBUG
-						std::cout<<"[Manager]Worker "<<i<<" is zombie, restart it"<<std::endl;
-#endif
-						this->workers[i]->stop();
-						this->workers[i]->start();
+					PendingWork work;
+					if (!this->dequeue(work)) {
+						pthread_mutex_unlock(&this->mutex);
+						break;
 					}
-					Client *c = this->pending.front();
-					this->pending.pop();
-					if (!c->isBusy()) {
+					Client *c = work.client;
+					// One worker per client, keeps the replies in order;
+					if (c->acquire()) {
 #ifdef DEBUG
 						std::cout<<"[Manager]Client is free, associate it with Worker "<<i<<std::endl;
 #endif
-						this->workers[i]->setClient(c);
+						__sync_add_and_fetch(&work.flow->share->running, 1);
+						this->workers[i]->setClient(c, work.flow->share);
 					} else {
 #ifdef DEBUG
 						std::cout<<"[Manager]Client is busy, push it to the end of pending queue"<<std::endl;
 #endif
-						this->pending.push(c);
+						// Waits behind its own statement, not for a worker;
+						work.queued = Manager::now();
+						this->enqueue(work);
 					}
 #ifdef DEBUG
 					std::cout<<"[Manager]Done a assignment"<<std::endl;
@@ -269,6 +453,27 @@ void Manager::run() {
 	}
 }
 
+void Manager::restart(unsigned int i) {
+	if ('N' == this->workers[i]->getStatus()) {
+		// Its thread failed to start;
+		delete this->workers[i];
+	} else if (this->workers[i]->retire()) {
+		// No signal stops a thread alone, it ends once its work returns;
+		syslog(LOG_WARNING, "Worker %u busy over %d seconds, replaced", i,
+				MPOOL_CLIENT_TIMEOUT);
+	} else {
+		// Done meanwhile;
+		return;
+	}
+	this->workers[i] = new Worker();
+	try {
+		this->workers[i]->start();
+	} catch (ServerException &e) {
+		// Runs no work, the next restart tries again;
+		syslog(LOG_ERR, "Cannot start a worker thread");
+	}
+}
+
 void Manager::start() {
 	if (this->tid) {
 		if (0 == pthread_kill(this->tid, 0)) {
@@ -277,11 +482,13 @@ void Manager::start() {
 		}
 		this->tid = 0;
 	}
+	// Set before the thread starts, or run() may exit at once;
+	this->running = true;
 	if (pthread_create(&this->tid, 0, MPool::Manager::threadStart, this) != 0) {
+		this->running = false;
 		throw ServerException();
 	}
 	pthread_detach(this->tid);
-	this->running = true;
 }
 
 }
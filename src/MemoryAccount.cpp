@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include "include/MemoryAccount.h"
+
+namespace MPool {
+
+MemoryAccount::MemoryAccount() {
+	this->parent = NULL;
+	for (int i = 0; i < TYPES; i++) {
+		this->used[i] = 0;
+	}
+}
+
+MemoryAccount::~MemoryAccount() {
+	for (int i = 0; i < TYPES; i++) {
+		if (this->parent && this->used[i]) {
+			this->parent->sub(i, this->used[i]);
+		}
+	}
+}
+
+void MemoryAccount::setParent(MemoryAccount *parent) {
+	this->parent = parent;
+}
+
+void MemoryAccount::add(int type, size_t bytes) {
+	__atomic_add_fetch(&this->used[type], bytes, __ATOMIC_RELAXED);
+	if (this->parent) {
+		this->parent->add(type, bytes);
+	}
+}
+
+void MemoryAccount::sub(int type, size_t bytes) {
+	__atomic_sub_fetch(&this->used[type], bytes, __ATOMIC_RELAXED);
+	if (this->parent) {
+		this->parent->sub(type, bytes);
+	}
+}
+
+unsigned long long MemoryAccount::get(int type) {
+	return __atomic_load_n(&this->used[type], __ATOMIC_RELAXED);
+}
+
+unsigned long long MemoryAccount::total() {
+	unsigned long long total = 0;
+	for (int i = 0; i < TYPES; i++) {
+		total += this->get(i);
+	}
+	return total;
+}
+
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <openssl/sha.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/MySQLProtocol.h"
+
+#define MPOOL_MYSQL_NATIVE_PASSWORD "mysql_native_password"
+#define MPOOL_MYSQL_CHARSET 33 /// utf8_general_ci
+#define MPOOL_MYSQL_STATUS_AUTOCOMMIT 0x0002
+#define MPOOL_MYSQL_CLIENT_PROTOCOL_41 0x0200
+#define MPOOL_MYSQL_CLIENT_CONNECT_WITH_DB 0x0008
+#define MPOOL_MYSQL_CLIENT_SECURE_CONNECTION 0x8000
+#define MPOOL_MYSQL_CLIENT_PLUGIN_AUTH 0x00080000
+#define MPOOL_MYSQL_CLIENT_PLUGIN_AUTH_LENENC 0x00200000
+
+namespace MPool {
+
+static void appendInt(std::string &out, unsigned long long n, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		out += (char) ((n >> (8 * i)) & 0xff);
+	}
+}
+
+static unsigned long long readInt(const std::string &in, size_t pos,
+		int bytes) {
+	unsigned long long n = 0;
+	for (int i = 0; i < bytes; i++) {
+		n |= (unsigned long long) (unsigned char) in[pos + i] << (8 * i);
+	}
+	return n;
+}
+
+void MySQLProtocol::appendPacket(std::string &out, unsigned char &seq,
+		const std::string &payload) {
+	size_t offset = 0;
+	while (true) {
+		size_t length = payload.length() - offset;
+		if (length > MPOOL_MYSQL_MAX_PAYLOAD) {
+			length = MPOOL_MYSQL_MAX_PAYLOAD;
+		}
+		appendInt(out, length, 3);
+		out += (char) seq++;
+		out.append(payload, offset, length);
+		offset += length;
+		// A full packet is followed by another one, even an empty one;
+		if (length < MPOOL_MYSQL_MAX_PAYLOAD) {
+			break;
+		}
+	}
+}
+
+void MySQLProtocol::appendLength(std::string &out, unsigned long long n) {
+	if (n < 251) {
+		out += (char) n;
+	} else if (n < 0x10000) {
+		out += (char) 0xfc;
+		appendInt(out, n, 2);
+	} else if (n < 0x1000000) {
+		out += (char) 0xfd;
+		appendInt(out, n, 3);
+	} else {
+		out += (char) 0xfe;
+		appendInt(out, n, 8);
+	}
+}
+
+void MySQLProtocol::appendString(std::string &out, const char *str,
+		unsigned long length) {
+	appendLength(out, length);
+	out.append(str, length);
+}
+
+std::string MySQLProtocol::handshake(unsigned int connection_id,
+		const std::string &scramble) {
+	std::string payload;
+	payload += (char) 0x0a;
+	payload += "5.7.0-mpool-" MPOOL_SERVER_VERSION;
+	payload += '\0';
+	appendInt(payload, connection_id, 4);
+	payload.append(scramble, 0, 8);
+	payload += '\0';
+	appendInt(payload, MPOOL_MYSQL_CAPABILITIES & 0xffff, 2);
+	payload += (char) MPOOL_MYSQL_CHARSET;
+	appendInt(payload, MPOOL_MYSQL_STATUS_AUTOCOMMIT, 2);
+	appendInt(payload, MPOOL_MYSQL_CAPABILITIES >> 16, 2);
+	payload += (char) (MPOOL_MYSQL_SCRAMBLE_LENGTH + 1);
+	payload.append(10, '\0');
+	payload.append(scramble, 8, std::string::npos);
+	payload += '\0';
+	payload += MPOOL_MYSQL_NATIVE_PASSWORD;
+	payload += '\0';
+	std::string out;
+	unsigned char seq = 0;
+	appendPacket(out, seq, payload);
+	return out;
+}
+
+bool MySQLProtocol::parseHandshakeResponse(const std::string &payload,
+		std::string &user, std::string &auth, std::string &plugin) {
+	if (payload.length() < 33) {
+		return false;
+	}
+	unsigned long capabilities = readInt(payload, 0, 4);
+	if (!(capabilities & MPOOL_MYSQL_CLIENT_PROTOCOL_41)) {
+		return false;
+	}
+	size_t pos = 32;
+	size_t end = payload.find('\0', pos);
+	if (std::string::npos == end) {
+		return false;
+	}
+	user = payload.substr(pos, end - pos);
+	pos = end + 1;
+	size_t length = 0;
+	if (capabilities & MPOOL_MYSQL_CLIENT_PLUGIN_AUTH_LENENC) {
+		if (pos >= payload.length()) {
+			return false;
+		}
+		unsigned char c = payload[pos++];
+		if (c < 251) {
+			length = c;
+		} else if (0xfc == c && pos + 2 <= payload.length()) {
+			length = readInt(payload, pos, 2);
+			pos += 2;
+		} else {
+			return false;
+		}
+	} else if (capabilities & MPOOL_MYSQL_CLIENT_SECURE_CONNECTION) {
+		if (pos >= payload.length()) {
+			return false;
+		}
+		length = (unsigned char) payload[pos++];
+	} else {
+		end = payload.find('\0', pos);
+		length = (std::string::npos == end ? payload.length() : end) - pos;
+	}
+	if (pos + length > payload.length()) {
+		return false;
+	}
+	auth = payload.substr(pos, length);
+	pos += length;
+	if (capabilities & MPOOL_MYSQL_CLIENT_CONNECT_WITH_DB) {
+		// The database is the one of the pool;
+		end = payload.find('\0', pos);
+		pos = std::string::npos == end ? payload.length() : end + 1;
+	}
+	plugin = MPOOL_MYSQL_NATIVE_PASSWORD;
+	if ((capabilities & MPOOL_MYSQL_CLIENT_PLUGIN_AUTH)
+			&& pos < payload.length()) {
+		end = payload.find('\0', pos);
+		plugin = payload.substr(pos,
+				(std::string::npos == end ? payload.length() : end) - pos);
+	}
+	return true;
+}
+
+std::string MySQLProtocol::authSwitch(const std::string &scramble) {
+	std::string payload;
+	payload += (char) 0xfe;
+	payload += MPOOL_MYSQL_NATIVE_PASSWORD;
+	payload += '\0';
+	payload += scramble;
+	payload += '\0';
+	return payload;
+}
+
+bool MySQLProtocol::checkNativePassword(const std::string &scramble,
+		const std::string &password, const std::string &auth) {
+	if (password.empty()) {
+		return auth.empty();
+	}
+	if (auth.length() != SHA_DIGEST_LENGTH) {
+		return false;
+	}
+	// auth = SHA1(password) XOR SHA1(scramble + SHA1(SHA1(password)));
+	unsigned char stage1[SHA_DIGEST_LENGTH];
+	unsigned char stage2[SHA_DIGEST_LENGTH];
+	unsigned char mask[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char*) password.data(), password.length(), stage1);
+	SHA1(stage1, SHA_DIGEST_LENGTH, stage2);
+	std::string salted = scramble;
+	salted.append((const char*) stage2, SHA_DIGEST_LENGTH);
+	SHA1((const unsigned char*) salted.data(), salted.length(), mask);
+	unsigned char diff = 0;
+	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+		diff |= (unsigned char) auth[i] ^ mask[i] ^ stage1[i];
+	}
+	return 0 == diff;
+}
+
+std::string MySQLProtocol::scramble(const std::string &secret,
+		unsigned long long handle) {
+	std::string seed = secret;
+	appendInt(seed, handle, 8);
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char*) seed.data(), seed.length(), digest);
+	// Printable, without NUL;
+	std::string str;
+	for (int i = 0; i < MPOOL_MYSQL_SCRAMBLE_LENGTH; i++) {
+		str += (char) (0x21 + digest[i] % 94);
+	}
+	return str;
+}
+
+std::string MySQLProtocol::ok(unsigned long long affected_rows,
+		unsigned long long insert_id) {
+	std::string payload;
+	payload += (char) 0x00;
+	appendLength(payload, affected_rows);
+	appendLength(payload, insert_id);
+	appendInt(payload, MPOOL_MYSQL_STATUS_AUTOCOMMIT, 2);
+	appendInt(payload, 0, 2);
+	return payload;
+}
+
+std::string MySQLProtocol::error(unsigned int code, const char *state,
+		const std::string &message) {
+	std::string payload;
+	payload += (char) 0xff;
+	appendInt(payload, code, 2);
+	payload += '#';
+	payload.append(state, 5);
+	payload += message;
+	return payload;
+}
+
+std::string MySQLProtocol::eof() {
+	std::string payload;
+	payload += (char) 0xfe;
+	appendInt(payload, 0, 2);
+	appendInt(payload, MPOOL_MYSQL_STATUS_AUTOCOMMIT, 2);
+	return payload;
+}
+
+void MySQLProtocol::appendColumns(std::string &out, unsigned char &seq,
+		MYSQL_RES *res) {
+	unsigned int fields = mysql_num_fields(res);
+	std::string payload;
+	appendLength(payload, fields);
+	appendPacket(out, seq, payload);
+	MYSQL_FIELD *defs = mysql_fetch_fields(res);
+	for (unsigned int i = 0; i < fields; i++) {
+		MYSQL_FIELD *field = &defs[i];
+		payload.clear();
+		appendString(payload, "def", 3);
+		appendString(payload, field->db ? field->db : "",
+				field->db ? strlen(field->db) : 0);
+		appendString(payload, field->table ? field->table : "",
+				field->table ? strlen(field->table) : 0);
+		appendString(payload, field->org_table ? field->org_table : "",
+				field->org_table ? strlen(field->org_table) : 0);
+		appendString(payload, field->name, strlen(field->name));
+		appendString(payload, field->org_name ? field->org_name : "",
+				field->org_name ? strlen(field->org_name) : 0);
+		payload += (char) 0x0c;
+		appendInt(payload, field->charsetnr, 2);
+		appendInt(payload, field->length, 4);
+		payload += (char) field->type;
+		appendInt(payload, field->flags, 2);
+		payload += (char) field->decimals;
+		appendInt(payload, 0, 2);
+		appendPacket(out, seq, payload);
+	}
+	appendPacket(out, seq, eof());
+}
+
+void MySQLProtocol::appendRow(std::string &out, unsigned char &seq,
+		MYSQL_RES *res, MYSQL_ROW row) {
+	unsigned int fields = mysql_num_fields(res);
+	unsigned long *lengths = mysql_fetch_lengths(res);
+	std::string payload;
+	for (unsigned int i = 0; i < fields; i++) {
+		if (!row[i]) {
+			payload += (char) 0xfb;
+		} else {
+			appendString(payload, row[i], lengths[i]);
+		}
+	}
+	appendPacket(out, seq, payload);
+}
+
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "include/version.h"
+#include "include/MonotonicClock.h"
+#include "include/RateLimiter.h"
+
+namespace MPool {
+
+RateLimiter::RateLimiter() {
+	this->rate = 0;
+	this->burst = 0;
+	this->tokens = 0;
+	this->refilled = 0;
+	this->max_queries = 0;
+	this->queries = 0;
+	this->limited = 0;
+}
+
+RateLimiter::~RateLimiter() {
+}
+
+void RateLimiter::setLimits(double qps, double burst, unsigned int max_queries) {
+	this->rate = qps > 0 ? qps / 1000000 : 0;
+	this->burst = burst >= 1 ? burst : (qps > 1 ? qps : 1);
+	// Start full, a new user may use the whole burst at once;
+	this->tokens = this->burst;
+	this->refilled = MonotonicClock::micros();
+	this->max_queries = max_queries;
+}
+
+unsigned long RateLimiter::admit(const char *&reason) {
+	if (this->max_queries
+			&& __atomic_load_n(&this->queries, __ATOMIC_RELAXED)
+					>= this->max_queries) {
+		// No telling when one finishes;
+		this->limited++;
+		reason = "Too many queries of the user queued or running";
+		return MPOOL_RATE_RETRY;
+	}
+	if (!this->rate) {
+		return 0;
+	}
+	unsigned long long now = MonotonicClock::micros();
+	this->tokens += (now - this->refilled) * this->rate;
+	this->refilled = now;
+	if (this->tokens > this->burst) {
+		this->tokens = this->burst;
+	}
+	if (this->tokens >= 1) {
+		this->tokens -= 1;
+		return 0;
+	}
+	this->limited++;
+	reason = "Query rate of the user exceeded";
+	return (unsigned long) ceil((1 - this->tokens) / this->rate / 1000);
+}
+
+void RateLimiter::enter() {
+	__atomic_add_fetch(&this->queries, 1, __ATOMIC_RELAXED);
+}
+
+void RateLimiter::leave(unsigned long count) {
+	__atomic_sub_fetch(&this->queries, count, __ATOMIC_RELAXED);
+}
+
+unsigned long RateLimiter::getQueries() {
+	return __atomic_load_n(&this->queries, __ATOMIC_RELAXED);
+}
+
+unsigned long long RateLimiter::getLimited() {
+	return this->limited;
+}
+
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <ctype.h>
+#include <string.h>
+#include <pthread.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/ReplicaSet.h"
+
+namespace MPool {
+
+ReplicaSet::ReplicaSet() {
+	this->next = 0;
+	this->wait = MPOOL_GTID_WAIT;
+	this->reads = 0;
+	this->fallbacks = 0;
+}
+
+ReplicaSet::~ReplicaSet() {
+	for (size_t i = 0; i < this->replicas.size(); i++) {
+		delete this->replicas[i];
+	}
+	this->replicas.clear();
+}
+
+void ReplicaSet::addReplica(DBPool *pool) {
+	this->replicas.push_back(pool);
+}
+
+size_t ReplicaSet::size() {
+	return this->replicas.size();
+}
+
+void ReplicaSet::setWait(unsigned long wait) {
+	this->wait = wait;
+}
+
+DBPool* ReplicaSet::pick() {
+	unsigned long start = __atomic_fetch_add(&this->next, 1, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < this->replicas.size(); i++) {
+		DBPool *pool = this->replicas[(start + i) % this->replicas.size()];
+		if (pool) {
+			return pool;
+		}
+	}
+	return NULL;
+}
+
+bool ReplicaSet::waitFor(DB *db_con, const std::string &gtid, bool wait) {
+	if (!ReplicaSet::isGtidSet(gtid)) {
+		return false;
+	}
+	// GTID_SUBSET answers at once, 1 when applied; WAIT_FOR_EXECUTED_GTID_SET
+	// 0 when applied, 1 on timeout, a timeout of 0 waiting forever;
+	std::stringstream ss;
+	if (wait) {
+		ss << "SELECT WAIT_FOR_EXECUTED_GTID_SET('" << gtid << "', "
+				<< (double) (this->wait ? this->wait : 1) / 1000 << ")";
+	} else {
+		ss << "SELECT GTID_SUBSET('" << gtid << "', @@GLOBAL.gtid_executed)";
+	}
+	MYSQL_RES *res = NULL;
+	if (!db_con->execute(ss.str(), &res) || !res) {
+		return false;
+	}
+	MYSQL_ROW row = mysql_fetch_row(res);
+	bool applied = row && row[0] && (wait ? '0' : '1') == row[0][0]
+			&& !row[0][1];
+	mysql_free_result(res);
+	return applied;
+}
+
+void ReplicaSet::record(bool replica) {
+	__atomic_add_fetch(replica ? &this->reads : &this->fallbacks, 1,
+			__ATOMIC_RELAXED);
+}
+
+unsigned long long ReplicaSet::getReads() {
+	return __atomic_load_n(&this->reads, __ATOMIC_RELAXED);
+}
+
+unsigned long long ReplicaSet::getFallbacks() {
+	return __atomic_load_n(&this->fallbacks, __ATOMIC_RELAXED);
+}
+
+bool ReplicaSet::isGtidSet(const std::string &gtid) {
+	// uuid[:tag]:interval[:interval]..., joined by commas;
+	for (size_t i = 0; i < gtid.size(); i++) {
+		char c = gtid[i];
+		if (!isalnum((unsigned char) c) && !strchr("-:,_ \n\r\t", c)) {
+			return false;
+		}
+	}
+	return !gtid.empty();
+}
+
+}
@@ -26,6 +26,7 @@
 #include <sstream>
 #include <list>
 #include <queue>
+#include <deque>
 #include <vector>
 #include <map>
 #include <exception>
@@ -34,13 +35,18 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <linux/version.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <time.h>
 #include <signal.h>
 #include <syslog.h>
 #include <pthread.h>
@@ -50,30 +56,88 @@
 #include <mysql.h>
 #include "include/version.h"
 #include "include/DBPool.h"
+#include "include/ConcurrencyLimiter.h"
+#include "include/RateLimiter.h"
+#include "include/ShardRouter.h"
+#include "include/ReplicaSet.h"
+#include "include/InsertBatcher.h"
+#include "include/WriteSpool.h"
+#include "include/SnapshotCache.h"
+#include "include/FrameCompressor.h"
+#include "include/BulkLoad.h"
+#include "include/IOUring.h"
+#include "include/TimerWheel.h"
+#include "include/ShmChannel.h"
+#include "include/MemoryAccount.h"
 #include "include/Client.h"
+#include "include/ConnectionTable.h"
+#include "include/FrameTemplate.h"
+#include "include/MySQLProtocol.h"
 #include "include/Manager.h"
 #include "include/Server.h"
 #include "include/ServerException.h"
 
+/// Tags the epoll data of a shared memory doorbell, handles stay below 2^61
+#define MPOOL_EPOLL_DOORBELL (1ULL << 63)
+
 namespace MPool {
 
+/// Numbers of the protocol are strings, plain JSON numbers are accepted too;
+static unsigned long toNumber(const Json::Value &value) {
+	if (value.isString()) {
+		return strtoul(value.asString().c_str(), NULL, 10);
+	}
+	return value.isNumeric() ? (unsigned long) value.asDouble() : 0;
+}
+
 Server::Server() {
 	this->support_protocol_versions.push_back(MPOOL_PROTOCOL_VERSION);
 	this->jsonReader = new Json::Reader(Json::Features::strictMode());
 	this->jsonWriter = new Json::FastWriter();
 	// Default value;
 	this->max_connections = 2000;
+	this->listen_backlog = MPOOL_EPOLL_LISTEN;
 	this->port = 3840;
 	this->workers = 4;
-	this->clients = new std::map<int, MPool::Client*>();
-	this->gc_tid = 0;
+	// One slot per possible fd, grows when the limit is raised;
+	unsigned long capacity = 1024;
+	struct rlimit rl;
+	if (0 == getrlimit(RLIMIT_NOFILE, &rl) && RLIM_INFINITY != rl.rlim_cur) {
+		capacity = rl.rlim_cur > (1 << 20) ? (1 << 20) : rl.rlim_cur;
+	}
+	this->clients = new ConnectionTable(capacity);
 	this->manager = NULL;
 	this->db_pool = NULL;
+	this->router = NULL;
+	this->replicas = NULL;
+	this->batcher = NULL;
+	this->spool = NULL;
+	this->snapshots = NULL;
+	this->compressor = NULL;
+	this->bulk_window = MPOOL_BULK_WINDOW;
+	this->bulk_timeout = MPOOL_BULK_DEADLINE;
 	this->socket_fd = 0;
+	this->unix_fd = 0;
+	this->mysql_fd = 0;
 	this->running = false;
-	this->gc_running = false;
 	this->epoll_fd = 0;
 	this->pool_size = 4;
+	this->session_grace = MPOOL_SESSION_GRACE;
+	this->spill_threshold = MPOOL_SPILL_THRESHOLD;
+	this->max_request_size = MPOOL_MAX_REQUEST_SIZE;
+	this->max_result_size = 0;
+	this->max_client_memory = 0;
+	this->max_memory = 0;
+	this->cursor_timeout = MPOOL_CURSOR_TIMEOUT;
+	this->max_cursors = MPOOL_MAX_CURSORS;
+	this->queue_wait_target = 0;
+	this->max_queue_depth = 0;
+	this->max_inflight = 0;
+	this->max_client_inflight = 0;
+	this->shed = 0;
+	this->uring = NULL;
+	this->timers = new TimerWheel();
+	this->status_template = new FrameTemplate();
 	pthread_mutex_init(&this->client_mutex, NULL);
 }
 
@@ -83,6 +147,8 @@ Server::~Server() {
 	delete this->jsonWriter;
 	delete this->jsonReader;
 	delete this->clients;
+	delete this->timers;
+	delete this->status_template;
 }
 
 bool Server::isSocketVal(int fd) {
@@ -113,11 +179,23 @@ void Server::socketMessage(int s, const char *status, const char *code,
 #ifdef DEBUG
 	std::cout<<str<<std::endl;
 #endif
+	this->sendFrame(s, str);
+}
+
+void Server::sendFrame(int s, const std::string &str) {
+	Client *client = this->findClient(s);
+	if (client && client->getShm()) {
+		client->sendData(str);
+		return;
+	}
+	if (this->uring) {
+		this->uring->send(s, str);
+		return;
+	}
 	if (this->isSocketVal(s)) {
 		ssize_t sent = 0;
 		while (sent < (ssize_t) str.length()) {
-			ssize_t psent = write(s, str.substr(sent).c_str(),
-					str.substr(sent).length());
+			ssize_t psent = write(s, str.data() + sent, str.length() - sent);
 			if (-1 == psent) {
 				if (EAGAIN == errno) {
 					//Sleep a while and try again;
@@ -126,7 +204,8 @@ void Server::socketMessage(int s, const char *status, const char *code,
 				} else {
 					std::cout << "(Server) Send Socket Data Error: "
 							<< strerror(errno) << std::endl;
-					close(s);
+					// The reactor closes it, the fd stays reserved until then;
+					shutdown(s, SHUT_RDWR);
 					break;
 				}
 			}
@@ -144,30 +223,78 @@ void Server::clientMessage(Client *client, const char *status, const char *code,
 }
 
 void Server::doCleanWorks() {
-	if (!this->clients->empty()) {
+	// Detached sessions are not in the connection table;
+	for (std::map<std::string, Client*>::iterator it = this->sessions.begin();
+			it != this->sessions.end(); it++) {
+		if (!it->second->getSocket()) {
+			DB *db_con = it->second->getDBConnection();
+			DBPool *db_pool = it->second->getDBPool();
+			delete it->second;
+			db_pool->freeDB(db_con);
+		}
+	}
+	this->sessions.clear();
+	if (this->clients->size()) {
 #ifdef DEBUG
 		std::cout<<"Cleaning clients"<<std::endl;
 #endif
-		for (std::map<int, MPool::Client*>::iterator it =
-				this->clients->begin(); it != this->clients->end(); it++) {
-			Client *client = it->second;
-			this->db_pool->freeDB(client->getDBConnection());
+		for (unsigned long fd = 0; fd < this->clients->capacity(); fd++) {
+			Client *client = this->clients->get(fd);
+			if (!client) {
+				continue;
+			}
+			this->clients->close(fd);
+			DB *db_con = client->getDBConnection();
+			DBPool *db_pool = client->getDBPool();
 			delete client;
-			this->clients->erase(it);
+			db_pool->freeDB(db_con);
 		}
 	}
 #ifdef DEBUG
 	std::cout<<"Stop the manager"<<std::endl;
 #endif
-	this->manager->stop();
+	if (this->manager) {
+		// NULL when the default pool failed to start;
+		this->manager->stop();
+	}
 #ifdef DEBUG
 	std::cout<<"Free the manager"<<std::endl;
 #endif
 	delete this->manager;
+	this->manager = NULL;
+	// Drained until here, the rest is replayed on the next start;
+	delete this->spool;
+	this->spool = NULL;
+	// Stops the refresher before its pool goes;
+	delete this->snapshots;
+	this->snapshots = NULL;
+	delete this->compressor;
+	this->compressor = NULL;
 #ifdef DEBUG
 	std::cout<<"Cleaning DB Connection Pool"<<std::endl;
 #endif
+	// Twice when init() fails, once more in the destructor;
 	delete this->db_pool;
+	this->db_pool = NULL;
+	for (std::map<std::string, DBPool*>::iterator it = this->user_pools.begin();
+			it != this->user_pools.end(); it++) {
+		delete it->second;
+	}
+	this->user_pools.clear();
+	delete this->router;
+	this->router = NULL;
+	delete this->replicas;
+	this->replicas = NULL;
+	// After the clients, they leave the batches they wait for;
+	delete this->batcher;
+	this->batcher = NULL;
+	for (std::map<std::string, RateLimiter*>::iterator it =
+			this->user_rates.begin(); it != this->user_rates.end(); it++) {
+		delete it->second;
+	}
+	this->user_rates.clear();
+	delete this->uring;
+	this->uring = NULL;
 }
 
 void Server::init(const char *config_file, const char *user_list_file) {
@@ -185,29 +312,226 @@ void Server::init(const char *config_file, const char *user_list_file) {
 void Server::reload() {
 	this->readConfigFile(this->config_file.c_str());
 	this->readUserListFile(this->user_list_file.c_str());
-	// Initialize DB Connection Pool;
-	this->db_pool = new DBPool();
-	if (!this->db_pool) {
-		throw ServerException(ServerException::DB_CONNECTION_FAIL);
+	if (!this->setFileLimit(atol(this->config["max_open_files"].c_str()))) {
+		syslog(LOG_WARNING, "Cannot raise RLIMIT_NOFILE to %s",
+				this->config["max_open_files"].c_str());
 	}
+	// Initialize DB Connection Pool;
 #ifdef DEBUG
 	std::cout<<"Starting DB Connection Pool"<<std::endl;
 #endif
-	if (!this->db_pool->start(this->config["mysql_host"],
-			this->config["mysql_user"], this->config["mysql_pass"],
-			this->config["mysql_db"],
-			atoi(this->config["mysql_port"].c_str()))) {
+	this->db_pool = this->openPool(this->config);
+	if (!this->db_pool) {
 		this->doCleanWorks();
 		throw ServerException(ServerException::DB_CONNECTION_FAIL);
 	}
-#ifdef DEBUG
-	std::cout<<"Set DB Pool Size:"<<this->pool_size<<std::endl;
-#endif
-	this->db_pool->setMinAlives(this->pool_size);
+	for (std::map<std::string, std::map<std::string, std::string> >::iterator it =
+			this->user_backends.begin(); it != this->user_backends.end();
+			it++) {
+		// A failing backend only locks out its own user;
+		this->user_pools[it->first] = this->openPool(it->second);
+		if (!this->user_pools[it->first]) {
+			syslog(LOG_ERR, "Fail to start the DB pool of user %s",
+					it->first.c_str());
+		}
+	}
+	if (!this->replica_backends.empty()) {
+		this->replicas = new ReplicaSet();
+		this->replicas->setWait(
+				strtoul(this->config["mysql_gtid_wait"].c_str(), NULL, 10));
+		for (size_t i = 0; i < this->replica_backends.size(); i++) {
+			// Reads skip a replica that cannot connect;
+			DBPool *replica_pool = this->openPool(this->replica_backends[i]);
+			if (!replica_pool) {
+				syslog(LOG_ERR, "Fail to start the DB pool of replica %lu",
+						(unsigned long) i);
+			}
+			this->replicas->addReplica(replica_pool);
+		}
+	}
+	if (!this->shard_backends.empty()) {
+		this->router = new ShardRouter();
+		this->router->setMode(
+				this->config["shard_mode"].compare("range") ?
+						ShardRouter::HASH : ShardRouter::RANGE);
+		this->router->setColumn(this->config["shard_column"]);
+		for (size_t i = 0; i < this->shard_backends.size(); i++) {
+			// A failing shard only fails the statements routed to it;
+			DBPool *shard_pool = this->openPool(this->shard_backends[i]);
+			if (!shard_pool) {
+				syslog(LOG_ERR, "Fail to start the DB pool of shard %lu",
+						(unsigned long) i);
+			}
+			this->router->addShard(shard_pool,
+					strtoll(this->shard_backends[i]["range_end"].c_str(),
+							NULL, 10));
+		}
+		this->router->start(this->shard_backends.size() - 1);
+	}
+	if (!this->config["spool_file"].empty()) {
+		this->spool = new WriteSpool();
+		if (!this->spool->open(this->config["spool_file"],
+				strtoul(this->config["spool_size"].c_str(), NULL, 10))) {
+			syslog(LOG_ERR, "Fail to open the write spool %s: %s",
+					this->config["spool_file"].c_str(), strerror(errno));
+			this->doCleanWorks();
+			throw ServerException(ServerException::SPOOL_OPEN_FAIL);
+		}
+		const std::string &sync = this->config["spool_sync"];
+		this->spool->setSync(
+				!sync.compare("always") ? WriteSpool::SYNC_ALWAYS :
+				!sync.compare("none") ?
+						WriteSpool::SYNC_NONE : WriteSpool::SYNC_INTERVAL,
+				strtoul(this->config["spool_sync_interval"].c_str(), NULL, 10));
+		this->spool->setBatch(
+				strtoul(this->config["spool_batch"].c_str(), NULL, 10));
+		// Same pools as the queries of the users;
+		this->spool->setDefaultPool(this->db_pool);
+		for (std::map<std::string, DBPool*>::iterator it =
+				this->user_pools.begin(); it != this->user_pools.end(); it++) {
+			this->spool->setPool(it->first, it->second);
+		}
+		this->spool->start();
+	}
+	if (!this->snapshot_queries.empty()) {
+		this->snapshots = new SnapshotCache();
+		for (size_t i = 0; i < this->snapshot_queries.size(); i++) {
+			// Comma separated, empty for any authorized user;
+			std::vector<std::string> users;
+			std::stringstream list(this->snapshot_queries[i]["users"]);
+			std::string user;
+			while (std::getline(list, user, ',')) {
+				users.push_back(user);
+			}
+			this->snapshots->add(this->snapshot_queries[i]["name"],
+					this->snapshot_queries[i]["sql"],
+					strtoul(this->snapshot_queries[i]["refresh"].c_str(), NULL,
+							10), users);
+		}
+		this->snapshots->setPool(this->db_pool);
+		this->snapshots->start();
+	}
+	this->compressor = new FrameCompressor();
+	this->compressor->setLimits(
+			strtoul(this->config["compress_threshold"].c_str(), NULL, 10),
+			atoi(this->config["compress_level"].c_str()));
+	unsigned long batch_window = strtoul(
+			this->config["insert_batch_window"].c_str(), NULL, 10);
+	if (batch_window) {
+		this->batcher = new InsertBatcher();
+		this->batcher->setLimits(batch_window,
+				strtoul(this->config["insert_batch_rows"].c_str(), NULL, 10));
+		this->batcher->setWake(Server::wakeMember, this);
+	}
 #ifdef DEBUG
 	std::cout<<"Initializing manager"<<std::endl;
 #endif
 	this->manager = new Manager(this->workers);
+	for (std::map<std::string, unsigned int>::iterator it =
+			this->user_workers.begin(); it != this->user_workers.end(); it++) {
+		this->manager->setMaxWorkers(it->first, it->second);
+	}
+	this->buildTemplates();
+}
+
+DBPool* Server::openPool(std::map<std::string, std::string> &backend) {
+	DBPool *db_pool = new DBPool();
+	db_pool->setTrackGtids(!backend["mysql_track_gtids"].compare("true"));
+	if (!db_pool->start(backend["mysql_host"], backend["mysql_user"],
+			backend["mysql_pass"], backend["mysql_db"],
+			atoi(backend["mysql_port"].c_str()))) {
+		delete db_pool;
+		return NULL;
+	}
+#ifdef DEBUG
+	std::cout<<"Set DB Pool Size:"<<backend["pool_size"]<<std::endl;
+#endif
+	db_pool->setMinAlives(atoi(backend["pool_size"].c_str()));
+	db_pool->getLimiter()->setLimits(
+			!backend["mysql_adaptive_limit"].compare("true"),
+			atoi(backend["mysql_min_limit"].c_str()),
+			atoi(backend["mysql_max_limit"].c_str()));
+	return db_pool;
+}
+
+DBPool* Server::getPool(const std::string &username) {
+	std::map<std::string, DBPool*>::iterator it = this->user_pools.find(
+			username);
+	return it == this->user_pools.end() ? this->db_pool : it->second;
+}
+
+void Server::buildTemplates() {
+	Json::Value root;
+	root["protocol_version"] = MPOOL_PROTOCOL_VERSION;
+	root["status"] = "SUCCESS";
+	root["code"] = "T001";
+	root["message"] = "Heartbeat";
+	root["data"] = "";
+	this->heartbeat_frame = FrameTemplate::frame(this->jsonWriter->write(root));
+	// Slot 0: clients, 1: sessions, 2-7: memory, 8-11: load, 12-15: limiter,
+	// 16-21: user, 22-23: replicas, 24-25: batches, 26-29: spool,
+	// 30-32: snapshots, 33-36: compression;
+	Json::Value data;
+	data["server_version"] = MPOOL_SERVER_VERSION;
+	data["clients"] = FrameTemplate::slot(0);
+	data["sessions"] = FrameTemplate::slot(1);
+	Json::Value memory;
+	memory["receive"] = FrameTemplate::slot(2);
+	memory["queued"] = FrameTemplate::slot(3);
+	memory["results"] = FrameTemplate::slot(4);
+	memory["output"] = FrameTemplate::slot(5);
+	memory["total"] = FrameTemplate::slot(6);
+	memory["client"] = FrameTemplate::slot(7);
+	data["memory"] = memory;
+	Json::Value load;
+	load["pending"] = FrameTemplate::slot(8);
+	load["inflight"] = FrameTemplate::slot(9);
+	load["queue_delay"] = FrameTemplate::slot(10);
+	load["shed"] = FrameTemplate::slot(11);
+	data["load"] = load;
+	Json::Value limiter;
+	limiter["running"] = FrameTemplate::slot(12);
+	limiter["limit"] = FrameTemplate::slot(13);
+	limiter["rtt"] = FrameTemplate::slot(14);
+	limiter["min_rtt"] = FrameTemplate::slot(15);
+	data["limiter"] = limiter;
+	Json::Value user;
+	user["pool_hits"] = FrameTemplate::slot(16);
+	user["pool_misses"] = FrameTemplate::slot(17);
+	user["pool_waits"] = FrameTemplate::slot(18);
+	user["running"] = FrameTemplate::slot(19);
+	user["queued"] = FrameTemplate::slot(20);
+	user["rate_limited"] = FrameTemplate::slot(21);
+	data["user"] = user;
+	Json::Value replicas;
+	replicas["reads"] = FrameTemplate::slot(22);
+	replicas["fallbacks"] = FrameTemplate::slot(23);
+	data["replicas"] = replicas;
+	Json::Value batches;
+	batches["batches"] = FrameTemplate::slot(24);
+	batches["rows"] = FrameTemplate::slot(25);
+	data["batches"] = batches;
+	Json::Value spool;
+	spool["pending"] = FrameTemplate::slot(26);
+	spool["bytes"] = FrameTemplate::slot(27);
+	spool["applied"] = FrameTemplate::slot(28);
+	spool["failed"] = FrameTemplate::slot(29);
+	data["spool"] = spool;
+	Json::Value snapshots;
+	snapshots["refreshes"] = FrameTemplate::slot(30);
+	snapshots["failures"] = FrameTemplate::slot(31);
+	snapshots["hits"] = FrameTemplate::slot(32);
+	data["snapshots"] = snapshots;
+	Json::Value compression;
+	compression["frames"] = FrameTemplate::slot(33);
+	compression["bytes_in"] = FrameTemplate::slot(34);
+	compression["bytes_out"] = FrameTemplate::slot(35);
+	compression["time"] = FrameTemplate::slot(36);
+	data["compression"] = compression;
+	data["workers"] = this->workers;
+	root["message"] = "Success";
+	root["data"] = this->jsonWriter->write(data);
+	this->status_template->compile(this->jsonWriter->write(root));
 }
 
 void Server::readConfigFile(const char *config_file) {
@@ -268,11 +592,246 @@ void Server::readConfigFile(const char *config_file) {
 			mysql_json.isMember("pool_size") ?
 					mysql_json["pool_size"].asString() : ss.str();
 	this->pool_size = atoi(this->config["pool_size"].c_str());
+	// Adaptive limit of the statements running on the backend;
+	this->config["mysql_adaptive_limit"] =
+			mysql_json.isMember("adaptive_limit") ?
+					mysql_json["adaptive_limit"].asString() : "false";
+	this->config["mysql_min_limit"] =
+			mysql_json.isMember("min_limit") ?
+					mysql_json["min_limit"].asString() : "1";
+	ss.str("");
+	ss << MPOOL_LIMIT_MAX;
+	this->config["mysql_max_limit"] =
+			mysql_json.isMember("max_limit") ?
+					mysql_json["max_limit"].asString() : ss.str();
+	this->config["shm_ring_size"] =
+			root.isMember("shm_ring_size") ?
+					root["shm_ring_size"].asString() : "1048576";
+	// MySQL protocol front-end, disabled when 0;
+	this->config["mysql_listen_port"] =
+			root.isMember("mysql_listen_port") ?
+					root["mysql_listen_port"].asString() : "0";
+	// Local clients, disabled when empty;
+	this->config["unix_socket"] =
+			root.isMember("unix_socket") ?
+					root["unix_socket"].asString() : "";
+	this->config["unix_socket_mode"] =
+			root.isMember("unix_socket_mode") ?
+					root["unix_socket_mode"].asString() : "0660";
+	this->config["io_backend"] =
+			root.isMember("io_backend") ?
+					root["io_backend"].asString() : "epoll";
+	ss.str("");
+	ss << this->listen_backlog;
+	this->config["listen_backlog"] =
+			root.isMember("listen_backlog") ?
+					root["listen_backlog"].asString() : ss.str();
+	this->listen_backlog = atoi(this->config["listen_backlog"].c_str());
+	ss.str("");
+	ss << this->session_grace;
+	this->config["session_grace"] =
+			root.isMember("session_grace") ?
+					root["session_grace"].asString() : ss.str();
+	this->session_grace = atol(this->config["session_grace"].c_str());
+	ss.str("");
+	ss << this->cursor_timeout;
+	this->config["cursor_timeout"] =
+			root.isMember("cursor_timeout") ?
+					root["cursor_timeout"].asString() : ss.str();
+	this->cursor_timeout = atol(this->config["cursor_timeout"].c_str());
+	ss.str("");
+	ss << this->max_cursors;
+	this->config["max_cursors"] =
+			root.isMember("max_cursors") ?
+					root["max_cursors"].asString() : ss.str();
+	this->max_cursors = atoi(this->config["max_cursors"].c_str());
+	// Larger responses go to unlinked temp files, 0 to keep them in memory;
+	ss.str("");
+	ss << this->spill_threshold;
+	this->config["spill_threshold"] =
+			root.isMember("spill_threshold") ?
+					root["spill_threshold"].asString() : ss.str();
+	this->spill_threshold = strtoul(this->config["spill_threshold"].c_str(),
+			NULL, 10);
+	this->config["spill_dir"] =
+			root.isMember("spill_dir") ? root["spill_dir"].asString() : "/tmp";
+	// Memory limits in bytes, 0 for no limit;
+	const char *limits[] = { "max_request_size", "max_result_size",
+			"max_client_memory", "max_memory" };
+	size_t *values[] = { &this->max_request_size, &this->max_result_size,
+			&this->max_client_memory, &this->max_memory };
+	for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+		ss.str("");
+		ss << *values[i];
+		this->config[limits[i]] =
+				root.isMember(limits[i]) ?
+						root[limits[i]].asString() : ss.str();
+		*values[i] = strtoul(this->config[limits[i]].c_str(), NULL, 10);
+	}
+	// Admission control, 0 for no limit;
+	const char *loads[] = { "max_queue_depth", "max_inflight",
+			"max_client_inflight" };
+	size_t *load_values[] = { &this->max_queue_depth, &this->max_inflight,
+			&this->max_client_inflight };
+	for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+		ss.str("");
+		ss << *load_values[i];
+		this->config[loads[i]] =
+				root.isMember(loads[i]) ? root[loads[i]].asString() : ss.str();
+		*load_values[i] = strtoul(this->config[loads[i]].c_str(), NULL, 10);
+	}
+	ss.str("");
+	ss << MPOOL_BULK_WINDOW;
+	this->config["bulk_window"] =
+			root.isMember("bulk_window") ?
+					root["bulk_window"].asString() : ss.str();
+	this->bulk_window = strtoul(this->config["bulk_window"].c_str(), NULL, 10);
+	// A trickling upload would hold a worker & a connection for good;
+	ss.str("");
+	ss << MPOOL_BULK_DEADLINE;
+	this->config["bulk_timeout"] =
+			root.isMember("bulk_timeout") ?
+					root["bulk_timeout"].asString() : ss.str();
+	this->bulk_timeout = strtoul(this->config["bulk_timeout"].c_str(), NULL,
+			10);
+	ss.str("");
+	ss << this->queue_wait_target;
+	this->config["queue_wait_target"] =
+			root.isMember("queue_wait_target") ?
+					root["queue_wait_target"].asString() : ss.str();
+	this->queue_wait_target = strtoull(
+			this->config["queue_wait_target"].c_str(), NULL, 10);
+	// Single-row INSERTs merged for up to insert_batch_window ms, 0 disables;
+	this->config["insert_batch_window"] =
+			root.isMember("insert_batch_window") ?
+					root["insert_batch_window"].asString() : "0";
+	ss.str("");
+	ss << MPOOL_BATCH_ROWS;
+	this->config["insert_batch_rows"] =
+			root.isMember("insert_batch_rows") ?
+					root["insert_batch_rows"].asString() : ss.str();
+	// Write-behind spool of the async statements, disabled when empty;
+	this->config["spool_file"] =
+			root.isMember("spool_file") ? root["spool_file"].asString() : "";
+	ss.str("");
+	ss << MPOOL_SPOOL_SIZE;
+	this->config["spool_size"] =
+			root.isMember("spool_size") ?
+					root["spool_size"].asString() : ss.str();
+	this->config["spool_sync"] =
+			root.isMember("spool_sync") ?
+					root["spool_sync"].asString() : "interval";
+	ss.str("");
+	ss << MPOOL_SPOOL_SYNC_INTERVAL;
+	this->config["spool_sync_interval"] =
+			root.isMember("spool_sync_interval") ?
+					root["spool_sync_interval"].asString() : ss.str();
+	ss.str("");
+	ss << MPOOL_SPOOL_BATCH;
+	this->config["spool_batch"] =
+			root.isMember("spool_batch") ?
+					root["spool_batch"].asString() : ss.str();
+	// Result frames compressed on request from compress_threshold bytes;
+	ss.str("");
+	ss << MPOOL_COMPRESS_THRESHOLD;
+	this->config["compress_threshold"] =
+			root.isMember("compress_threshold") ?
+					root["compress_threshold"].asString() : ss.str();
+	ss.str("");
+	ss << MPOOL_COMPRESS_LEVEL;
+	this->config["compress_level"] =
+			root.isMember("compress_level") ?
+					root["compress_level"].asString() : ss.str();
+	// Queries run in the background, replied from their last rows;
+	ss.str("");
+	ss << MPOOL_SNAPSHOT_REFRESH;
+	this->snapshot_queries.clear();
+	if (root.isMember("snapshots") && root["snapshots"].isArray()) {
+		for (unsigned int i = 0; i < root["snapshots"].size(); i++) {
+			Json::Value snapshot = root["snapshots"][i];
+			if (snapshot["name"].asString().empty()
+					|| snapshot["sql"].asString().empty()) {
+				syslog(LOG_WARNING, "Snapshot %u without name or sql ignored",
+						i);
+				continue;
+			}
+			this->snapshot_queries.push_back(
+					std::map<std::string, std::string>());
+			this->snapshot_queries.back()["name"] =
+					snapshot["name"].asString();
+			this->snapshot_queries.back()["sql"] = snapshot["sql"].asString();
+			this->snapshot_queries.back()["refresh"] =
+					snapshot.isMember("refresh") ?
+							snapshot["refresh"].asString() : ss.str();
+			std::string users;
+			for (unsigned int j = 0; j < snapshot["users"].size(); j++) {
+				users += (j ? "," : "") + snapshot["users"][j].asString();
+			}
+			this->snapshot_queries.back()["users"] = users;
+		}
+	}
+	// pinned: one DB connection per client, shared: one per statement;
+	this->config["connection_mode"] =
+			root.isMember("connection_mode") ?
+					root["connection_mode"].asString() : "pinned";
+	// Client sockets, plus their DB connections when pinned;
+	ss.str("");
+	ss << (this->max_connections
+			* (this->config["connection_mode"].compare("shared") ? 2 : 1)
+			+ MPOOL_RESERVED_FILES);
+	this->config["max_open_files"] =
+			root.isMember("max_open_files") ?
+					root["max_open_files"].asString() : ss.str();
+	// Read replicas of the primary, writes then return GTID tokens;
+	this->replica_backends.clear();
+	if (mysql_json.isMember("replicas") && mysql_json["replicas"].isArray()) {
+		for (unsigned int i = 0; i < mysql_json["replicas"].size(); i++) {
+			this->replica_backends.push_back(
+					std::map<std::string, std::string>());
+			this->readBackend(mysql_json["replicas"][i],
+					this->replica_backends.back());
+		}
+	}
+	this->config["mysql_track_gtids"] =
+			this->replica_backends.empty() ? "false" : "true";
+	ss.str("");
+	ss << MPOOL_GTID_WAIT;
+	this->config["mysql_gtid_wait"] =
+			mysql_json.isMember("gtid_wait") ?
+					mysql_json["gtid_wait"].asString() : ss.str();
+	// Shards: hash or range of the key to pools, disabled when empty;
+	Json::Value sharding = root["sharding"];
+	this->config["shard_mode"] =
+			sharding.isMember("mode") ? sharding["mode"].asString() : "hash";
+	this->config["shard_column"] =
+			sharding.isMember("column") ? sharding["column"].asString() : "";
+	this->shard_backends.clear();
+	if (sharding.isMember("shards") && sharding["shards"].isArray()) {
+		for (unsigned int i = 0; i < sharding["shards"].size(); i++) {
+			Json::Value shard = sharding["shards"][i];
+			this->shard_backends.push_back(
+					std::map<std::string, std::string>());
+			this->readBackend(shard, this->shard_backends.back());
+			this->shard_backends.back()["range_end"] =
+					shard.isMember("range_end") ?
+							shard["range_end"].asString() : "0";
+		}
+	}
 	fs.close();
 
 }
 void Server::readUserListFile(const char *user_list_file) {
 	this->user_list.clear();
+	this->user_priorities.clear();
+	this->user_weights.clear();
+	this->user_workers.clear();
+	this->user_backends.clear();
+	// Only read before the clients are created;
+	for (std::map<std::string, RateLimiter*>::iterator it =
+			this->user_rates.begin(); it != this->user_rates.end(); it++) {
+		delete it->second;
+	}
+	this->user_rates.clear();
 	std::fstream fs;
 	fs.open(user_list_file, std::ios_base::in);
 	if (!fs.is_open()) {
@@ -291,11 +850,81 @@ void Server::readUserListFile(const char *user_list_file) {
 		Json::Value v = root[i];
 		if (v.isObject()) {
 			this->user_list[v["user"].asString()] = v["pass"].asString();
+			// Scheduling, a normal user with weight 1 by default;
+			if (v.isMember("priority")) {
+				this->user_priorities[v["user"].asString()] =
+						Manager::parsePriority(v["priority"].asString(),
+								MPOOL_PRIORITY_NORMAL);
+			}
+			if (v.isMember("weight")) {
+				this->user_weights[v["user"].asString()] = toNumber(
+						v["weight"]);
+			}
+			// Bulkhead: workers the user may occupy at once;
+			if (v.isMember("max_workers")) {
+				this->user_workers[v["user"].asString()] = toNumber(
+						v["max_workers"]);
+			}
+			// Token bucket & query cap, checked by the reactor;
+			if (v.isMember("qps") || v.isMember("max_queries")) {
+				RateLimiter *&rate_limiter =
+						this->user_rates[v["user"].asString()];
+				if (!rate_limiter) {
+					rate_limiter = new RateLimiter();
+				}
+				rate_limiter->setLimits(
+						v["qps"].isString() ?
+								atof(v["qps"].asString().c_str()) :
+								(v["qps"].isNumeric() ? v["qps"].asDouble() : 0),
+						toNumber(v["burst"]), toNumber(v["max_queries"]));
+			}
+			// Own pool, missing settings come from the mysql section;
+			if (v.isMember("mysql") && v["mysql"].isObject()) {
+				this->readBackend(v["mysql"],
+						this->user_backends[v["user"].asString()]);
+			}
 		}
 	}
 	fs.close();
 }
 
+void Server::readBackend(Json::Value &json,
+		std::map<std::string, std::string> &backend) {
+	const char *keys[] = { "host", "user", "pass", "port", "db", "pool_size",
+			"adaptive_limit", "min_limit", "max_limit" };
+	for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+		std::string key =
+				strcmp(keys[k], "pool_size") ?
+						std::string("mysql_") + keys[k] : keys[k];
+		backend[key] =
+				json.isMember(keys[k]) ?
+						json[keys[k]].asString() : this->config[key];
+	}
+}
+
+bool Server::setFileLimit(unsigned long files) {
+	struct rlimit rl;
+	if (-1 == getrlimit(RLIMIT_NOFILE, &rl)) {
+		return false;
+	}
+	if (RLIM_INFINITY == rl.rlim_cur || rl.rlim_cur >= files) {
+		return true;
+	}
+	rl.rlim_cur = files;
+	if (RLIM_INFINITY != rl.rlim_max && rl.rlim_max < files) {
+		// Root may raise the hard limit too;
+		rl.rlim_max = files;
+		if (-1 == setrlimit(RLIMIT_NOFILE, &rl)) {
+			getrlimit(RLIMIT_NOFILE, &rl);
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+			return false;
+		}
+		return true;
+	}
+	return -1 != setrlimit(RLIMIT_NOFILE, &rl);
+}
+
 bool Server::setNoBlock(int fd) {
 	if (!fd) {
 		return false;
@@ -349,43 +978,195 @@ void Server::run() {
 		throw ServerException(ServerException::SOCKET_PORT_INUSE);
 	}
 	/* Step 2: Listen; */
-	if (listen(this->socket_fd, MPOOL_EPOLL_LISTEN) == -1) {
+	if (listen(this->socket_fd, this->listen_backlog) == -1) {
 		throw ServerException(ServerException::SOCKET_LISTEN_FAIL);
 	}
 	if (!this->setNoBlock(this->socket_fd)) {
 		throw ServerException(ServerException::SOCKET_NOBLOCK_FAIL);
 	}
-	struct epoll_event ev;
-	memset(&ev, 0, sizeof(struct epoll_event));
-	ev.events = EPOLLIN | EPOLLET;
-	ev.data.fd = this->socket_fd;
-	this->epoll_fd = epoll_create(MPOOL_EPOLL_LISTEN);
-	struct epoll_event events[MPOOL_EPOLL_LISTEN];
-	if (this->epoll_fd == -1) {
-		throw ServerException(ServerException::EPOLL_CREATE_FAIL);
+	if (!this->config["unix_socket"].empty()) {
+		this->listenUnix();
 	}
-	if (-1 == epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->socket_fd, &ev)) {
-		throw ServerException(ServerException::EPOLL_CTL_FAIL);
+	if (atoi(this->config["mysql_listen_port"].c_str())) {
+		this->listenMySQL();
 	}
 	openlog(MPOOL_LOG_IDENT, LOG_CONS | LOG_PID, LOG_USER);
-	syslog(LOG_INFO, "Server Started");
+	/* Step 3: I/O backend, epoll is the fallback; */
+	if (!this->config["io_backend"].compare("io_uring")) {
+		this->uring = new IOUring();
+		if (!this->uring->init(MPOOL_URING_ENTRIES, MPOOL_URING_BUFFERS,
+		MPOOL_URING_BUFFER_SIZE)) {
+			syslog(LOG_WARNING, "io_uring is not available, use epoll instead");
+			delete this->uring;
+			this->uring = NULL;
+		}
+	}
+	if (this->uring) {
+		this->uring->accept(this->socket_fd);
+		if (this->unix_fd) {
+			this->uring->accept(this->unix_fd);
+		}
+		if (this->mysql_fd) {
+			this->uring->accept(this->mysql_fd);
+		}
+	} else {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u64 = this->socket_fd;
+		this->epoll_fd = epoll_create(MPOOL_EPOLL_LISTEN);
+		if (this->epoll_fd == -1) {
+			throw ServerException(ServerException::EPOLL_CREATE_FAIL);
+		}
+		if (-1
+				== epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->socket_fd,
+						&ev)) {
+			throw ServerException(ServerException::EPOLL_CTL_FAIL);
+		}
+		ev.data.u64 = this->unix_fd;
+		if (this->unix_fd
+				&& -1
+						== epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD,
+								this->unix_fd, &ev)) {
+			throw ServerException(ServerException::EPOLL_CTL_FAIL);
+		}
+		ev.data.u64 = this->mysql_fd;
+		if (this->mysql_fd
+				&& -1
+						== epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD,
+								this->mysql_fd, &ev)) {
+			throw ServerException(ServerException::EPOLL_CTL_FAIL);
+		}
+	}
+	syslog(LOG_INFO, "Server Started, I/O backend: %s",
+			this->uring ? "io_uring" : "epoll");
 #ifdef DEBUG
 	std::cout<<"Starting the manager"<<std::endl;
 #endif
 	this->manager->start();
 #ifdef DEBUG
 	std::cout<<"Manager started"<<std::endl;
-#endif
-#ifdef DEBUG
-	std::cout<<"Starting GC thread"<<std::endl;
-#endif
-	this->startGc();
-#ifdef DEBUG
-	std::cout<<"GC thread started"<<std::endl;
 #endif
 	this->running = true;
+	if (this->uring) {
+		this->uringLoop();
+	} else {
+		this->epollLoop();
+		close(this->epoll_fd);
+	}
+	if (this->unix_fd) {
+		close(this->unix_fd);
+		unlink(this->config["unix_socket"].c_str());
+		this->unix_fd = 0;
+	}
+	if (this->mysql_fd) {
+		close(this->mysql_fd);
+		this->mysql_fd = 0;
+	}
+	syslog(LOG_INFO, "Server end without error");
+	closelog();
+}
+
+void Server::listenUnix() {
+	const std::string &path = this->config["unix_socket"];
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(struct sockaddr_un));
+	if (path.length() >= sizeof(sun.sun_path)) {
+		throw ServerException(ServerException::INVALID_CONFIG);
+	}
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path.c_str(), sizeof(sun.sun_path) - 1);
+	this->unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == this->unix_fd) {
+		this->unix_fd = 0;
+		throw ServerException(ServerException::SOCKET_BIND_FAIL);
+	}
+	// Left behind by a previous run, never remove anything but a socket;
+	struct stat st;
+	if (0 == lstat(path.c_str(), &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			syslog(LOG_ERR, "unix_socket %s exists and is not a socket",
+					path.c_str());
+			throw ServerException(ServerException::SOCKET_BIND_FAIL);
+		}
+		unlink(path.c_str());
+	}
+	// Created with its final permissions, no window with the default ones;
+	mode_t mode = strtol(this->config["unix_socket_mode"].c_str(), NULL, 8);
+	mode_t mask = umask(~mode & 0777);
+	int bound = bind(this->unix_fd, (struct sockaddr*) &sun,
+			sizeof(struct sockaddr_un));
+	umask(mask);
+	if (-1 == bound) {
+		throw ServerException(ServerException::SOCKET_BIND_FAIL);
+	}
+	if (-1 == listen(this->unix_fd, this->listen_backlog)) {
+		throw ServerException(ServerException::SOCKET_LISTEN_FAIL);
+	}
+	if (!this->setNoBlock(this->unix_fd)) {
+		throw ServerException(ServerException::SOCKET_NOBLOCK_FAIL);
+	}
+}
+
+void Server::listenMySQL() {
+	this->mysql_fd = socket(PF_INET, SOCK_STREAM, 0);
+	int opt = 1;
+	setsockopt(this->mysql_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(struct sockaddr_in));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons(atoi(this->config["mysql_listen_port"].c_str()));
+	if (-1
+			== bind(this->mysql_fd, (struct sockaddr*) &sin,
+					sizeof(struct sockaddr_in))) {
+		throw ServerException(ServerException::SOCKET_PORT_INUSE);
+	}
+	if (-1 == listen(this->mysql_fd, this->listen_backlog)) {
+		throw ServerException(ServerException::SOCKET_LISTEN_FAIL);
+	}
+	if (!this->setNoBlock(this->mysql_fd)) {
+		throw ServerException(ServerException::SOCKET_NOBLOCK_FAIL);
+	}
+	// Seed of the scrambles, so no state is kept before the handshake ends;
+	char secret[MPOOL_MYSQL_SCRAMBLE_LENGTH];
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (-1 == fd
+			|| (ssize_t) sizeof(secret) != read(fd, secret, sizeof(secret))) {
+		if (-1 != fd) {
+			close(fd);
+		}
+		throw ServerException(ServerException::SOCKET_LISTEN_FAIL);
+	}
+	close(fd);
+	this->mysql_secret.assign(secret, sizeof(secret));
+}
+
+bool Server::isListener(int fd) {
+	return fd == this->socket_fd || (this->unix_fd && fd == this->unix_fd)
+			|| (this->mysql_fd && fd == this->mysql_fd);
+}
+
+unsigned long long Server::openConnection(int listener, int fd) {
+	if (this->mysql_fd && listener == this->mysql_fd) {
+		unsigned long long handle = this->clients->open(fd, MPOOL_WIRE_MYSQL);
+		this->sendFrame(fd,
+				MySQLProtocol::handshake((unsigned int) handle,
+						MySQLProtocol::scramble(this->mysql_secret, handle)));
+		return handle;
+	}
+	return this->clients->open(fd);
+}
+
+void Server::epollLoop() {
+	struct epoll_event ev;
+	struct epoll_event events[MPOOL_EPOLL_LISTEN];
 	while (this->running) {
-		int nfds = epoll_wait(this->epoll_fd, events, MPOOL_EPOLL_LISTEN, 200);
+		this->gc();
+		// Woken in time to close the open batches;
+		int nfds = epoll_wait(this->epoll_fd, events, MPOOL_EPOLL_LISTEN,
+				this->batcher ?
+						this->batcher->getTimeout(Manager::now(), 200) : 200);
 		if (nfds == -1) {
 #ifdef DEBUG
 			std::cout<<"(Server)epoll wait error:"<<strerror(errno)
@@ -395,22 +1176,29 @@ void Server::run() {
 		}
 		int n = 0;
 		for (n = 0; n < nfds; n++) {
-			Client *client = NULL;
-			std::map<int, MPool::Client*>::iterator it = this->clients->find(
-					events[n].data.fd);
-			if (it != this->clients->end()) {
-				client = it->second;
+			if (events[n].data.u64 & MPOOL_EPOLL_DOORBELL) {
+				// Requests in the shared memory ring;
+				unsigned long long handle = events[n].data.u64
+						& ~MPOOL_EPOLL_DOORBELL;
+				if (this->clients->isValid(handle)) {
+					this->onDoorbell(ConnectionTable::getHandleFd(handle));
+				}
+				continue;
+			}
+			int fd = ConnectionTable::getHandleFd(events[n].data.u64);
+			if (!this->isListener(fd)
+					&& !this->clients->isValid(events[n].data.u64)) {
+				// The socket was closed and its fd reused, stale event;
+				continue;
 			}
-			if (events[n].data.fd == this->socket_fd) {
-				//New connection;
-				struct sockaddr_in new_sin;
-				socklen_t new_sin_len = sizeof(struct sockaddr);
+			Client *client = this->findClient(fd);
+			if (this->isListener(fd)) {
+				//New connection, TCP or unix socket;
 #ifdef DEBUG
 				std::cout<<"(Server)New connection, try to accept"<<std::endl;
 #endif
 				while (1) {
-					int new_socket = accept(this->socket_fd,
-							(struct sockaddr*) &new_sin, &new_sin_len);
+					int new_socket = accept(fd, NULL, NULL);
 					if (-1 == new_socket) {
 						// All connections have been established;
 						if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
@@ -433,7 +1221,7 @@ void Server::run() {
 #else
 					ev.events = EPOLLIN | EPOLLET;
 #endif
-					ev.data.fd = new_socket;
+					ev.data.u64 = this->openConnection(fd, new_socket);
 					if (-1
 							== epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD,
 									new_socket, &ev)) {
@@ -443,19 +1231,19 @@ void Server::run() {
 				}
 			} else {
 #ifdef DEBUG
-				std::cout<<"(Server)#Event: EPOLLIN="<<(events[n].events & EPOLLIN)<<" ,FD:"<< events[n].data.fd<<std::endl;
-				std::cout<<"(Server)#Event: EPOLLOUT="<<(events[n].events & EPOLLOUT)<<" ,FD:"<< events[n].data.fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLIN="<<(events[n].events & EPOLLIN)<<" ,FD:"<< fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLOUT="<<(events[n].events & EPOLLOUT)<<" ,FD:"<< fd<<std::endl;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
-				std::cout<<"(Server)#Event: EPOLLRDHUP="<<(events[n].events & EPOLLRDHUP)<<" ,FD:"<< events[n].data.fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLRDHUP="<<(events[n].events & EPOLLRDHUP)<<" ,FD:"<< fd<<std::endl;
 #endif
-				std::cout<<"(Server)#Event: EPOLLPRI="<<(events[n].events & EPOLLPRI)<<" ,FD:"<< events[n].data.fd<<std::endl;
-				std::cout<<"(Server)#Event: EPOLLERR="<<(events[n].events & EPOLLERR)<<" ,FD:"<< events[n].data.fd<<std::endl;
-				std::cout<<"(Server)#Event: EPOLLHUP="<<(events[n].events & EPOLLHUP)<<" ,FD:"<< events[n].data.fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLPRI="<<(events[n].events & EPOLLPRI)<<" ,FD:"<< fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLERR="<<(events[n].events & EPOLLERR)<<" ,FD:"<< fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLHUP="<<(events[n].events & EPOLLHUP)<<" ,FD:"<< fd<<std::endl;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,2)
-				std::cout<<"(Server)#Event: EPOLLONESHOT="<<(events[n].events & EPOLLONESHOT)<<" ,FD:"<< events[n].data.fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLONESHOT="<<(events[n].events & EPOLLONESHOT)<<" ,FD:"<< fd<<std::endl;
 #endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
-				std::cout<<"(Server)#Event: EPOLLWAKEUP="<<(events[n].events & EPOLLWAKEUP)<<" ,FD:"<< events[n].data.fd<<std::endl;
+				std::cout<<"(Server)#Event: EPOLLWAKEUP="<<(events[n].events & EPOLLWAKEUP)<<" ,FD:"<< fd<<std::endl;
 #endif
 #endif
 				bool normal_end = false;
@@ -463,20 +1251,14 @@ void Server::run() {
 				if ((events[n].events & EPOLLERR)
 						&& !(events[n].events & EPOLLIN)) {
 					std::cout << "(Server)epoll wait event error, FD:"
-							<< events[n].data.fd << ", Error:" << strerror(
+							<< fd << ", Error:" << strerror(
 							errno) << std::endl;
 					if (EAGAIN != errno && ENOTSUP != errno) {
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
+						this->dropConnection(fd, client);
 					} else {
 						std::cout
 								<< "(Server)EAGAIN/ENOTSUP for epoll wait, sleep a while & try again, FD:"
-								<< events[n].data.fd << std::endl;
+								<< fd << std::endl;
 					}
 					continue;
 				}
@@ -485,16 +1267,9 @@ void Server::run() {
 						&& !(events[n].events & EPOLLIN)) {
 					// Connection closed by client;
 #ifdef DEBUG
-					std::cout<<"(Server)Connection closed by client: "<<events[n].data.fd<<std::endl;
+					std::cout<<"(Server)Connection closed by client: "<<fd<<std::endl;
 #endif
-					if (!client) {
-						// Garbage Connection;
-						this->closeSocket(events[n].data.fd);
-					} else {
-						if (!client->isBusy() && client->getWorks() <= 0) {
-							this->normalEnd(client);
-						}
-					}
+					this->dropConnection(fd, client);
 					continue;
 				}
 #endif
@@ -503,13 +1278,13 @@ void Server::run() {
 					std::string buffer = "";
 					buffer.clear();
 #ifdef DEBUG
-					std::cout<<"(Server)Start reading, FD:"<<events[n].data.fd<<std::endl;
+					std::cout<<"(Server)Start reading, FD:"<<fd<<std::endl;
 #endif
 					bool client_close = false;
 					while (!normal_end) {
 						char buf[257];
 						memset(buf, 0, sizeof(buf));
-						int rv = read(events[n].data.fd, buf, 256);
+						int rv = read(fd, buf, 256);
 						switch (rv) {
 						case 0:
 							// Connection closed by client;
@@ -532,295 +1307,622 @@ void Server::run() {
 							}
 							break;
 						default:
-							buffer += buf;
+							// Binary safe, MySQL packets carry NUL bytes;
+							buffer.append(buf, rv);
 							break;
 						}
 
 					}
-#ifdef DEBUG
-					std::cout<<"(Server)Read length:"<<buffer.size()<<std::endl;
-#endif
-					// Package Length, first 16 characters;
-					if (!buffer.empty() && buffer.size() < 16) {
-						// Wrong package length;
-#ifdef DEBUG
-						std::cout<<"(Server)Wrong package length, FD:"<<events[n].data.fd<<std::endl;
-						std::cout<<buffer<<std::endl;
-#endif
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
-					}
-					// Connection closed by client;
-					if (buffer.empty() || (error_end && buffer.empty())
-							|| (client_close && buffer.empty())) {
-#ifdef DEBUG
-						std::cout<<"(Server)Connection closed by client, FD:"<<events[n].data.fd<<std::endl;
-#endif
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
-					}
-					const std::string len_str = buffer.substr(0, 16);
-					ssize_t jsonLength = atol(len_str.c_str());
-					std::string jsonBuffer = buffer.substr(16);
-					if (!jsonLength
-							|| (ssize_t) jsonBuffer.size() != jsonLength) {
-						// Wrong package length;
-#ifdef DEBUG
-						std::cout<<"(Server)Package length is not matched with buffer, FD:"<<events[n].data.fd<<std::endl;
-#endif
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
+					if (buffer.empty()) {
+						this->onMessage(fd, buffer, client_close, error_end);
 						continue;
 					}
-					// Right trim;
-					jsonBuffer.erase(
-							jsonBuffer.find_last_not_of(" \n\r\t") + 1);
-#ifdef DEBUG
-					std::cout<<"(Server)JSON:"<<jsonBuffer<<std::endl;
-#endif
-					if (jsonBuffer.empty()) {
-#ifdef DEBUG
-						std::cout<<"(Server)Wrong Data, end of socket, FD:"<<events[n].data.fd<<std::endl;
-						if(error_end) {
-							std::cout<<"(Server)Error End, FD:"<<events[n].data.fd<<std::endl;
-							std::cout<<"(Server)Socket Error:"<<strerror(errno)
-							<< std::endl;
-						}
-#endif
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
+					// Several packages may arrive in one read;
+					unsigned int generation = this->clients->getGeneration(fd);
+					this->onData(fd, buffer);
+					if ((client_close || error_end)
+							&& this->clients->getGeneration(fd) == generation) {
+						this->dropConnection(fd, this->findClient(fd));
 					}
-#ifdef DEBUG
-					std::cout<<"(Server)Data received>"<<buffer<<std::endl;
-#endif
-					Json::Value root;
-
-					bool parsed = this->jsonReader->parse(jsonBuffer, root,
-							false);
+				}
+			}
+		}
+	}
+}
 
-					if (!parsed || !root.isMember("type")
-							|| !root.isMember("protocol_version")) {
-#ifdef DEBUG
-						std::cout<<"(Server)Fail to parse JSON, Wrong data, drop it"<<std::endl;
-#endif
-						// Wrong Data;
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
-					}
-					if (root["protocol_version"].asString().compare(
-					MPOOL_PROTOCOL_VERSION)) {
-#ifdef DEBUG
-						std::cout<<"(Server)Wrong protocol, drop it"<<std::endl;
-#endif
-						// Wrong Protocol Version;
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
-					}
-					if (this->clients->size() >= this->max_connections) {
-#ifdef DEBUG
-						std::cout<<"(Server)Too many connections"<<std::endl;
-#endif
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-						} else {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
-					}
-					if (!root["type"].asString().compare("query")) {
-#ifdef DEBUG
-						std::cout<<"(Server)Query Action"<<std::endl;
-#endif
-						// Normal query;
-						if (!client) {
-#ifdef DEBUG
-							std::cout<<"(Creating new client)"<<std::endl;
-#endif
-							client = new Client(root["username"].asString());
-							if (!client) {
-								syslog(LOG_ERR,
-										"Fail to collect memory to create client");
-								this->closeSocket(events[n].data.fd);
-								continue;
-							}
-							client->setSocket(events[n].data.fd);
-							DB *db_con = this->db_pool->allocDB();
-							if (!db_con) {
+void Server::uringLoop() {
+	std::vector<IOEvent> events;
+	while (this->running) {
+		this->gc();
+		if (-1
+				== this->uring->wait(events,
+						this->batcher ?
+								this->batcher->getTimeout(Manager::now(), 200) :
+								200)) {
+			continue;
+		}
+		for (std::vector<IOEvent>::iterator it = events.begin();
+				it != events.end(); it++) {
+			if (IOEvent::ACCEPT != it->type
+					&& !this->clients->isValid(
+							ConnectionTable::makeHandle(it->fd,
+									it->generation))) {
+				// The socket was closed and its fd reused, stale event;
+				continue;
+			}
+			switch (it->type) {
+			case IOEvent::ACCEPT:
 #ifdef DEBUG
-								std::cout<<"(Creating new client)Fail to get db connection from pool, FD:"<<events[n].data.fd<<std::endl;
+				std::cout<<"(Server)New connection is established, FD:"<<it->res<<std::endl;
 #endif
-								syslog(LOG_ERR,
-										"Fail to get db connection from pool");
-								delete client;
-								this->closeSocket(events[n].data.fd);
-								continue;
-							}
-							client->setDBConnection(db_con);
-							(*this->clients)[events[n].data.fd] = client;
-
-						}
-						if (!this->clientQueryAction(client, root)) {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						if (client_close) {
+				this->uring->recv(it->res,
+						ConnectionTable::getHandleGeneration(
+								this->openConnection(it->fd, it->res)));
+				break;
+			case IOEvent::RECV:
+				this->onData(it->fd, it->data);
+				break;
+			case IOEvent::READY:
+				this->onDoorbell(it->fd);
+				break;
+			case IOEvent::CLOSED:
+			case IOEvent::ERROR:
 #ifdef DEBUG
-							std::cout<<"(Server)Client closed the connection after send SQL, FD"<<events[n].data.fd<<std::endl;
+				std::cout<<"(Server)Connection closed, FD:"<<it->fd<<", Result:"<<it->res<<std::endl;
 #endif
-							// Wrong Data;
-							if (!client) {
-								this->closeSocket(events[n].data.fd);
-							} else {
-								if (!client->isBusy()
-										&& client->getWorks() <= 0) {
-									this->normalEnd(client);
-								}
-							}
-						}
-						continue;
-					}
-					if (!root["type"].asString().compare("status")) {
-						// Get server running information;
-						if (!client) {
-							this->closeSocket(events[n].data.fd);
-							continue;
-						}
-						if (!this->clientServerStatusAction(client, root)) {
-							if (!client->isBusy() && client->getWorks() <= 0) {
-								this->normalEnd(client);
-							}
-						}
-						continue;
-					}
-					// Garbage message, go to gc;
-					if (!client) {
-						this->closeSocket(events[n].data.fd);
-					} else {
-						if (!client->isBusy() && client->getWorks() <= 0) {
-							this->normalEnd(client);
-						}
-					}
-				}
+				this->dropConnection(it->fd, this->findClient(it->fd));
+				break;
 			}
 		}
 	}
-	close(this->epoll_fd);
-	syslog(LOG_INFO, "Server end without error");
-	closelog();
 }
 
-void Server::stop() {
-	this->running = false;
-	this->gc_running = false;
+void Server::onData(int fd, std::string &data) {
+	if (MPOOL_WIRE_MYSQL == this->clients->getWire(fd)) {
+		this->onMySQLData(fd, data);
+		return;
+	}
+	this->clients->takeBuffer(fd, data);
+	// Dispatch every complete package;
+	size_t offset = 0;
+	unsigned int generation = this->clients->getGeneration(fd);
+	while (data.size() - offset >= 16) {
+		size_t length = atol(data.substr(offset, 16).c_str());
+		if (!length) {
+			// Wrong package length, let onMessage drop the connection;
+			std::string garbage = data.substr(offset);
+			this->onMessage(fd, garbage, false, false);
+			return;
+		}
+		if (this->max_request_size && length > this->max_request_size) {
+			this->rejectRequest(fd);
+			return;
+		}
+		if (data.size() - offset < 16 + length) {
+			break;
+		}
+		std::string package = data.substr(offset, 16 + length);
+		offset += 16 + length;
+		this->onMessage(fd, package, false, false);
+		if (this->clients->getGeneration(fd) != generation) {
+			// Closed while handling the package;
+			return;
+		}
+	}
+	if (offset < data.size()) {
+		// Keep the partial package until the rest arrives;
+		this->clients->keepBuffer(fd, data, offset);
+	}
 }
 
-void Server::startGc() {
-	if (this->gc_tid) {
-		if (0 == pthread_kill(this->gc_tid, 0)) {
-			// Kill the thread if still alive;
-			pthread_kill(this->gc_tid, SIGKILL);
+void Server::onMySQLData(int fd, std::string &data) {
+	this->clients->takeBuffer(fd, data);
+	size_t offset = 0;
+	unsigned int generation = this->clients->getGeneration(fd);
+	while (true) {
+		// Join the packets of one payload;
+		std::string payload;
+		unsigned char seq = 0;
+		size_t pos = offset;
+		bool complete = false;
+		while (data.size() - pos >= 4) {
+			size_t length = (unsigned char) data[pos]
+					| ((unsigned char) data[pos + 1] << 8)
+					| ((unsigned char) data[pos + 2] << 16);
+			if (data.size() - pos - 4 < length) {
+				break;
+			}
+			seq = data[pos + 3];
+			payload.append(data, pos + 4, length);
+			pos += 4 + length;
+			if (length < MPOOL_MYSQL_MAX_PAYLOAD) {
+				complete = true;
+				break;
+			}
+		}
+		if (!complete) {
+			break;
+		}
+		offset = pos;
+		this->onMySQLPacket(fd, seq, payload);
+		if (this->clients->getGeneration(fd) != generation) {
+			// Closed while handling the packet;
+			return;
 		}
-		this->gc_tid = 0;
 	}
-	if (pthread_create(&this->gc_tid, 0, MPool::Server::threadStart, this)
-			!= 0) {
-		throw ServerException();
+	if (this->max_request_size && data.size() - offset > this->max_request_size) {
+		this->rejectRequest(fd);
+		return;
+	}
+	if (offset < data.size()) {
+		// Keep the partial packet until the rest arrives;
+		this->clients->keepBuffer(fd, data, offset);
 	}
-	pthread_detach(this->gc_tid);
-	this->gc_running = true;
 }
 
-void Server::gc() {
-	//Garbage Collection;
-	while (this->gc_running) {
+void Server::onMySQLPacket(int fd, unsigned char seq,
+		const std::string &payload) {
+	Client *client = this->findClient(fd);
+	if (!client) {
+		this->mysqlAuthAction(fd, seq, payload);
+		return;
+	}
+	if (payload.empty()) {
+		this->dropConnection(fd, client);
+		return;
+	}
+	std::string out;
+	unsigned char reply = 1;
+	switch ((unsigned char) payload[0]) {
+	case MySQLProtocol::COM_QUIT:
+		this->dropConnection(fd, client);
+		return;
+	case MySQLProtocol::COM_PING:
+		// Answered here, like heartbeats;
+		client->lastActive();
+		MySQLProtocol::appendPacket(out, reply, MySQLProtocol::ok());
+		this->sendFrame(fd, out);
+		return;
+	case MySQLProtocol::COM_INIT_DB:
+		if (std::string::npos != payload.find_first_of(std::string("`\0", 2), 1)
+				|| payload.size() < 2) {
+			MySQLProtocol::appendPacket(out, reply,
+					MySQLProtocol::error(1102, "42000",
+							"Incorrect database name"));
+		} else if (!client->getDBConnection()) {
+			// USE would change the schema of a pooled connection;
+			MySQLProtocol::appendPacket(out, reply,
+					MySQLProtocol::error(1235, "42000",
+							"COM_INIT_DB needs a pinned connection"));
+		} else {
+			this->queueSQL(client, "USE `" + payload.substr(1) + "`");
+			return;
+		}
+		if (client->isBusy() || client->getWorks() > 0) {
+			// Replied after the statements queued before;
+			client->pushSQL(out, Statement::FRAME);
+			this->manager->push(client);
+		} else {
+			this->sendFrame(fd, out);
+		}
+		return;
+	case MySQLProtocol::COM_QUERY:
+		this->queueSQL(client, payload.substr(1));
+		return;
+	default:
+		MySQLProtocol::appendPacket(out, reply,
+				MySQLProtocol::error(1047, "08S01", "Unknown command"));
+		this->sendFrame(fd, out);
+		return;
+	}
+}
+
+void Server::mysqlAuthAction(int fd, unsigned char seq,
+		const std::string &payload) {
+	std::string scramble = MySQLProtocol::scramble(this->mysql_secret,
+			ConnectionTable::makeHandle(fd, this->clients->getGeneration(fd)));
+	std::string user;
+	std::string auth;
+	std::string plugin;
+	std::string out;
+	unsigned char reply = seq + 1;
+	std::map<int, std::string>::iterator sit = this->mysql_auth_switch.find(
+			fd);
+	if (sit != this->mysql_auth_switch.end()) {
+		user = sit->second;
+		auth = payload;
+		this->mysql_auth_switch.erase(sit);
+	} else if (!MySQLProtocol::parseHandshakeResponse(payload, user, auth,
+			plugin)) {
+		this->closeSocket(fd);
+		return;
+	} else if (plugin.compare("mysql_native_password")) {
+		// e.g. caching_sha2_password, ask for the native one;
+		this->mysql_auth_switch[fd] = user;
+		MySQLProtocol::appendPacket(out, reply,
+				MySQLProtocol::authSwitch(scramble));
+		this->sendFrame(fd, out);
+		return;
+	}
+	std::map<std::string, std::string>::iterator it = this->user_list.find(
+			user);
+	if (it == this->user_list.end()
+			|| !MySQLProtocol::checkNativePassword(scramble, it->second,
+					auth)) {
+		MySQLProtocol::appendPacket(out, reply,
+				MySQLProtocol::error(1045, "28000",
+						"Access denied for user '" + user + "'"));
+		this->sendFrame(fd, out);
+		this->closeSocket(fd);
+		return;
+	}
+	Client *client = NULL;
+	if (this->clients->size() >= this->max_connections
+			|| !(client = this->createClient(fd, user))) {
+		MySQLProtocol::appendPacket(out, reply,
+				MySQLProtocol::error(1040, "08004", "Too many connections"));
+		this->sendFrame(fd, out);
+		this->closeSocket(fd);
+		return;
+	}
+	client->setWire(MPOOL_WIRE_MYSQL);
+	client->lastActive();
+	MySQLProtocol::appendPacket(out, reply, MySQLProtocol::ok());
+	this->sendFrame(fd, out);
+}
+
+Client* Server::createClient(int fd, const std::string &username) {
+#ifdef DEBUG
+	std::cout<<"(Creating new client)"<<std::endl;
+#endif
+	Client *client = new Client(username);
+	if (!client) {
+		syslog(LOG_ERR, "Fail to collect memory to create client");
+		return NULL;
+	}
+	std::map<std::string, unsigned char>::iterator priority =
+			this->user_priorities.find(username);
+	std::map<std::string, unsigned int>::iterator weight =
+			this->user_weights.find(username);
+	client->setSchedule(
+			priority == this->user_priorities.end() ?
+					MPOOL_PRIORITY_NORMAL : priority->second,
+			weight == this->user_weights.end() ? 1 : weight->second);
+	// Resolved once, the reactor reaches the bucket through the client;
+	std::map<std::string, RateLimiter*>::iterator rate =
+			this->user_rates.find(username);
+	if (rate != this->user_rates.end()) {
+		client->setRateLimiter(rate->second);
+	}
+	client->setShardRouter(this->router);
+	client->setReplicaSet(this->replicas);
+	client->setWriteSpool(this->spool);
+	client->setCompressor(this->compressor);
+	client->setSocket(fd);
+	client->setUring(this->uring);
+	client->setTimerWheel(this->timers);
+	client->setSpill(this->spill_threshold, this->config["spill_dir"].c_str());
+	client->setResultLimit(this->max_result_size);
+	client->setCursorLimit(this->max_cursors);
+	client->getMemory()->setParent(&this->memory);
+	// Borrowed by the worker for each statement when shared, the
+	// concurrency limit of the backend applies to both modes;
+	DBPool *db_pool = this->getPool(username);
+	if (!db_pool) {
+		syslog(LOG_ERR, "No DB pool for user %s", username.c_str());
+		delete client;
+		return NULL;
+	}
+	client->setDBPool(db_pool);
+	if (this->config["connection_mode"].compare("shared")) {
+		DB *db_con = db_pool->allocDB();
+		if (!db_con) {
 #ifdef DEBUG
-		std::cout<<"(GC Loop Start)"<<std::endl;
-		if(!this->clients->empty()) {
-			std::cout<<"(Server)Clients:"<<this->clients->size()<<std::endl;
+			std::cout<<"(Creating new client)Fail to get db connection from pool, FD:"<<fd<<std::endl;
+#endif
+			syslog(LOG_ERR, "Fail to get db connection from pool");
+			delete client;
+			return NULL;
+		}
+		client->setDBConnection(db_con);
+	}
+	this->clients->attach(fd, client);
+	return client;
+}
+
+Client* Server::resumeSession(int fd, const std::string &token) {
+	std::map<std::string, Client*>::iterator it = this->sessions.find(token);
+	if (it == this->sessions.end()) {
+		return NULL;
+	}
+	Client *client = it->second;
+	if (client->getSocket()) {
+		// The old socket is still open, take over when it is idle;
+		if (client->isBusy() || client->getWorks() > 0) {
+			return NULL;
 		}
+		this->closeSocket(client->getSocket());
+	}
+#ifdef DEBUG
+	std::cout<<"(Server)Session resumed, FD:"<<fd<<std::endl;
 #endif
-		for (std::map<int, MPool::Client*>::iterator it =
-				this->clients->begin(); it != this->clients->end(); it++) {
-			Client *client = it->second;
+	client->setSocket(fd);
+	this->clients->attach(fd, client);
+	client->lastActive();
+	return client;
+}
+
+void Server::destroyClient(Client *client) {
+	std::map<std::string, Client*>::iterator it = this->sessions.find(
+			client->getToken());
+	if (it != this->sessions.end() && it->second == client) {
+		this->sessions.erase(it);
+	}
+	// Open cursors are closed on the connection before it goes back;
+	DB *db_con = client->getDBConnection();
+	DBPool *db_pool = client->getDBPool();
+	delete client;
+	db_pool->freeDB(db_con);
+}
+
+Client* Server::findClient(int fd) {
+	return this->clients->get(fd);
+}
+
+void Server::dropConnection(int fd, Client *client) {
+	if (!client) {
+		this->closeSocket(fd);
+	} else {
+		if (client->getBulkLoad()) {
+			// Nobody sends the rest;
+			client->getBulkLoad()->abort("Connection closed");
+		}
+		if (!client->isBusy() && client->getWorks() <= 0) {
+			this->normalEnd(client);
+		}
+	}
+}
+
+void Server::onMessage(int fd, std::string &buffer, bool client_close,
+		bool error_end) {
+	Client *client = this->findClient(fd);
 #ifdef DEBUG
-			std::cout<<"(Server)Client:"<<client->getSocket()<<std::endl;
-			std::cout<<"Is timeout? "<<client->isTimeout()<<std::endl;
-			std::cout<<"Is busy? "<<client->isBusy()<<std::endl;
-			std::cout<<"Pending works: "<<client->getWorks()<<std::endl;
+	std::cout<<"(Server)Read length:"<<buffer.size()<<std::endl;
 #endif
-			if (client->isTimeout() && !client->isBusy()
-					&& client->getWorks() <= 0) {
-				pthread_mutex_lock(&this->client_mutex);
+	// Package Length, first 16 characters;
+	if (!buffer.empty() && buffer.size() < 16) {
+		// Wrong package length;
 #ifdef DEBUG
-				std::cout<<"(Server)Garbage collection for client:"<<client->getSocket()<<std::endl;
+		std::cout<<"(Server)Wrong package length, FD:"<<fd<<std::endl;
+		std::cout<<buffer<<std::endl;
 #endif
-				if (this->isSocketVal(client->getSocket())) {
-					if (-1 == close(client->getSocket())) {
+		this->dropConnection(fd, client);
+		return;
+	}
+	// Connection closed by client;
+	if (buffer.empty() || (error_end && buffer.empty())
+			|| (client_close && buffer.empty())) {
 #ifdef DEBUG
-						std::cout<<"(Server)Fail to close socket, FD: "<<client->getSocket()<<", Error: "<<strerror(errno)<<std::endl;
+		std::cout<<"(Server)Connection closed by client, FD:"<<fd<<std::endl;
 #endif
-					}
-				}
-				this->db_pool->freeDB((it->second)->getDBConnection());
-				delete it->second;
-				this->clients->erase(it);
-				pthread_mutex_unlock(&this->client_mutex);
-			}
+		this->dropConnection(fd, client);
+		return;
+	}
+	const std::string len_str = buffer.substr(0, 16);
+	ssize_t jsonLength = atol(len_str.c_str());
+	std::string jsonBuffer = buffer.substr(16);
+	if (!jsonLength || (ssize_t) jsonBuffer.size() != jsonLength) {
+		// Wrong package length;
+#ifdef DEBUG
+		std::cout<<"(Server)Package length is not matched with buffer, FD:"<<fd<<std::endl;
+#endif
+		this->dropConnection(fd, client);
+		return;
+	}
+	// Right trim;
+	jsonBuffer.erase(jsonBuffer.find_last_not_of(" \n\r\t") + 1);
+#ifdef DEBUG
+	std::cout<<"(Server)JSON:"<<jsonBuffer<<std::endl;
+#endif
+	if (jsonBuffer.empty()) {
+#ifdef DEBUG
+		std::cout<<"(Server)Wrong Data, end of socket, FD:"<<fd<<std::endl;
+		if(error_end) {
+			std::cout<<"(Server)Error End, FD:"<<fd<<std::endl;
+			std::cout<<"(Server)Socket Error:"<<strerror(errno)
+			<< std::endl;
 		}
+#endif
+		this->dropConnection(fd, client);
+		return;
+	}
+#ifdef DEBUG
+	std::cout<<"(Server)Data received>"<<buffer<<std::endl;
+#endif
+	Json::Value root;
+
+	bool parsed = this->jsonReader->parse(jsonBuffer, root, false);
+
+	if (!parsed || !root.isMember("type")
+			|| !root.isMember("protocol_version")) {
 #ifdef DEBUG
-		std::cout<<"(GC Loop End)"<<std::endl;
-		if(!this->clients->empty()) {
-			std::cout<<"(Server)Clients:"<<this->clients->size()<<std::endl;
+		std::cout<<"(Server)Fail to parse JSON, Wrong data, drop it"<<std::endl;
+#endif
+		// Wrong Data;
+		this->dropConnection(fd, client);
+		return;
+	}
+	if (root["protocol_version"].asString().compare(
+	MPOOL_PROTOCOL_VERSION)) {
+#ifdef DEBUG
+		std::cout<<"(Server)Wrong protocol, drop it"<<std::endl;
+#endif
+		// Wrong Protocol Version;
+		this->dropConnection(fd, client);
+		return;
+	}
+	if (!client && root.isMember("token")) {
+		// Reconnected, re-attach the session without auth;
+		client = this->resumeSession(fd, root["token"].asString());
+		if (!client) {
+			this->socketMessage(fd, "AUTH_FAIL", "F001",
+					"Invalid token or session in use");
+			this->closeSocket(fd);
+			return;
+		}
+	}
+	// Fast path, answered on the reactor thread without a worker or DB;
+	// a heartbeat behind pending queries is queued to keep replies in order;
+	if (this->isHeartbeat(root)
+			&& (!client || (!client->isBusy() && client->getWorks() <= 0))) {
+		if (!this->clientHeartbeatAction(fd, root)) {
+			this->dropConnection(fd, client);
+		} else if (client) {
+			client->lastActive();
 		}
+		return;
+	}
+	if (!root["type"].asString().compare("status")) {
+		// Get server running information;
+		if (!this->clientServerStatusAction(fd, root)) {
+			this->dropConnection(fd, client);
+		} else if (client) {
+			client->lastActive();
+		}
+		return;
+	}
+	if (!root["type"].asString().compare("close")) {
+		// End the session, its DB connection goes back to the pool;
+		if (client && this->authenticate(fd, root)) {
+			this->sessions.erase(client->getToken());
+		}
+		this->dropConnection(fd, client);
+		return;
+	}
+	if (this->clients->size() >= this->max_connections) {
+#ifdef DEBUG
+		std::cout<<"(Server)Too many connections"<<std::endl;
 #endif
-		sleep(30);
+		this->dropConnection(fd, client);
+		return;
+	}
+	if (!root["type"].asString().compare("auth")) {
+		if (!this->clientAuthAction(fd, client, root)) {
+			this->dropConnection(fd, this->findClient(fd));
+		}
+		return;
 	}
+	if (!root["type"].asString().compare("shm")) {
+		if (!this->clientShmAction(fd, client, root)) {
+			this->dropConnection(fd, this->findClient(fd));
+		}
+		return;
+	}
+	std::string type = root["type"].asString();
+	if (!type.compare("query") || !type.compare("cursor")
+			|| !type.compare("fetch") || !type.compare("cursor_close")
+			|| !type.compare("bulk_load") || !type.compare("bulk_data")
+			|| !type.compare("snapshot")) {
+#ifdef DEBUG
+		std::cout<<"(Server)Query Action"<<std::endl;
+#endif
+		// Normal query;
+		const char *reason = NULL;
+		if (!client && (reason = this->checkOverload(NULL))) {
+			// Shed before a client & DB connection are set up;
+			this->shed++;
+			this->socketMessage(fd, "OVERLOADED", "F001", reason);
+			return;
+		}
+		if (!client) {
+			client = this->createClient(fd, root["username"].asString());
+			if (!client) {
+				this->closeSocket(fd);
+				return;
+			}
+		}
+		// The hint may lower the priority of the user, never raise it;
+		client->setPriority(
+				Manager::parsePriority(root["priority"].asString(),
+						MPOOL_PRIORITY_INTERACTIVE));
+		bool queued =
+				!type.compare("query") ?
+						this->clientQueryAction(client, root) :
+				!type.compare(0, 5, "bulk_") ?
+						this->clientBulkAction(client, root) :
+				!type.compare("snapshot") ?
+						this->clientSnapshotAction(client, root) :
+						this->clientCursorAction(client, root);
+		if (!queued) {
+			if (!client->isBusy() && client->getWorks() <= 0) {
+				this->normalEnd(client);
+			}
+		}
+		if (client_close) {
+#ifdef DEBUG
+			std::cout<<"(Server)Client closed the connection after send SQL, FD"<<fd<<std::endl;
+#endif
+			// Wrong Data;
+			this->dropConnection(fd, client);
+		}
+		return;
+	}
+	// Garbage message, go to gc;
+	this->dropConnection(fd, client);
 }
 
-bool Server::clientQueryAction(Client *client, Json::Value root) {
-	if (!client) {
+void Server::stop() {
+	this->running = false;
+}
+
+void Server::gc() {
+	// Garbage Collection, driven by the reactor;
+	if (this->batcher) {
+		std::vector<Client*> ready;
+		this->batcher->expire(Manager::now(), ready);
+		this->pushReady(ready);
+	}
+	std::vector<TimerNode*> expired;
+	this->timers->advance(TimerWheel::now(), expired);
+	for (std::vector<TimerNode*>::iterator it = expired.begin();
+			it != expired.end(); it++) {
+		Client *client = (Client*) (*it)->data;
+		if (client->isCursorTimer(*it)) {
+			// Cursors unused for cursor_timeout seconds, checked again
+			// while the client keeps some open;
+			bool open = client->getCursorCount() > 0 || client->getWorks() > 0;
+			this->flushBatch(client);
+			client->pushCursor(Statement::EXPIRE_CURSORS, 0,
+					this->cursor_timeout);
+			this->manager->push(client);
+			if (open) {
+				client->touchCursors(this->cursor_timeout);
+			}
+			continue;
+		}
+		if (!client->getSocket()) {
+			// Detached session, nobody came back;
+			this->destroyClient(client);
+			continue;
+		}
+		if (client->isBusy() || client->getWorks() > 0) {
+			// Still working, check it again after a full timeout;
+			client->lastActive();
+			continue;
+		}
 #ifdef DEBUG
-		std::cout<<"(Server)Call Query Action without Client, Drop it"<<std::endl;
+		std::cout<<"(Server)Garbage collection for client:"<<client->getSocket()<<std::endl;
 #endif
-		return false;
+		this->normalEnd(client);
+	}
+}
+
+bool Server::authenticate(int fd, Json::Value &root) {
+	if (root.isMember("token")) {
+		// Session attached to this socket;
+		std::map<std::string, Client*>::iterator it = this->sessions.find(
+				root["token"].asString());
+		return it != this->sessions.end() && it->second->getSocket() == fd;
 	}
 	if (!root.isMember("username") || !root.isMember("password")) {
 		return false;
@@ -828,59 +1930,577 @@ bool Server::clientQueryAction(Client *client, Json::Value root) {
 	std::map<std::string, std::string>::iterator it = this->user_list.find(
 			root["username"].asString());
 	if (it == this->user_list.end()) {
-		this->clientMessage(client, "AUTH_FAIL", "F001",
-				"Authorization fail, incorrect user or password");
 		return false;
 	}
-	if (it->second.compare(root["password"].asString())) {
+	return !it->second.compare(root["password"].asString());
+}
+
+bool Server::isHeartbeat(Json::Value &root) {
+	if (root["type"].asString().compare("query") || !root.isMember("sql")) {
+		return false;
+	}
+	const std::string &sql = root["sql"].asString();
+	return std::string::npos == sql.find_first_not_of(" \n\r\t");
+}
+
+bool Server::authorizeClient(Client *client, Json::Value &root) {
+	if (!client) {
+#ifdef DEBUG
+		std::cout<<"(Server)Call Query Action without Client, Drop it"<<std::endl;
+#endif
+		return false;
+	}
+	if (!root.isMember("token")
+			&& (!root.isMember("username") || !root.isMember("password"))) {
+		return false;
+	}
+	if (!this->authenticate(client->getSocket(), root)) {
 		this->clientMessage(client, "AUTH_FAIL", "F001",
 				"Authorization fail, incorrect user or password");
 		return false;
 	}
+	return true;
+}
+
+bool Server::clientQueryAction(Client *client, Json::Value root) {
+	if (!this->authorizeClient(client, root)) {
+		return false;
+	}
 	if (!root.isMember("sql")) {
 		return false;
 	}
+	std::string sql = root["sql"].asString();
+	unsigned char type = Statement::QUERY;
+	client->setRoute(Statement::NO_SHARD);
+	client->setCodec(FrameCompressor::parseCodec(root["compress"].asString()));
+	// Polling clients send the hash of the rows they got last time;
+	if (root.isMember("if_none_match")) {
+		client->setIfNoneMatch(true, root["if_none_match"].asString());
+	} else {
+		client->setIfNoneMatch(false);
+	}
+	if ((root.isMember("shard_key") || root.isMember("shard"))
+			&& std::string::npos != sql.find_first_not_of(" \n\r\t")) {
+		// Routed by the reactor, the worker only picks the pool;
+		bool keyed = root.isMember("shard_key");
+		std::string key = keyed ? root["shard_key"].asString() : "";
+		std::string shard =
+				root.isMember("shard") ? root["shard"].asString() : "";
+		int index = -1;
+		if (!this->router) {
+			this->refuseRequest(client, "FAILED", "No shards configured");
+			return true;
+		}
+		if (!shard.compare("all")) {
+			std::string order = root["order"].asString();
+			client->setRoute(Statement::ALL_SHARDS,
+					root["order_by"].asString(),
+					!strcasecmp(order.c_str(), "desc"));
+		} else if (!keyed && shard.compare("auto")) {
+			this->refuseRequest(client, "FAILED", "Unknown shard");
+			return true;
+		} else if (!keyed && !this->router->extractKey(sql, key)) {
+			this->refuseRequest(client, "FAILED",
+					"No shard key in the statement");
+			return true;
+		} else if ((index = this->router->route(key)) < 0) {
+			this->refuseRequest(client, "FAILED", "Invalid shard key");
+			return true;
+		} else {
+			client->setRoute(index);
+		}
+	} else if (root.isMember("read")
+			&& !root["read"].asString().compare("replica")
+			&& std::string::npos != sql.find_first_not_of(" \n\r\t")) {
+		// Runs on the primary without replicas;
+		std::string gtid =
+				root.isMember("gtid") ? root["gtid"].asString() : "";
+		if (!gtid.empty() && !ReplicaSet::isGtidSet(gtid)) {
+			this->refuseRequest(client, "FAILED",
+					"Invalid consistency token");
+			return true;
+		}
+		if (this->replicas) {
+			client->setReplicaRoute(gtid);
+		}
+	} else if (root.isMember("async")
+			&& !root["async"].asString().compare("true")
+			&& std::string::npos != sql.find_first_not_of(" \n\r\t")) {
+		// Acknowledged once spooled, applied later;
+		if (!this->spool) {
+			this->refuseRequest(client, "FAILED", "No write spool configured");
+			return true;
+		}
+		type = Statement::SPOOL;
+	} else if (this->batcher && root.isMember("batch")
+			&& !root["batch"].asString().compare("true")) {
+		// Joins a multi-row INSERT when it is one;
+		type = Statement::BATCH;
+	}
 #ifdef DEBUG
 	std::cout<<"(Server)Push SQL into Client"<<std::endl;
 #endif
-	client->pushSQL(root["sql"].asString());
+	this->queueSQL(client, sql, type);
+	return true;
+}
+
+bool Server::clientBulkAction(Client *client, Json::Value root) {
+	if (!this->authorizeClient(client, root)) {
+		return false;
+	}
+	BulkLoad *bulk = client->getBulkLoad();
+	client->lastActive();
+	if (!root["type"].asString().compare("bulk_data")) {
+		if (!root["end"].asString().compare("true")) {
+			// Replied with the result of the load;
+			if (bulk) {
+				bulk->finish();
+			}
+			return true;
+		}
+		if (!bulk || !bulk->push(root["data"].asString())) {
+			std::string error = bulk ? bulk->getError() : "";
+			this->refuseRequest(client, "FAILED",
+					error.empty() ? "No bulk load in progress" : error.c_str());
+		}
+		return true;
+	}
+	if (bulk && !bulk->isClosed()) {
+		this->refuseRequest(client, "FAILED", "Bulk load in progress");
+		return true;
+	}
+	std::string sql;
+	if (!BulkLoad::buildStatement(root["table"].asString(),
+			root["columns"].asString(), root["format"].asString(),
+			toNumber(root["ignore_lines"]), sql)) {
+		this->refuseRequest(client, "FAILED",
+				"Invalid table, columns or format");
+		return true;
+	}
+	bulk = new BulkLoad(this->bulk_window, this->bulk_timeout,
+			client->getMemory());
+	client->setBulkLoad(bulk);
+	if (!this->queueSQL(client, sql, Statement::BULK)) {
+		// The frames that follow are refused too;
+		bulk->close();
+	}
+	return true;
+}
+
+bool Server::clientSnapshotAction(Client *client, Json::Value root) {
+	if (!this->authorizeClient(client, root)) {
+		return false;
+	}
+	std::string error;
+	if (!this->snapshots) {
+		this->refuseRequest(client, "FAILED", "No snapshots configured");
+		return true;
+	}
+	SnapshotFrame *frame = this->snapshots->get(root["name"].asString(),
+			client->getUsername(), error);
+	if (!frame) {
+		this->refuseRequest(client, "FAILED", error.c_str());
+		return true;
+	}
+	this->flushBatch(client);
+	if (client->isBusy() || client->getWorks() > 0) {
+		// Replied in order, after the queries queued before;
+		client->pushSQL(frame->getData(), Statement::FRAME);
+		this->manager->push(client);
+	} else {
+		client->lastActive();
+		this->sendFrame(client->getSocket(), frame->getData());
+	}
+	if (frame->release()) {
+		delete frame;
+	}
+	return true;
+}
+
+bool Server::clientCursorAction(Client *client, Json::Value root) {
+	if (!this->authorizeClient(client, root)) {
+		return false;
+	}
+	client->setCodec(FrameCompressor::parseCodec(root["compress"].asString()));
+	std::string type = root["type"].asString();
+	if (!type.compare("cursor")) {
+		if (!root.isMember("sql")) {
+			return false;
+		}
+		client->touchCursors(this->cursor_timeout);
+		this->queueSQL(client, root["sql"].asString(), Statement::CURSOR);
+		return true;
+	}
+	if (!root.isMember("cursor")) {
+		return false;
+	}
+	unsigned long cursor = toNumber(root["cursor"]);
+	if (!type.compare("fetch")) {
+		unsigned long rows = toNumber(root["rows"]);
+		client->touchCursors(this->cursor_timeout);
+		this->queueSQL(client, "", Statement::FETCH, cursor,
+				rows ? rows : MPOOL_CURSOR_ROWS);
+	} else {
+		this->queueSQL(client, "", Statement::CLOSE_CURSOR, cursor);
+	}
+	return true;
+}
+
+bool Server::queueSQL(Client *client, const std::string &sql,
+		unsigned char type, unsigned long cursor, unsigned long rows) {
+	// Keeps the replies in order, the batch is answered first;
+	this->flushBatch(client);
+	// Heartbeats & cursor closes are never refused, they hold nothing new;
+	const char *reason = NULL;
+	bool refusable = Statement::CURSOR == type || Statement::FETCH == type
+			|| Statement::SPOOL == type || Statement::BULK == type
+			|| ((Statement::QUERY == type || Statement::BATCH == type)
+					&& std::string::npos != sql.find_first_not_of(" \n\r\t"));
+	// Limits of the user first, an O(1) check without locks;
+	unsigned long retry;
+	if (refusable && client->getRateLimiter()
+			&& (retry = client->getRateLimiter()->admit(reason))) {
+		this->refuseRequest(client, "RATE_LIMITED", reason, retry);
+		return false;
+	}
+	if (refusable && (reason = this->checkOverload(client))) {
+		this->shed++;
+		this->refuseRequest(client, "OVERLOADED", reason);
+		return false;
+	}
+	// Refused in order, after the replies of the queries queued before;
+	bool queued = false;
+	if (this->max_client_memory
+			&& client->getMemory()->total() + sql.size()
+					> this->max_client_memory) {
+		client->reject("MEMORY_LIMIT", "Client memory limit exceeded");
+	} else if (this->max_memory
+			&& this->getMemoryUsed() + sql.size() > this->max_memory) {
+		client->reject("MEMORY_LIMIT", "Server memory limit exceeded");
+	} else if (Statement::BATCH == type && this->batchInsert(client, sql)) {
+		// Handed to the workers when the batch closes;
+		return true;
+	} else if (Statement::QUERY == type || Statement::BATCH == type) {
+		client->pushSQL(sql);
+		queued = true;
+	} else if (Statement::SPOOL == type || Statement::BULK == type) {
+		client->pushSQL(sql, type);
+		queued = true;
+	} else {
+		client->pushCursor(type, cursor, rows, sql);
+		queued = true;
+	}
 #ifdef DEBUG
 	std::cout<<"(Server)Push Client into pending list"<<std::endl;
 #endif
 	this->manager->push(client);
+	return queued;
+}
+
+bool Server::batchInsert(Client *client, const std::string &sql) {
+	std::string prefix, tuple;
+	// The reply of a client with queued statements would overtake them. A
+	// pinned session runs its own, it may be inside a transaction;
+	if (client->isBusy() || client->getWorks() > 0
+			|| client->getDBConnection()
+			|| !InsertBatcher::parse(sql, prefix, tuple)) {
+		return false;
+	}
+	std::vector<Client*> ready;
+	unsigned int row;
+	InsertBatch *batch = this->batcher->add(client->getDBPool(), prefix,
+			tuple, client, Manager::now(), row, ready);
+	client->pushBatch(batch, row);
+	client->setOpenBatch(batch);
+	// Full already;
+	this->pushReady(ready);
 	return true;
 }
+
+void Server::flushBatch(Client *client) {
+	if (!client->getOpenBatch()) {
+		return;
+	}
+	std::vector<Client*> ready;
+	this->batcher->close(client->getOpenBatch(), ready);
+	this->pushReady(ready);
+}
+
+void Server::pushReady(std::vector<Client*> &ready) {
+	for (std::vector<Client*>::iterator it = ready.begin(); it != ready.end();
+			it++) {
+		(*it)->setOpenBatch(NULL);
+		this->manager->push(*it);
+	}
+}
+
+void Server::wakeMember(void *server, Client *client) {
+	((Server*) server)->manager->push(client);
+}
+
+const char* Server::checkOverload(Client *client) {
+	if (client && this->max_client_inflight
+			&& client->getWorks() >= this->max_client_inflight) {
+		return "Too many queries in flight for the client";
+	}
+	if (!this->max_queue_depth && !this->max_inflight
+			&& !this->queue_wait_target) {
+		return NULL;
+	}
+	size_t pending, inflight;
+	unsigned long long delay;
+	this->manager->getLoad(pending, inflight, delay);
+	if (this->max_inflight && inflight >= this->max_inflight) {
+		return "Too many queries in flight";
+	}
+	if (this->max_queue_depth && pending >= this->max_queue_depth) {
+		return "Too many queries waiting for a worker";
+	}
+	if (this->queue_wait_target && delay > this->queue_wait_target) {
+		return "Queue wait time exceeds queue_wait_target";
+	}
+	return NULL;
+}
+
+void Server::refuseRequest(Client *client, const char *status,
+		const char *reason, unsigned long retry) {
+	this->flushBatch(client);
+	if (client->isBusy() || client->getWorks() > 0) {
+		// Replied in order, after the queries queued before;
+		client->reject(status, reason, retry);
+		this->manager->push(client);
+		return;
+	}
+	client->lastActive();
+	if (MPOOL_WIRE_MYSQL == this->clients->getWire(client->getSocket())) {
+		std::string out;
+		unsigned char seq = 1;
+		MySQLProtocol::appendPacket(out, seq,
+				strcmp(status, "RATE_LIMITED") ?
+						MySQLProtocol::error(1040, "08004", reason) :
+						MySQLProtocol::error(1226, "42000", reason));
+		this->sendFrame(client->getSocket(), out);
+	} else if (retry) {
+		std::stringstream ss;
+		ss << retry;
+		this->clientMessage(client, status, "F001", reason, ss.str().c_str());
+	} else {
+		this->clientMessage(client, status, "F001", reason);
+	}
+}
+
+unsigned long long Server::getMemoryUsed() {
+	return this->memory.total() + this->clients->getBuffered()
+			+ (this->uring ? this->uring->getPending() : 0);
+}
+
+void Server::rejectRequest(int fd) {
+	if (MPOOL_WIRE_MYSQL == this->clients->getWire(fd)) {
+		std::string out;
+		unsigned char seq = 1;
+		MySQLProtocol::appendPacket(out, seq,
+				MySQLProtocol::error(1153, "08S01",
+						"Got a packet bigger than 'max_request_size' bytes"));
+		this->sendFrame(fd, out);
+	} else {
+		this->socketMessage(fd, "REQUEST_TOO_LARGE", "F001",
+				"Request exceeds max_request_size");
+	}
+	// The rest of the package would be parsed as garbage;
+	shutdown(fd, SHUT_RD);
+	this->dropConnection(fd, this->findClient(fd));
+}
 bool Server::clientExitAction(Client *client, Json::Value root) {
 	if (!client) {
 		return false;
 	}
 	return true;
 }
-bool Server::clientServerStatusAction(Client *client, Json::Value root) {
-	if (!client) {
+bool Server::clientHeartbeatAction(int fd, Json::Value root) {
+	if (!root.isMember("token")
+			&& (!root.isMember("username") || !root.isMember("password"))) {
 		return false;
 	}
-	if (!root.isMember("username") || !root.isMember("password")) {
+	if (!this->authenticate(fd, root)) {
+		this->socketMessage(fd, "AUTH_FAIL", "F001",
+				"Authorization fail, incorrect user or password");
 		return false;
 	}
-	std::map<std::string, std::string>::iterator it = this->user_list.find(
-			root["username"].asString());
-	if (it == this->user_list.end()) {
-		this->clientMessage(client, "AUTH_FAIL", "F001",
+	this->sendFrame(fd, this->heartbeat_frame);
+	return true;
+}
+bool Server::clientAuthAction(int fd, Client *client, Json::Value root) {
+	if (!this->authenticate(fd, root)) {
+		this->socketMessage(fd, "AUTH_FAIL", "F001",
 				"Authorization fail, incorrect user or password");
 		return false;
 	}
-	if (it->second.compare(root["password"].asString())) {
-		this->clientMessage(client, "AUTH_FAIL", "F001",
+	if (!client) {
+		client = this->createClient(fd, root["username"].asString());
+		if (!client) {
+			this->socketMessage(fd, "FAILED", "F001",
+					"Fail to get connection from the pool");
+			return false;
+		}
+	}
+	if (client->getToken().empty()) {
+		if (client->generateToken().empty()) {
+			syslog(LOG_ERR, "Fail to generate session token");
+			this->socketMessage(fd, "FAILED", "F001",
+					"Fail to create session");
+			return false;
+		}
+		this->sessions[client->getToken()] = client;
+	}
+	client->lastActive();
+	this->socketMessage(fd, "SUCCESS", "T001", "Authorized",
+			client->getToken().c_str());
+	return true;
+}
+bool Server::clientShmAction(int fd, Client *client, Json::Value root) {
+	if (!this->authenticate(fd, root)) {
+		this->socketMessage(fd, "AUTH_FAIL", "F001",
 				"Authorization fail, incorrect user or password");
 		return false;
 	}
-	Json::Value data;
-	data["server_version"] = MPOOL_SERVER_VERSION;
-	data["clients"] = (unsigned int) this->clients->size();
-	data["workers"] = this->workers;
-	std::string str_data = this->jsonWriter->write(data);
-	this->clientMessage(client, "SUCCESS", "T001", "Success", str_data.c_str());
+	int domain = 0;
+	socklen_t len = sizeof(domain);
+	if (-1 == getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len)
+			|| AF_UNIX != domain) {
+		this->socketMessage(fd, "FAILED", "F001",
+				"Shared memory needs the unix socket");
+		return false;
+	}
+	if (client && (client->getShm() || client->isBusy()
+			|| client->getWorks() > 0)) {
+		this->socketMessage(fd, "FAILED", "F001",
+				"Shared memory is set up when the connection is idle");
+		return false;
+	}
+	if (!client) {
+		client = this->createClient(fd, root["username"].asString());
+		if (!client) {
+			this->socketMessage(fd, "FAILED", "F001",
+					"Fail to get connection from the pool");
+			return false;
+		}
+	}
+	ShmChannel *shm = new ShmChannel();
+	if (!shm->create(atol(this->config["shm_ring_size"].c_str()))) {
+		syslog(LOG_ERR, "Fail to create shared memory: %s", strerror(errno));
+		delete shm;
+		this->socketMessage(fd, "FAILED", "F001",
+				"Fail to create shared memory");
+		return false;
+	}
+	unsigned int generation = this->clients->getGeneration(fd);
+	if (this->uring) {
+		this->uring->poll(shm->getDoorbell(), fd, generation);
+	} else {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u64 = ConnectionTable::makeHandle(fd, generation)
+				| MPOOL_EPOLL_DOORBELL;
+		if (-1
+				== epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, shm->getDoorbell(),
+						&ev)) {
+			delete shm;
+			this->socketMessage(fd, "FAILED", "F001",
+					"Fail to create shared memory");
+			return false;
+		}
+	}
+	client->setShm(shm);
+	client->lastActive();
+	// Region layout & fds (memfd, request eventfd, response eventfd) go with
+	// the reply, later replies are written to the response ring;
+	std::stringstream ss;
+	ss << shm->getRingSize();
+	Json::Value reply;
+	reply["protocol_version"] = MPOOL_PROTOCOL_VERSION;
+	reply["status"] = "SUCCESS";
+	reply["code"] = "T001";
+	reply["message"] = "Shared memory";
+	reply["data"] = ss.str();
+	if (!shm->offer(fd, FrameTemplate::frame(this->jsonWriter->write(reply)))) {
+		this->closeShm(client);
+		return false;
+	}
+	return true;
+}
+bool Server::clientServerStatusAction(int fd, Json::Value root) {
+	if (!root.isMember("token")
+			&& (!root.isMember("username") || !root.isMember("password"))) {
+		return false;
+	}
+	if (!this->authenticate(fd, root)) {
+		this->socketMessage(fd, "AUTH_FAIL", "F001",
+				"Authorization fail, incorrect user or password");
+		return false;
+	}
+	std::vector<unsigned long long> values(37);
+	values[0] = this->clients->size();
+	values[1] = this->sessions.size();
+	values[2] = this->clients->getBuffered();
+	values[3] = this->memory.get(MemoryAccount::QUEUED);
+	values[4] = this->memory.get(MemoryAccount::RESULT);
+	values[5] = this->uring ? this->uring->getPending() : 0;
+	values[6] = values[2] + values[3] + values[4] + values[5];
+	// Bytes held for the client of this connection;
+	Client *client = this->findClient(fd);
+	values[7] = client ? client->getMemory()->total() : 0;
+	size_t pending, inflight;
+	this->manager->getLoad(pending, inflight, values[10]);
+	values[8] = pending;
+	values[9] = inflight;
+	values[11] = this->shed;
+	ConcurrencyLimiter *limiter = this->db_pool->getLimiter();
+	values[12] = limiter->getInflight();
+	values[13] = limiter->getLimit();
+	values[14] = limiter->getRtt();
+	values[15] = limiter->getMinRtt();
+	// The pool of the user, shared with the others on the default one;
+	std::string username =
+			client ? client->getUsername() : root["username"].asString();
+	DBPool *db_pool = this->getPool(username);
+	if (db_pool) {
+		values[16] = db_pool->getHits();
+		values[17] = db_pool->getMisses();
+		values[18] = db_pool->getLimiter()->getWaits();
+	}
+	unsigned long queued;
+	unsigned int running;
+	this->manager->getUserLoad(username, queued, running);
+	values[19] = running;
+	values[20] = queued;
+	std::map<std::string, RateLimiter*>::iterator rate = this->user_rates.find(
+			username);
+	values[21] = rate == this->user_rates.end() ? 0 : rate->second->getLimited();
+	values[22] = this->replicas ? this->replicas->getReads() : 0;
+	values[23] = this->replicas ? this->replicas->getFallbacks() : 0;
+	values[24] = this->batcher ? this->batcher->getBatches() : 0;
+	values[25] = this->batcher ? this->batcher->getBatchedRows() : 0;
+	values[26] = this->spool ? this->spool->getPending() : 0;
+	values[27] = this->spool ? this->spool->getBytes() : 0;
+	values[28] = this->spool ? this->spool->getApplied() : 0;
+	values[29] = this->spool ? this->spool->getFailed() : 0;
+	values[30] = this->snapshots ? this->snapshots->getRefreshes() : 0;
+	values[31] = this->snapshots ? this->snapshots->getFailures() : 0;
+	values[32] = this->snapshots ? this->snapshots->getHits() : 0;
+	values[33] = this->compressor->getFrames();
+	values[34] = this->compressor->getBytesIn();
+	values[35] = this->compressor->getBytesOut();
+	values[36] = this->compressor->getTime();
+	std::string frame = this->status_template->render(values);
+	if (client && (client->isBusy() || client->getWorks() > 0)) {
+		// Replied in order, a direct write could land inside a result
+		// the worker is sending;
+		client->pushSQL(frame, Statement::FRAME);
+		this->manager->push(client);
+		return true;
+	}
+	this->sendFrame(fd, frame);
 	return true;
 }
 
@@ -888,6 +2508,24 @@ void Server::closeSocket(int fd) {
 	if (!fd) {
 		return;
 	}
+	Client *client = this->findClient(fd);
+	if (client && client->getShm()) {
+		this->closeShm(client);
+	}
+	if (!this->mysql_auth_switch.empty()) {
+		this->mysql_auth_switch.erase(fd);
+	}
+	this->clients->close(fd);
+	if (this->uring && this->uring->linger(fd)) {
+		// Replies still queued, e.g. the error of a refused request;
+		// the ring closes it after sending them;
+		shutdown(fd, SHUT_RD);
+		return;
+	}
+	if (this->uring) {
+		// Cancel the multishot recv before the fd can be reused;
+		this->uring->forget(fd);
+	}
 	if (-1 == close(fd)) {
 #ifdef DEBUG
 		std::cout<<"(Server)Fail to close socket, FD: "<<fd<<", Error: "<<strerror(errno)<<std::endl;
@@ -895,34 +2533,53 @@ void Server::closeSocket(int fd) {
 	}
 }
 
-void Server::goToGc(Client *client) {
-	if (client) {
-		// GC it;
-		client->setTimeout();
+void Server::closeShm(Client *client) {
+	int doorbell = client->getShm()->getDoorbell();
+	if (this->uring) {
+		this->uring->forget(doorbell);
+	} else {
+		// The client still holds the eventfd, close() would not remove it;
+		epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, doorbell, NULL);
+	}
+	client->setShm(NULL);
+}
+
+void Server::onDoorbell(int fd) {
+	Client *client = this->findClient(fd);
+	if (!client || !client->getShm()) {
+		return;
+	}
+	unsigned int generation = this->clients->getGeneration(fd);
+	std::string data;
+	client->getShm()->receive(data);
+	if (!data.empty()) {
+		this->onData(fd, data);
+	}
+	if (this->uring && this->clients->getGeneration(fd) == generation
+			&& this->findClient(fd) == client && client->getShm()) {
+		this->uring->poll(client->getShm()->getDoorbell(), fd, generation);
 	}
 }
 
 void Server::normalEnd(Client *client) {
 	if (client) {
 		if (!client->isBusy() && client->getWorks() <= 0) {
-			if (!this->clients->empty()) {
+			if (this->clients->size()) {
 				pthread_mutex_lock(&this->client_mutex);
-				std::map<int, MPool::Client*>::iterator it =
-						this->clients->find(client->getSocket());
-				if (it == this->clients->end()) {
+				if (this->clients->get(client->getSocket()) != client) {
 					pthread_mutex_unlock(&this->client_mutex);
 					return;
 				}
-				this->clients->erase(it);
 				if (this->isSocketVal(client->getSocket())) {
-					if (-1 == close(client->getSocket())) {
-#ifdef DEBUG
-						std::cout<<"(Server)Fail to close socket, FD: "<<client->getSocket()<<", Error: "<<strerror(errno)<<std::endl;
-#endif
-					}
+					this->closeSocket(client->getSocket());
+				}
+				if (this->session_grace
+						&& this->sessions.count(client->getToken())) {
+					// Keep the session and its DB connection for a reconnect;
+					client->detach(this->session_grace);
+				} else {
+					this->destroyClient(client);
 				}
-				this->db_pool->freeDB(client->getDBConnection());
-				delete client;
 				pthread_mutex_unlock(&this->client_mutex);
 			}
 		}
@@ -59,6 +59,10 @@ const char* ServerException::what() {
 		return "Fail to call epoll_ctl";
 	case ServerException::DBPOLL_GETCON_FAIL:
 		return "Fail to get connection from the pool";
+	case ServerException::SOCKET_BIND_FAIL:
+		return "Fail to bind the unix socket, please check the path and permissions";
+	case ServerException::SPOOL_OPEN_FAIL:
+		return "Fail to open the write spool, please check spool_file";
 	default:
 		return "Unknown Error";
 	}
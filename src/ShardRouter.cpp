@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/ConcurrencyLimiter.h"
+#include "include/FnvHash.h"
+#include "include/ShardRouter.h"
+
+namespace MPool {
+
+/**
+ * @brief Statement of a scatter on one shard
+ * */
+class ScatterTask {
+public:
+	DBPool *pool;
+	const std::string *sql;
+	ShardResult *result;
+	size_t *left; /// Tasks of the scatter not done yet
+};
+
+/**
+ * @brief Token of a statement for extractKey()
+ * */
+class SQLToken {
+public:
+	/// Kinds
+	const static char WORD = 'w';
+	const static char QUOTED_WORD = 'q'; /// Backquoted identifier
+	const static char STRING = 's';
+	const static char NUMBER = 'n';
+	const static char PUNCT = 'p';
+	char kind;
+	std::string text; /// Unquoted
+	int depth; /// Of parentheses
+};
+
+static void runShard(ScatterTask *task) {
+	ShardResult &result = *task->result;
+	result.res = NULL;
+	result.failed = false;
+	result.affected_rows = 0;
+	if (!task->pool) {
+		result.failed = true;
+		result.error = "The backend of the shard is not available";
+		return;
+	}
+	ConcurrencyLimiter *limiter = task->pool->getLimiter();
+	limiter->acquire();
+	DB *db_con = task->pool->allocDB();
+	unsigned long long rtt = 0;
+	if (!db_con) {
+		result.failed = true;
+		result.error = "Fail to get connection from the pool";
+	} else if (!db_con->execute(*task->sql, &result.res)) {
+		// Stored, the connection goes back at once;
+		result.failed = true;
+		result.error = db_con->getError();
+	} else {
+		result.affected_rows = db_con->getAffectedRows();
+	}
+	if (db_con) {
+		rtt = db_con->getRtt();
+		task->pool->freeDB(db_con);
+	}
+	limiter->release(rtt);
+}
+
+static bool isIdentifier(char c) {
+	return isalnum((unsigned char) c) || '_' == c || '$' == c
+			|| (unsigned char) c >= 0x80;
+}
+
+/**
+ * @brief Split the statement, comments dropped
+ * @return false on an executable comment or an unterminated literal
+ * */
+static bool tokenize(const std::string &sql, std::vector<SQLToken> &tokens) {
+	int depth = 0;
+	size_t i = 0;
+	while (i < sql.size()) {
+		char c = sql[i];
+		if (isspace((unsigned char) c)) {
+			i++;
+			continue;
+		}
+		if ('#' == c || (!sql.compare(i, 2, "--")
+				&& (i + 2 == sql.size()
+						|| isspace((unsigned char) sql[i + 2])))) {
+			i = sql.find('\n', i);
+			if (std::string::npos == i) {
+				break;
+			}
+			continue;
+		}
+		if (!sql.compare(i, 2, "/*")) {
+			if (!sql.compare(i, 3, "/*!") || !sql.compare(i, 3, "/*+")) {
+				return false;
+			}
+			i = sql.find("*/", i + 2);
+			if (std::string::npos == i) {
+				return false;
+			}
+			i += 2;
+			continue;
+		}
+		SQLToken token;
+		token.depth = depth;
+		if ('\'' == c || '"' == c || '`' == c) {
+			// Backslash escapes & doubled quotes, none in backquotes;
+			token.kind = '`' == c ? SQLToken::QUOTED_WORD : SQLToken::STRING;
+			bool closed = false;
+			for (i++; i < sql.size() && !closed; i++) {
+				if ('\\' == sql[i] && '`' != c && i + 1 < sql.size()) {
+					token.text += sql[++i];
+				} else if (c != sql[i]) {
+					token.text += sql[i];
+				} else if (i + 1 < sql.size() && c == sql[i + 1]) {
+					token.text += sql[++i];
+				} else {
+					closed = true;
+				}
+			}
+			if (!closed) {
+				return false;
+			}
+		} else if (isIdentifier(c) || ('.' == c && i + 1 < sql.size()
+				&& isdigit((unsigned char) sql[i + 1]))) {
+			// 1e3, 0x1F & 1abc are words, never a key;
+			size_t end = i;
+			bool number = true;
+			while (end < sql.size()
+					&& (isIdentifier(sql[end]) || ('.' == sql[end] && number))) {
+				number = number
+						&& (isdigit((unsigned char) sql[end])
+								|| '.' == sql[end]);
+				end++;
+			}
+			token.kind = number ? SQLToken::NUMBER : SQLToken::WORD;
+			token.text = sql.substr(i, end - i);
+			i = end;
+		} else {
+			static const char *operators[] = { "<=>", "<=", ">=", "<>", "!=",
+					"||", "&&", ":=", NULL };
+			token.kind = SQLToken::PUNCT;
+			token.text = c;
+			for (size_t k = 0; operators[k]; k++) {
+				if (!sql.compare(i, strlen(operators[k]), operators[k])) {
+					token.text = operators[k];
+					break;
+				}
+			}
+			i += token.text.size();
+			if ("(" == token.text) {
+				depth++;
+			} else if (")" == token.text) {
+				token.depth = --depth;
+			}
+		}
+		tokens.push_back(token);
+	}
+	return true;
+}
+
+static bool isKeyword(const SQLToken &token, const char *keyword) {
+	return SQLToken::WORD == token.kind
+			&& !strcasecmp(token.text.c_str(), keyword);
+}
+
+static bool isPunct(const SQLToken &token, const char *punct) {
+	return SQLToken::PUNCT == token.kind && !token.text.compare(punct);
+}
+
+ShardRouter::ShardRouter() {
+	this->mode = ShardRouter::HASH;
+	this->running = false;
+	pthread_mutex_init(&this->mutex, NULL);
+	pthread_cond_init(&this->ready, NULL);
+	pthread_cond_init(&this->finished, NULL);
+}
+
+ShardRouter::~ShardRouter() {
+	this->stop();
+	pthread_cond_destroy(&this->finished);
+	pthread_cond_destroy(&this->ready);
+	pthread_mutex_destroy(&this->mutex);
+	for (size_t i = 0; i < this->shards.size(); i++) {
+		delete this->shards[i];
+	}
+	this->shards.clear();
+}
+
+void ShardRouter::setMode(unsigned char mode) {
+	this->mode = mode;
+}
+
+void ShardRouter::setColumn(const std::string &column) {
+	this->column = column;
+}
+
+void ShardRouter::addShard(DBPool *pool, long long range_end) {
+	this->shards.push_back(pool);
+	this->range_ends.push_back(range_end);
+}
+
+void ShardRouter::start(size_t threads) {
+	pthread_mutex_lock(&this->mutex);
+	this->running = true;
+	pthread_mutex_unlock(&this->mutex);
+	for (size_t i = 0; i < threads; i++) {
+		// Fewer threads only means the callers run more of their tasks;
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, ShardRouter::runThread, this)) {
+			break;
+		}
+		this->threads.push_back(tid);
+	}
+}
+
+void ShardRouter::stop() {
+	pthread_mutex_lock(&this->mutex);
+	this->running = false;
+	pthread_cond_broadcast(&this->ready);
+	pthread_mutex_unlock(&this->mutex);
+	for (size_t i = 0; i < this->threads.size(); i++) {
+		pthread_join(this->threads[i], NULL);
+	}
+	this->threads.clear();
+}
+
+void* ShardRouter::runThread(void *router) {
+	ShardRouter *self = (ShardRouter*) router;
+	mysql_thread_init();
+	pthread_mutex_lock(&self->mutex);
+	while (self->running) {
+		if (!self->runQueued()) {
+			pthread_cond_wait(&self->ready, &self->mutex);
+		}
+	}
+	pthread_mutex_unlock(&self->mutex);
+	mysql_thread_end();
+	return NULL;
+}
+
+bool ShardRouter::runQueued() {
+	if (this->queue.empty()) {
+		return false;
+	}
+	ScatterTask *task = this->queue.front();
+	this->queue.erase(this->queue.begin());
+	pthread_mutex_unlock(&this->mutex);
+	runShard(task);
+	pthread_mutex_lock(&this->mutex);
+	if (!--*task->left) {
+		pthread_cond_broadcast(&this->finished);
+	}
+	return true;
+}
+
+size_t ShardRouter::size() {
+	return this->shards.size();
+}
+
+DBPool* ShardRouter::getShard(size_t index) {
+	return index < this->shards.size() ? this->shards[index] : NULL;
+}
+
+int ShardRouter::route(const std::string &key) {
+	if (this->shards.empty()) {
+		return -1;
+	}
+	if (ShardRouter::HASH == this->mode) {
+		// 05, +5 & 5 are the same integer, -0 & 0 too;
+		std::string canonical = key;
+		size_t digits = ('-' == key[0] || '+' == key[0]) ? 1 : 0;
+		if (digits < key.size()
+				&& std::string::npos
+						== key.find_first_not_of("0123456789", digits)) {
+			size_t first = key.find_first_not_of('0', digits);
+			canonical = std::string::npos == first ? "0" :
+					('-' == key[0] ? "-" : "") + key.substr(first);
+		}
+		unsigned long long hash = FnvHash::OFFSET64;
+		FnvHash::hash64(hash, canonical.data(), canonical.size());
+		return (int) (hash % this->shards.size());
+	}
+	char *end = NULL;
+	long long value = strtoll(key.c_str(), &end, 10);
+	if (key.empty() || *end) {
+		return -1;
+	}
+	for (size_t i = 0; i + 1 < this->shards.size(); i++) {
+		if (value < this->range_ends[i]) {
+			return (int) i;
+		}
+	}
+	return (int) this->shards.size() - 1;
+}
+
+bool ShardRouter::extractKey(const std::string &sql, std::string &key) {
+	std::vector<SQLToken> tokens;
+	if (this->column.empty() || !tokenize(sql, tokens)) {
+		return false;
+	}
+	bool found = false;
+	for (size_t i = 0; i < tokens.size(); i++) {
+		const SQLToken &token = tokens[i];
+		if (isKeyword(token, "OR") || isKeyword(token, "XOR")
+				|| isKeyword(token, "UNION") || isPunct(token, "||")) {
+			return false;
+		}
+		if ((SQLToken::WORD != token.kind
+				&& SQLToken::QUOTED_WORD != token.kind)
+				|| strcasecmp(token.text.c_str(), this->column.c_str())
+				|| (i + 1 < tokens.size() && isPunct(tokens[i + 1], "."))) {
+			continue;
+		}
+		// Qualified by its table or not, right after WHERE or AND;
+		size_t before = i;
+		if (before >= 2 && isPunct(tokens[before - 1], ".")) {
+			before -= 2;
+		}
+		if (!before || token.depth
+				|| (!isKeyword(tokens[before - 1], "WHERE")
+						&& !isKeyword(tokens[before - 1], "AND"))
+				|| i + 2 >= tokens.size() || !isPunct(tokens[i + 1], "=")) {
+			continue;
+		}
+		size_t at = i + 2;
+		std::string value;
+		if (SQLToken::STRING == tokens[at].kind
+				|| SQLToken::NUMBER == tokens[at].kind) {
+			value = tokens[at].text;
+		} else if ((isPunct(tokens[at], "-") || isPunct(tokens[at], "+"))
+				&& at + 1 < tokens.size()
+				&& SQLToken::NUMBER == tokens[at + 1].kind) {
+			value = tokens[at].text + tokens[at + 1].text;
+			at++;
+		} else {
+			continue;
+		}
+		// Nothing but the end of the condition after the literal;
+		at++;
+		if (at < tokens.size() && !isPunct(tokens[at], ";")
+				&& !isKeyword(tokens[at], "AND")
+				&& !isKeyword(tokens[at], "ORDER")
+				&& !isKeyword(tokens[at], "GROUP")
+				&& !isKeyword(tokens[at], "LIMIT")
+				&& !isKeyword(tokens[at], "FOR")
+				&& !isKeyword(tokens[at], "LOCK")) {
+			continue;
+		}
+		if (found) {
+			return false;
+		}
+		found = true;
+		key = value;
+	}
+	return found;
+}
+
+void ShardRouter::scatter(const std::string &sql,
+		std::vector<ShardResult> &results) {
+	results.resize(this->shards.size());
+	std::vector<ScatterTask> tasks(this->shards.size());
+	size_t left = tasks.size();
+	for (size_t i = 0; i < tasks.size(); i++) {
+		tasks[i].pool = this->shards[i];
+		tasks[i].sql = &sql;
+		tasks[i].result = &results[i];
+		tasks[i].left = &left;
+	}
+	if (tasks.empty()) {
+		return;
+	}
+	// The first shard runs on the calling worker;
+	pthread_mutex_lock(&this->mutex);
+	for (size_t i = 1; i < tasks.size(); i++) {
+		this->queue.push_back(&tasks[i]);
+	}
+	pthread_cond_broadcast(&this->ready);
+	pthread_mutex_unlock(&this->mutex);
+	runShard(&tasks[0]);
+	pthread_mutex_lock(&this->mutex);
+	left--;
+	while (left) {
+		// Run any queued task rather than wait on busy threads;
+		if (!this->runQueued()) {
+			pthread_cond_wait(&this->finished, &this->mutex);
+		}
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "include/version.h"
+#include "include/MonotonicClock.h"
+#include "include/ShmChannel.h"
+
+namespace MPool {
+
+ShmRing::ShmRing() {
+	this->header = NULL;
+	this->data = NULL;
+	this->capacity = 0;
+}
+
+void ShmRing::attach(void *base, size_t capacity) {
+	this->header = (ShmRingHeader*) base;
+	this->data = (char*) base + sizeof(ShmRingHeader);
+	this->capacity = capacity;
+}
+
+bool ShmRing::write(const char *data, size_t &length) {
+	unsigned long long head = __atomic_load_n(&this->header->head,
+	__ATOMIC_ACQUIRE);
+	unsigned long long tail = this->header->tail;
+	if (tail - head > this->capacity) {
+		// head is written by the client, never trust it;
+		length = 0;
+		return false;
+	}
+	size_t space = this->capacity - (size_t) (tail - head);
+	if (length > space) {
+		length = space;
+	}
+	size_t offset = tail & (this->capacity - 1);
+	size_t first = this->capacity - offset;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(this->data + offset, data, first);
+	memcpy(this->data, data + first, length - first);
+	__atomic_store_n(&this->header->tail, tail + length, __ATOMIC_RELEASE);
+	return true;
+}
+
+void ShmRing::waitRead(unsigned long ms) {
+	unsigned long long head = __atomic_load_n(&this->header->head,
+	__ATOMIC_ACQUIRE);
+	if (this->header->tail - head < this->capacity) {
+		return;
+	}
+	// The futex word is the low half of head;
+	int *word = (int*) &this->header->head;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word++;
+#endif
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	syscall(SYS_futex, word, FUTEX_WAIT, (int) (unsigned int) head, &ts, NULL,
+			0);
+}
+
+size_t ShmRing::read(std::string &data) {
+	unsigned long long tail = __atomic_load_n(&this->header->tail,
+	__ATOMIC_ACQUIRE);
+	unsigned long long head = this->header->head;
+	size_t length = (size_t) (tail - head);
+	if (length > this->capacity) {
+		// Corrupted by the client, drop everything;
+		__atomic_store_n(&this->header->head, tail, __ATOMIC_RELEASE);
+		return 0;
+	}
+	size_t offset = head & (this->capacity - 1);
+	size_t first = this->capacity - offset;
+	if (first > length) {
+		first = length;
+	}
+	data.append(this->data + offset, first);
+	data.append(this->data, length - first);
+	__atomic_store_n(&this->header->head, tail, __ATOMIC_RELEASE);
+	return length;
+}
+
+ShmChannel::ShmChannel() {
+	this->region = MAP_FAILED;
+	this->region_size = 0;
+	this->ring_size = 0;
+	this->mem_fd = -1;
+	this->request_fd = -1;
+	this->response_fd = -1;
+	this->broken = false;
+	pthread_mutex_init(&this->mutex, NULL);
+}
+
+ShmChannel::~ShmChannel() {
+	if (MAP_FAILED != this->region) {
+		munmap(this->region, this->region_size);
+	}
+	if (-1 != this->mem_fd) {
+		close(this->mem_fd);
+	}
+	if (-1 != this->request_fd) {
+		close(this->request_fd);
+	}
+	if (-1 != this->response_fd) {
+		close(this->response_fd);
+	}
+	pthread_mutex_destroy(&this->mutex);
+}
+
+bool ShmChannel::create(size_t ring_size) {
+	this->ring_size = 4096;
+	while (this->ring_size < ring_size) {
+		this->ring_size <<= 1;
+	}
+	this->region_size = 2 * (sizeof(ShmRingHeader) + this->ring_size);
+	this->mem_fd = memfd_create("mpool", MFD_CLOEXEC);
+	if (-1 == this->mem_fd) {
+		return false;
+	}
+	if (-1 == ftruncate(this->mem_fd, this->region_size)) {
+		return false;
+	}
+	this->region = mmap(NULL, this->region_size, PROT_READ | PROT_WRITE,
+	MAP_SHARED, this->mem_fd, 0);
+	if (MAP_FAILED == this->region) {
+		return false;
+	}
+	// ftruncate() zero-filled the headers;
+	this->requests.attach(this->region, this->ring_size);
+	this->responses.attach(
+			(char*) this->region + sizeof(ShmRingHeader) + this->ring_size,
+			this->ring_size);
+	// Only the server reads the requests doorbell, the client may block on
+	// the responses one;
+	this->request_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	this->response_fd = eventfd(0, EFD_CLOEXEC);
+	return -1 != this->request_fd && -1 != this->response_fd;
+}
+
+bool ShmChannel::offer(int s, const std::string &str) {
+	int fds[3] = { this->mem_fd, this->request_fd, this->response_fd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov;
+	iov.iov_base = (void*) str.data();
+	iov.iov_len = str.length();
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+	while (-1 == sent && EAGAIN == errno) {
+		usleep(50);
+		sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+	}
+	if (-1 == sent) {
+		return false;
+	}
+	// The fds go with the first byte, send the rest plainly;
+	while (sent < (ssize_t) str.length()) {
+		ssize_t psent = ::send(s, str.data() + sent, str.length() - sent,
+		MSG_NOSIGNAL);
+		if (-1 == psent) {
+			if (EAGAIN != errno) {
+				return false;
+			}
+			psent = 0;
+			usleep(50);
+		}
+		sent += psent;
+	}
+	// The mapping is enough from now on;
+	close(this->mem_fd);
+	this->mem_fd = -1;
+	return true;
+}
+
+bool ShmChannel::send(const std::string &str) {
+	pthread_mutex_lock(&this->mutex);
+	size_t sent = 0;
+	unsigned long long start = 0;
+	while (!this->broken && sent < str.length()) {
+		size_t psent = str.length() - sent;
+		if (!this->responses.write(str.data() + sent, psent)) {
+			syslog(LOG_WARNING, "Shared memory ring corrupted by the client");
+			this->broken = true;
+			break;
+		}
+		if (psent) {
+			sent += psent;
+			start = 0;
+			continue;
+		}
+		// Ring full, let the client catch up;
+		unsigned long long v = 1;
+		if (-1 == write(this->response_fd, &v, sizeof(v))) {
+#ifdef DEBUG
+			std::cout<<"(ShmChannel)Fail to ring the client: "<<strerror(errno)<<std::endl;
+#endif
+		}
+		// Bounded well below the zombie check of the workers, a reader that
+		// stalls must not hold one;
+		if (!start) {
+			start = MonotonicClock::millis();
+		} else if (MonotonicClock::millis() - start > MPOOL_SHM_STALL) {
+			syslog(LOG_WARNING, "Shared memory ring not read for %d ms",
+					MPOOL_SHM_STALL);
+			this->broken = true;
+			break;
+		}
+		this->responses.waitRead(MPOOL_SHM_WAIT);
+	}
+	pthread_mutex_unlock(&this->mutex);
+	if (this->broken) {
+		return false;
+	}
+	unsigned long long v = 1;
+	if (-1 == write(this->response_fd, &v, sizeof(v))) {
+		return false;
+	}
+	return true;
+}
+
+void ShmChannel::receive(std::string &data) {
+	unsigned long long v = 0;
+	// Clear first, requests written after the drain ring it again;
+	if (-1 == read(this->request_fd, &v, sizeof(v)) && EAGAIN != errno) {
+		return;
+	}
+	this->requests.read(data);
+}
+
+int ShmChannel::getDoorbell() {
+	return this->request_fd;
+}
+
+size_t ShmChannel::getRingSize() {
+	return this->ring_size;
+}
+
+}
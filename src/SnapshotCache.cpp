@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <jsoncpp/json/json.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/ConcurrencyLimiter.h"
+#include "include/FrameTemplate.h"
+#include "include/MonotonicClock.h"
+#include "include/SnapshotCache.h"
+
+namespace MPool {
+
+SnapshotFrame::SnapshotFrame(std::string &frame) {
+	this->data.swap(frame);
+	this->refs = 1;
+}
+
+const std::string& SnapshotFrame::getData() {
+	return this->data;
+}
+
+void SnapshotFrame::retain() {
+	__atomic_add_fetch(&this->refs, 1, __ATOMIC_RELAXED);
+}
+
+bool SnapshotFrame::release() {
+	return 0 == __atomic_sub_fetch(&this->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+SnapshotCache::SnapshotCache() {
+	this->pool = NULL;
+	this->refreshes = 0;
+	this->failures = 0;
+	this->hits = 0;
+	this->running = false;
+	pthread_mutex_init(&this->mutex, NULL);
+	pthread_cond_init(&this->cond, NULL);
+}
+
+SnapshotCache::~SnapshotCache() {
+	this->stop();
+	for (std::map<std::string, Snapshot*>::iterator it =
+			this->snapshots.begin(); it != this->snapshots.end(); it++) {
+		if (it->second->frame && it->second->frame->release()) {
+			delete it->second->frame;
+		}
+		delete it->second;
+	}
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->mutex);
+}
+
+void SnapshotCache::add(const std::string &name, const std::string &sql,
+		unsigned long refresh, const std::vector<std::string> &users) {
+	Snapshot *snapshot = this->snapshots[name];
+	if (!snapshot) {
+		snapshot = new Snapshot();
+		snapshot->frame = NULL;
+		this->snapshots[name] = snapshot;
+	}
+	snapshot->name = name;
+	snapshot->sql = sql;
+	snapshot->users = users;
+	snapshot->refresh = refresh ? refresh : MPOOL_SNAPSHOT_REFRESH;
+	snapshot->due = 0;
+}
+
+void SnapshotCache::setPool(DBPool *pool) {
+	this->pool = pool;
+}
+
+void SnapshotCache::start() {
+	if (!this->pool || this->snapshots.empty() || this->running) {
+		return;
+	}
+	this->running = true;
+	pthread_create(&this->refresher, NULL, SnapshotCache::refresh, this);
+}
+
+void SnapshotCache::stop() {
+	pthread_mutex_lock(&this->mutex);
+	if (!this->running) {
+		pthread_mutex_unlock(&this->mutex);
+		return;
+	}
+	this->running = false;
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+	pthread_join(this->refresher, NULL);
+}
+
+SnapshotFrame* SnapshotCache::get(const std::string &name,
+		const std::string &username, std::string &error) {
+	std::map<std::string, Snapshot*>::iterator it = this->snapshots.find(
+			name);
+	if (it == this->snapshots.end()) {
+		error = "Unknown snapshot";
+		return NULL;
+	}
+	// The users never change while running;
+	std::vector<std::string> &users = it->second->users;
+	if (!users.empty()
+			&& std::find(users.begin(), users.end(), username) == users.end()) {
+		error = "Snapshot not allowed for the user";
+		return NULL;
+	}
+	pthread_mutex_lock(&this->mutex);
+	SnapshotFrame *frame = it->second->frame;
+	if (!frame) {
+		pthread_mutex_unlock(&this->mutex);
+		error = "Snapshot not ready";
+		return NULL;
+	}
+	// Sent outside of the lock, the refresher swaps in a new frame;
+	frame->retain();
+	this->hits++;
+	pthread_mutex_unlock(&this->mutex);
+	return frame;
+}
+
+unsigned long long SnapshotCache::getRefreshes() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long refreshes = this->refreshes;
+	pthread_mutex_unlock(&this->mutex);
+	return refreshes;
+}
+
+unsigned long long SnapshotCache::getFailures() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long failures = this->failures;
+	pthread_mutex_unlock(&this->mutex);
+	return failures;
+}
+
+unsigned long long SnapshotCache::getHits() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long hits = this->hits;
+	pthread_mutex_unlock(&this->mutex);
+	return hits;
+}
+
+void* SnapshotCache::refresh(void *cache) {
+	mysql_thread_init();
+	((SnapshotCache*) cache)->refreshLoop();
+	mysql_thread_end();
+	return NULL;
+}
+
+void SnapshotCache::refreshLoop() {
+	pthread_mutex_lock(&this->mutex);
+	while (this->running) {
+		// The query due first, the map itself never changes while running;
+		Snapshot *next = NULL;
+		for (std::map<std::string, Snapshot*>::iterator it =
+				this->snapshots.begin(); it != this->snapshots.end(); it++) {
+			if (!next || it->second->due < next->due) {
+				next = it->second;
+			}
+		}
+		unsigned long long now = MonotonicClock::millis();
+		if (next->due > now) {
+			MonotonicClock::waitFor(&this->cond, &this->mutex, next->due - now);
+			continue;
+		}
+		pthread_mutex_unlock(&this->mutex);
+		std::string frame;
+		bool done = this->run(next->name, next->sql, frame);
+		SnapshotFrame *old = NULL;
+		pthread_mutex_lock(&this->mutex);
+		// Counted from the end of the run, a slow query never piles up;
+		next->due = MonotonicClock::millis() + next->refresh;
+		this->refreshes++;
+		if (done) {
+			old = next->frame;
+			next->frame = new SnapshotFrame(frame);
+		} else {
+			this->failures++;
+		}
+		if (old && old->release()) {
+			// No request is sending it;
+			pthread_mutex_unlock(&this->mutex);
+			delete old;
+			pthread_mutex_lock(&this->mutex);
+		}
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+bool SnapshotCache::run(const std::string &name, const std::string &sql,
+		std::string &frame) {
+	this->pool->getLimiter()->acquire();
+	DB *db_con = this->pool->allocDB();
+	if (!db_con) {
+		this->pool->getLimiter()->release(0);
+		syslog(LOG_WARNING, "Snapshot %s not refreshed: no connection",
+				name.c_str());
+		return false;
+	}
+	MYSQL_RES *res = NULL;
+	bool done = db_con->execute(sql, &res);
+	if (!done) {
+		syslog(LOG_WARNING, "Snapshot %s not refreshed: %s", name.c_str(),
+				db_con->getError().c_str());
+	}
+	unsigned long long rtt = db_con->getRtt();
+	this->pool->freeDB(db_con);
+	this->pool->getLimiter()->release(rtt);
+	if (!done) {
+		return false;
+	}
+	// The reply of the same query sent by a client;
+	Json::Value root;
+	root["protocol_version"] = MPOOL_PROTOCOL_VERSION;
+	root["status"] = "SUCCESS";
+	root["code"] = "T001";
+	root["message"] = "";
+	root["data"] = "";
+	if (res) {
+		MYSQL_FIELD *fields = mysql_fetch_fields(res);
+		unsigned int count = mysql_num_fields(res);
+		MYSQL_ROW row;
+		root["data"] = Json::Value();
+		while ((row = mysql_fetch_row(res))) {
+			Json::Value item;
+			for (unsigned int i = 0; i < count; i++) {
+				item[fields[i].name] = row[i] ? row[i] : "";
+			}
+			root["data"].append(item);
+		}
+		mysql_free_result(res);
+	}
+	Json::FastWriter writer;
+	frame = FrameTemplate::frame(writer.write(root));
+	return true;
+}
+
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "include/version.h"
+#include "include/MemoryAccount.h"
+#include "include/SpillBuffer.h"
+
+namespace MPool {
+
+SpillBuffer::SpillBuffer(size_t threshold, const char *dir,
+		MemoryAccount *account) {
+	this->threshold = threshold;
+	this->dir = dir && *dir ? dir : "/tmp";
+	this->account = account;
+	this->size = 0;
+	this->fd = -1;
+	this->failed = false;
+}
+
+SpillBuffer::~SpillBuffer() {
+	if (this->account) {
+		this->account->sub(MemoryAccount::RESULT, this->data.size());
+	}
+	if (-1 != this->fd) {
+		close(this->fd);
+	}
+}
+
+void SpillBuffer::append(const char *data, size_t length) {
+	if (this->failed) {
+		return;
+	}
+	this->data.append(data, length);
+	this->size += length;
+	if (this->account) {
+		this->account->add(MemoryAccount::RESULT, length);
+	}
+	if (-1 == this->fd) {
+		if (this->threshold && this->size > this->threshold) {
+			this->spill();
+		}
+	} else if (this->data.size() >= MPOOL_SPILL_CHUNK) {
+		this->flush();
+	}
+}
+
+void SpillBuffer::append(const std::string &str) {
+	this->append(str.data(), str.length());
+}
+
+bool SpillBuffer::patch(size_t offset, const std::string &str) {
+	if (this->failed || offset + str.length() > this->size) {
+		return false;
+	}
+	if (-1 == this->fd) {
+		this->data.replace(offset, str.length(), str);
+		return true;
+	}
+	if (!this->flush()) {
+		return false;
+	}
+	if ((ssize_t) str.length()
+			!= pwrite(this->fd, str.data(), str.length(), offset)) {
+		this->failed = true;
+		return false;
+	}
+	return true;
+}
+
+bool SpillBuffer::flush() {
+	if (-1 == this->fd || this->failed) {
+		return !this->failed;
+	}
+	size_t written = 0;
+	while (written < this->data.size()) {
+		ssize_t rv = write(this->fd, this->data.data() + written,
+				this->data.size() - written);
+		if (-1 == rv) {
+			if (EINTR == errno) {
+				continue;
+			}
+			syslog(LOG_ERR, "Fail to write the spill file: %s",
+					strerror(errno));
+			this->failed = true;
+			break;
+		}
+		written += rv;
+	}
+	if (this->account) {
+		this->account->sub(MemoryAccount::RESULT, this->data.size());
+	}
+	this->data.clear();
+	return !this->failed;
+}
+
+bool SpillBuffer::spill() {
+#ifdef O_TMPFILE
+	this->fd = open(this->dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+#endif
+	if (-1 == this->fd) {
+		// No O_TMPFILE support, unlink a named file at once;
+		std::string path = this->dir;
+		path += "/mpool-spill-XXXXXX";
+		char name[PATH_MAX];
+		strncpy(name, path.c_str(), sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		this->fd = mkstemp(name);
+		if (-1 != this->fd) {
+			unlink(name);
+		}
+	}
+	if (-1 == this->fd) {
+		// Keep it in memory, retried on the next response;
+		syslog(LOG_ERR, "Fail to create a spill file in %s: %s", this->dir,
+				strerror(errno));
+		this->threshold = 0;
+		return false;
+	}
+#ifdef DEBUG
+	std::cout<<"(SpillBuffer)Spilled to disk, bytes:"<<this->size<<std::endl;
+#endif
+	if (!this->flush()) {
+		return false;
+	}
+	// Give the buffered memory back;
+	std::string().swap(this->data);
+	return true;
+}
+
+bool SpillBuffer::isSpilled() {
+	return -1 != this->fd;
+}
+
+bool SpillBuffer::isFailed() {
+	return this->failed;
+}
+
+size_t SpillBuffer::length() {
+	return this->size;
+}
+
+std::string& SpillBuffer::getData() {
+	return this->data;
+}
+
+size_t SpillBuffer::read(size_t offset, char *buffer, size_t length) {
+	if (this->failed || offset >= this->size) {
+		return 0;
+	}
+	if (length > this->size - offset) {
+		length = this->size - offset;
+	}
+	if (-1 == this->fd) {
+		memcpy(buffer, this->data.data() + offset, length);
+		return length;
+	}
+	if (!this->flush()) {
+		return 0;
+	}
+	ssize_t rv;
+	do {
+		rv = pread(this->fd, buffer, length, offset);
+	} while (-1 == rv && EINTR == errno);
+	return -1 == rv ? 0 : rv;
+}
+
+int SpillBuffer::release() {
+	int fd = this->fd;
+	this->fd = -1;
+	return fd;
+}
+
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <vector>
+#include <time.h>
+#include <stdlib.h>
+#include "include/TimerWheel.h"
+
+namespace MPool {
+
+TimerNode::TimerNode() {
+	this->prev = NULL;
+	this->next = NULL;
+	this->deadline = 0;
+	this->data = NULL;
+}
+
+bool TimerNode::isLinked() {
+	return this->next != NULL;
+}
+
+TimerWheel::TimerWheel(unsigned int slots) {
+	unsigned int n = 1;
+	while (n < slots) {
+		n <<= 1;
+	}
+	this->mask = n - 1;
+	this->slots = new TimerNode[n];
+	for (unsigned int i = 0; i < n; i++) {
+		this->slots[i].prev = &this->slots[i];
+		this->slots[i].next = &this->slots[i];
+	}
+	this->current = TimerWheel::now();
+	this->count = 0;
+}
+
+TimerWheel::~TimerWheel() {
+	// Detach the remaining nodes, their owners free them;
+	for (unsigned int i = 0; i <= this->mask; i++) {
+		TimerNode *head = &this->slots[i];
+		while (head->next != head) {
+			this->cancel(head->next);
+		}
+	}
+	delete[] this->slots;
+}
+
+void TimerWheel::schedule(TimerNode *node, time_t deadline) {
+	if (!node) {
+		return;
+	}
+	if (node->isLinked()) {
+		this->cancel(node);
+	}
+	if (deadline <= this->current) {
+		// Already due, fire on the next tick;
+		deadline = this->current + 1;
+	}
+	node->deadline = deadline;
+	TimerNode *head = &this->slots[deadline & this->mask];
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+	this->count++;
+}
+
+void TimerWheel::cancel(TimerNode *node) {
+	if (!node || !node->isLinked()) {
+		return;
+	}
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = NULL;
+	node->next = NULL;
+	this->count--;
+}
+
+void TimerWheel::advance(time_t now, std::vector<TimerNode*> &expired) {
+	if (now <= this->current) {
+		return;
+	}
+	// A full turn visits every slot, no need to go further;
+	time_t from = this->current + 1;
+	if (now - this->current > (time_t) this->mask + 1) {
+		from = now - this->mask;
+	}
+	for (time_t t = from; t <= now; t++) {
+		TimerNode *head = &this->slots[t & this->mask];
+		TimerNode *node = head->next;
+		while (node != head) {
+			TimerNode *next = node->next;
+			// Deadlines more than one turn away stay in the slot;
+			if (node->deadline <= now) {
+				this->cancel(node);
+				expired.push_back(node);
+			}
+			node = next;
+		}
+	}
+	this->current = now;
+}
+
+unsigned long TimerWheel::size() {
+	return this->count;
+}
+
+time_t TimerWheel::now() {
+	// Wall clock steps would reap all the clients at once or none;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+}
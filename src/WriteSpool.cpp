@@ -0,0 +1,477 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <my_global.h>
+#include <mysql.h>
+#include "include/version.h"
+#include "include/DBPool.h"
+#include "include/ConcurrencyLimiter.h"
+#include "include/FnvHash.h"
+#include "include/MonotonicClock.h"
+#include "include/WriteSpool.h"
+
+namespace MPool {
+
+static const char spool_magic[8] = { 'M', 'P', 'S', 'P', 'O', 'O', 'L', 1 };
+/// Header: magic, file size, head offset, head sequence;
+static const size_t header_size = 8;
+static const size_t header_head = 16;
+static const size_t header_seq = 24;
+/// Record: payload length, checksum, sequence, payload;
+static const size_t record_header = 16;
+/// Length of the marker at the end of the ring, the next record is at the start;
+static const uint32_t record_wrap = 0xFFFFFFFF;
+
+static size_t recordSize(size_t payload) {
+	return (record_header + payload + 7) & ~(size_t) 7;
+}
+
+/// FNV-1a of the sequence, little endian, & payload;
+static uint32_t checksum(unsigned long long seq, const char *data,
+		size_t length) {
+	unsigned int hash = FnvHash::OFFSET32;
+	unsigned char bytes[sizeof(seq)];
+	for (size_t i = 0; i < sizeof(seq); i++) {
+		bytes[i] = (seq >> (i * 8)) & 0xFF;
+	}
+	FnvHash::hash32(hash, bytes, sizeof(bytes));
+	FnvHash::hash32(hash, data, length);
+	return hash;
+}
+
+WriteSpool::WriteSpool() {
+	this->fd = -1;
+	this->map = NULL;
+	this->size = 0;
+	this->tail = MPOOL_SPOOL_HEADER;
+	this->head = MPOOL_SPOOL_HEADER;
+	this->used = 0;
+	this->next_seq = 1;
+	this->head_seq = 1;
+	this->applied = 0;
+	this->failed = 0;
+	this->sync = WriteSpool::SYNC_INTERVAL;
+	this->interval = MPOOL_SPOOL_SYNC_INTERVAL;
+	this->dirty = false;
+	this->batch = MPOOL_SPOOL_BATCH;
+	this->default_pool = NULL;
+	this->running = false;
+	pthread_mutex_init(&this->mutex, NULL);
+	pthread_cond_init(&this->cond, NULL);
+}
+
+WriteSpool::~WriteSpool() {
+	this->stop();
+	if (this->map) {
+		msync(this->map, this->size, MS_SYNC);
+		munmap(this->map, this->size);
+	}
+	if (this->fd >= 0) {
+		close(this->fd);
+	}
+	pthread_cond_destroy(&this->cond);
+	pthread_mutex_destroy(&this->mutex);
+}
+
+bool WriteSpool::open(const std::string &path, size_t size) {
+	this->path = path;
+	this->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+	if (this->fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (0 != fstat(this->fd, &st)) {
+		return false;
+	}
+	if (0 == st.st_size) {
+		// New spool, zero filled & allocated: a write to a hole of a full
+		// disk would be a SIGBUS in append(), not an error;
+		int error = posix_fallocate(this->fd, 0, size);
+		if (0 != error) {
+			// Empty again, the next start tries anew;
+			if (0 != ftruncate(this->fd, 0)) {
+				syslog(LOG_ERR, "Fail to truncate the spool %s", path.c_str());
+			}
+			errno = error;
+			return false;
+		}
+		st.st_size = size;
+	}
+	// An existing file keeps its size, the ring positions depend on it;
+	this->size = st.st_size;
+	if (this->size < MPOOL_SPOOL_HEADER * 2) {
+		return false;
+	}
+	void *map = mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			this->fd, 0);
+	if (MAP_FAILED == map) {
+		return false;
+	}
+	this->map = (char*) map;
+	pthread_mutex_lock(&this->mutex);
+	this->recover();
+	pthread_mutex_unlock(&this->mutex);
+	return true;
+}
+
+void WriteSpool::setSync(unsigned char sync, unsigned long interval) {
+	this->sync = sync;
+	this->interval = interval ? interval : MPOOL_SPOOL_SYNC_INTERVAL;
+}
+
+void WriteSpool::setBatch(unsigned int batch) {
+	this->batch = batch ? batch : 1;
+}
+
+void WriteSpool::setPool(const std::string &username, DBPool *pool) {
+	this->pools[username] = pool;
+}
+
+void WriteSpool::setDefaultPool(DBPool *pool) {
+	this->default_pool = pool;
+}
+
+void WriteSpool::start() {
+	if (!this->map || this->running) {
+		return;
+	}
+	this->running = true;
+	pthread_create(&this->drainer, NULL, WriteSpool::drain, this);
+}
+
+void WriteSpool::stop() {
+	pthread_mutex_lock(&this->mutex);
+	if (!this->running) {
+		pthread_mutex_unlock(&this->mutex);
+		return;
+	}
+	this->running = false;
+	pthread_cond_broadcast(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+	pthread_join(this->drainer, NULL);
+}
+
+bool WriteSpool::append(const std::string &username, const std::string &sql,
+		std::string &error) {
+	size_t payload = username.size() + 1 + sql.size();
+	size_t length = recordSize(payload);
+	if (!this->map) {
+		error = "No write spool";
+		return false;
+	}
+	if (payload >= record_wrap || length > this->size - MPOOL_SPOOL_HEADER) {
+		error = "Statement too large for the write spool";
+		return false;
+	}
+	pthread_mutex_lock(&this->mutex);
+	// Records never wrap, the end of the ring is skipped instead;
+	size_t waste = this->size - this->tail < length ? this->size - this->tail : 0;
+	if (this->used + waste + length > this->size - MPOOL_SPOOL_HEADER) {
+		pthread_mutex_unlock(&this->mutex);
+		error = "Write spool is full";
+		return false;
+	}
+	size_t wrapped = this->tail;
+	if (waste) {
+		if (waste >= sizeof(record_wrap)) {
+			memcpy(this->map + this->tail, &record_wrap, sizeof(record_wrap));
+		}
+		this->tail = MPOOL_SPOOL_HEADER;
+		this->used += waste;
+	}
+	size_t offset = this->tail;
+	char *record = this->map + offset;
+	unsigned long long seq = this->next_seq;
+	memcpy(record + 8, &seq, sizeof(seq));
+	memcpy(record + record_header, username.c_str(), username.size() + 1);
+	memcpy(record + record_header + username.size() + 1, sql.data(),
+			sql.size());
+	uint32_t sum = checksum(seq, record + record_header, payload);
+	memcpy(record + 4, &sum, sizeof(sum));
+	uint32_t size = payload;
+	memcpy(record, &size, sizeof(size));
+	this->tail += length;
+	this->used += length;
+	this->next_seq++;
+	this->dirty = true;
+	pthread_cond_signal(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+	if (WriteSpool::SYNC_ALWAYS == this->sync) {
+		if (waste) {
+			this->syncRange(wrapped, waste);
+		}
+		this->syncRange(offset, length);
+	}
+	return true;
+}
+
+unsigned long long WriteSpool::getPending() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long pending = this->next_seq - this->head_seq;
+	pthread_mutex_unlock(&this->mutex);
+	return pending;
+}
+
+unsigned long long WriteSpool::getBytes() {
+	pthread_mutex_lock(&this->mutex);
+	unsigned long long bytes = this->used;
+	pthread_mutex_unlock(&this->mutex);
+	return bytes;
+}
+
+unsigned long long WriteSpool::getApplied() {
+	return this->applied;
+}
+
+unsigned long long WriteSpool::getFailed() {
+	return this->failed;
+}
+
+void* WriteSpool::drain(void *spool) {
+	mysql_thread_init();
+	((WriteSpool*) spool)->drainLoop();
+	mysql_thread_end();
+	return NULL;
+}
+
+void WriteSpool::drainLoop() {
+	unsigned long long synced = MonotonicClock::millis();
+	pthread_mutex_lock(&this->mutex);
+	while (this->running) {
+		if (WriteSpool::SYNC_INTERVAL == this->sync && this->dirty
+				&& MonotonicClock::millis() - synced >= this->interval) {
+			this->dirty = false;
+			pthread_mutex_unlock(&this->mutex);
+			msync(this->map, this->size, MS_SYNC);
+			synced = MonotonicClock::millis();
+			pthread_mutex_lock(&this->mutex);
+			continue;
+		}
+		if (this->head_seq == this->next_seq) {
+			MonotonicClock::waitFor(&this->cond, &this->mutex, this->interval);
+			continue;
+		}
+		// A run of records of the same user;
+		std::string username;
+		std::vector<std::string> sqls;
+		size_t offset = this->head;
+		size_t bytes = 0;
+		unsigned long long seq = this->head_seq;
+		while (seq < this->next_seq && sqls.size() < this->batch) {
+			std::string user, sql;
+			size_t at = offset, length;
+			if (!this->readRecord(at, seq, user, sql, length)
+					|| (!sqls.empty() && user != username)) {
+				break;
+			}
+			username.swap(user);
+			sqls.push_back(sql);
+			offset = at;
+			bytes += length;
+			seq++;
+		}
+		if (sqls.empty()) {
+			// Cannot happen unless the file was changed under us;
+			syslog(LOG_ERR, "Write spool %s corrupted, %llu statements lost",
+					this->path.c_str(), this->next_seq - this->head_seq);
+			this->head = this->tail;
+			this->head_seq = this->next_seq;
+			this->used = 0;
+			this->writeHeader();
+			continue;
+		}
+		pthread_mutex_unlock(&this->mutex);
+		bool done = this->apply(username, sqls);
+		pthread_mutex_lock(&this->mutex);
+		if (!done) {
+			// Backend down, keep the records until it is back;
+			MonotonicClock::waitFor(&this->cond, &this->mutex,
+					MPOOL_SPOOL_RETRY);
+			continue;
+		}
+		this->head = offset;
+		this->head_seq = seq;
+		this->applied += sqls.size();
+		this->writeHeader();
+		if (WriteSpool::SYNC_NONE != this->sync) {
+			// On disk before the space is reused, or a replay would stop at
+			// the overwritten records;
+			pthread_mutex_unlock(&this->mutex);
+			this->syncRange(0, MPOOL_SPOOL_HEADER);
+			pthread_mutex_lock(&this->mutex);
+		}
+		this->used -= bytes;
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+bool WriteSpool::apply(const std::string &username,
+		std::vector<std::string> &sqls) {
+	std::map<std::string, DBPool*>::iterator it = this->pools.find(username);
+	DBPool *pool = it == this->pools.end() ? this->default_pool : it->second;
+	if (!pool) {
+		return false;
+	}
+	pool->getLimiter()->acquire();
+	DB *db_con = pool->allocDB();
+	if (!db_con) {
+		pool->getLimiter()->release(0);
+		return false;
+	}
+	MYSQL_RES *res = NULL;
+	bool transaction = sqls.size() > 1;
+	bool done = !transaction || db_con->execute("BEGIN", &res);
+	unsigned long long failed = 0;
+	for (size_t i = 0; done && i < sqls.size(); i++) {
+		if (db_con->execute(sqls[i], &res)) {
+			if (res) {
+				mysql_free_result(res);
+				res = NULL;
+			}
+		} else if (db_con->getErrno() >= 2000 || 1213 == db_con->getErrno()
+				|| 1205 == db_con->getErrno()) {
+			// CR_* client errors, the connection is gone; a deadlock or a
+			// lock wait timeout, the batch runs again from its first one;
+			done = false;
+		} else {
+			// Rolled back alone, nobody is waiting for the error;
+			failed++;
+			syslog(LOG_WARNING, "Spooled statement of %s failed: %s",
+					username.c_str(), db_con->getError().c_str());
+		}
+	}
+	if (done && transaction) {
+		done = db_con->execute("COMMIT", &res);
+	}
+	if (!done && transaction) {
+		db_con->execute("ROLLBACK", &res);
+	}
+	unsigned long long rtt = db_con->getRtt();
+	pool->freeDB(db_con);
+	pool->getLimiter()->release(rtt);
+	if (done) {
+		this->failed += failed;
+	}
+	return done;
+}
+
+void WriteSpool::recover() {
+	unsigned long long size = 0;
+	memcpy(&size, this->map + header_size, sizeof(size));
+	if (memcmp(this->map, spool_magic, sizeof(spool_magic))
+			|| size != this->size) {
+		memset(this->map, 0, MPOOL_SPOOL_HEADER);
+		memcpy(this->map, spool_magic, sizeof(spool_magic));
+		size = this->size;
+		memcpy(this->map + header_size, &size, sizeof(size));
+		this->head = MPOOL_SPOOL_HEADER;
+		this->head_seq = 1;
+		this->writeHeader();
+		this->syncRange(0, MPOOL_SPOOL_HEADER);
+	} else {
+		unsigned long long head = 0;
+		memcpy(&head, this->map + header_head, sizeof(head));
+		memcpy(&this->head_seq, this->map + header_seq,
+				sizeof(this->head_seq));
+		this->head =
+				head >= MPOOL_SPOOL_HEADER && head <= this->size ?
+						head : MPOOL_SPOOL_HEADER;
+	}
+	// Records after head, up to a gap in the sequence or a torn write;
+	this->tail = this->head;
+	this->next_seq = this->head_seq;
+	this->used = 0;
+	std::string username, sql;
+	size_t length;
+	while (this->readRecord(this->tail, this->next_seq, username, sql, length)) {
+		this->used += length;
+		this->next_seq++;
+	}
+	if (this->next_seq != this->head_seq) {
+		syslog(LOG_NOTICE, "Replaying %llu spooled statements from %s",
+				this->next_seq - this->head_seq, this->path.c_str());
+	}
+}
+
+bool WriteSpool::readRecord(size_t &offset, unsigned long long seq,
+		std::string &username, std::string &sql, size_t &length) {
+	size_t at = offset;
+	size_t skipped = 0;
+	uint32_t size = 0;
+	if (this->size - at >= record_header) {
+		memcpy(&size, this->map + at, sizeof(size));
+	}
+	if (this->size - at < record_header || record_wrap == size) {
+		skipped = this->size - at;
+		at = MPOOL_SPOOL_HEADER;
+		memcpy(&size, this->map + at, sizeof(size));
+	}
+	unsigned long long stored = 0;
+	uint32_t sum = 0;
+	memcpy(&sum, this->map + at + 4, sizeof(sum));
+	memcpy(&stored, this->map + at + 8, sizeof(stored));
+	if (!size || record_wrap == size || stored != seq
+			|| recordSize(size) > this->size - at
+			|| sum != checksum(seq, this->map + at + record_header, size)) {
+		return false;
+	}
+	const char *payload = this->map + at + record_header;
+	const char *end = (const char*) memchr(payload, 0, size);
+	if (!end) {
+		return false;
+	}
+	username.assign(payload, end - payload);
+	sql.assign(end + 1, size - (end + 1 - payload));
+	length = skipped + recordSize(size);
+	offset = at + recordSize(size);
+	return true;
+}
+
+void WriteSpool::writeHeader() {
+	unsigned long long head = this->head;
+	memcpy(this->map + header_head, &head, sizeof(head));
+	memcpy(this->map + header_seq, &this->head_seq, sizeof(this->head_seq));
+}
+
+void WriteSpool::syncRange(size_t offset, size_t length) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page - 1);
+	msync(this->map + start, offset + length - start, MS_SYNC);
+}
+
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef BULKLOAD_H_
+#define BULKLOAD_H_
+
+namespace MPool {
+
+class MemoryAccount;
+
+/**
+ * @brief Data frames of a bulk_load on their way to LOAD DATA LOCAL INFILE
+ * The reactor push()es the frames as they arrive, the worker running the
+ * statement read()s them from the local infile handler. At most window
+ * bytes are buffered, the client waits for the reply of a frame before
+ * sending more. Thread safe.
+ * */
+class BulkLoad {
+public:
+	/**
+	 * @param timeout: Seconds the whole load may take, 0 for no limit
+	 * @param memory: Charged with the buffered frames, NULL for none
+	 * */
+	BulkLoad(size_t window, unsigned long timeout, MemoryAccount *memory);
+	/// Gives the bytes still buffered back
+	~BulkLoad();
+	/**
+	 * @brief Buffer a frame
+	 * @return false when the load is over, or aborted past the window
+	 * @note Reactor thread only
+	 * */
+	bool push(const std::string &data);
+	/// No more frames, read() then returns 0
+	void finish();
+	/// Fail the load, read() then returns -1
+	void abort(const std::string &error);
+	/**
+	 * @brief Copy the next bytes, waits up to MPOOL_BULK_TIMEOUT for a frame
+	 * Aborts the load once past its timeout, frames buffered or not.
+	 * @param completed: Frames read to the end
+	 * @return Bytes copied, 0 at the end, -1 when aborted
+	 * */
+	int read(char *buffer, unsigned int length, unsigned long &completed);
+	/**
+	 * @brief The statement returned, push() fails from now on
+	 * @return Frames never read, they still need a reply
+	 * */
+	unsigned long close();
+	/// Closed, the next bulk_load may start
+	bool isClosed();
+	/// Frames are still taken
+	bool isOpen();
+	/// Why the load was aborted, empty when it was not
+	std::string getError();
+	unsigned long long getBytes();
+	/**
+	 * @brief LOAD DATA LOCAL INFILE of the request fields
+	 * @param table: Name, may be qualified by the database
+	 * @param columns: Comma separated names, empty for all in order
+	 * @param format: csv (RFC 4180 quoting) or tsv (MySQL defaults)
+	 * @return false when a name or the format is invalid
+	 * */
+	static bool buildStatement(const std::string &table,
+			const std::string &columns, const std::string &format,
+			unsigned long ignore_lines, std::string &sql);
+protected:
+	std::deque<std::string> frames;
+	size_t offset; /// Bytes of the first frame already read
+	size_t buffered;
+	size_t window;
+	time_t deadline; /// 0 for none
+	MemoryAccount *memory;
+	bool ended; /// finish() called
+	bool aborted;
+	bool closed;
+	std::string error;
+	unsigned long long bytes; /// Read so far
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+}
+
+#endif /* BULKLOAD_H_ */
@@ -26,6 +26,58 @@
 /// All Classes of mPool is defined in name space MPool
 namespace MPool {
 
+class SpillBuffer;
+class Cursor;
+class RateLimiter;
+class ShardRouter;
+class ReplicaSet;
+class ShardResult;
+class InsertBatch;
+class WriteSpool;
+class BulkLoad;
+class FrameCompressor;
+
+/**
+ * @brief Queued statement
+ * */
+class Statement {
+public:
+	/// Statement types
+	const static unsigned char QUERY = 0x00;
+	const static unsigned char CURSOR = 0x01; /// Open a cursor on sql
+	const static unsigned char FETCH = 0x02; /// Next rows of a cursor
+	const static unsigned char CLOSE_CURSOR = 0x03;
+	const static unsigned char EXPIRE_CURSORS = 0x04; /// Close all, no reply
+	const static unsigned char BATCH = 0x05; /// A row of a merged INSERT
+	const static unsigned char SPOOL = 0x06; /// Appended to the write spool
+	const static unsigned char BULK = 0x07; /// LOAD DATA LOCAL INFILE of the bulk load
+	const static unsigned char FRAME = 0x08; /// Framed reply in sql, sent as is
+	/// Shards of a query
+	const static int NO_SHARD = -1; /// The pool of the client
+	const static int ALL_SHARDS = -2; /// Scatter-gather
+	const static int REPLICA = -3; /// A read replica, the primary as fallback
+	std::string sql; /// The message when rejected
+	const char *rejected; /// Status replied instead of running it, NULL to run
+	unsigned char type;
+	unsigned long cursor; /// Id of the cursor
+	unsigned long rows; /// Rows to fetch, seconds unused for EXPIRE_CURSORS
+	unsigned long retry; /// Milliseconds to wait before a retry when rejected
+	bool limited; /// Counted by the rate limiter of the user until done
+	int shard; /// Index in the router, NO_SHARD or ALL_SHARDS
+	std::string order_by; /// Column merged on by a scatter, empty to concatenate
+	bool descending;
+	std::string gtid; /// Token a replica has to apply before a REPLICA read
+	InsertBatch *batch; /// Holds a reference, BATCH only
+	unsigned int row; /// Index of the row in the batch
+	bool conditional; /// Reply the hash of the rows, NOT_MODIFIED when it is hash
+	unsigned char codec; /// FrameCompressor::* of the rows
+	std::string hash; /// Hash of the rows the client holds, QUERY only
+public:
+	Statement(unsigned char type = QUERY);
+	/// Exchange all the fields, moves a statement in & out of the queue
+	void swap(Statement &other);
+};
+
 /**
  * @brief Client Structure
  * */
@@ -34,11 +86,15 @@ public:
 	Client(std::string username);
 	virtual ~Client();
 	time_t getConnectTime();
-	/// Heart break;
+	/**
+	 * @brief Heart break, re-arms the idle timeout
+	 * @note Reactor thread only
+	 * */
 	void lastActive();
+	void setTimerWheel(TimerWheel *wheel);
 	time_t getLastHbTime();
 	/**
-	 * @brief Generate a new token
+	 * @brief Generate a new token from /dev/urandom
 	 * @return The active token
 	 *         -NULL when fail
 	 *         -Token when success
@@ -57,33 +113,235 @@ public:
 	 * @param status: A for Active, O for Off-line
 	 * @return The last online status
 	 * */
-	void pushSQL(std::string sql);
+	/// Queue a statement, QUERY, SPOOL, BULK or FRAME
+	void pushSQL(std::string sql, unsigned char type = Statement::QUERY);
+	/// Queue a cursor statement, sql is used by CURSOR only
+	void pushCursor(unsigned char type, unsigned long cursor = 0,
+			unsigned long rows = 0, std::string sql = "");
+	/**
+	 * @brief Arm the expiry check of the cursors unless it is armed
+	 * @note Reactor thread only
+	 * */
+	void touchCursors(time_t timeout);
+	/// The expired timer is the cursor expiry
+	bool isCursorTimer(TimerNode *node);
+	/// Open cursors, thread safe
+	unsigned int getCursorCount();
+	void setCursorLimit(unsigned int max_cursors);
+	/// Scheduling of the user: MPOOL_PRIORITY_* class & weight in it
+	void setSchedule(unsigned char priority, unsigned int weight);
+	/// Priority of the statements pushed next, never above the one of the user
+	void setPriority(unsigned char priority);
+	unsigned char getPriority();
+	unsigned int getWeight();
+	/**
+	 * @brief Queue an error reply, kept in order with the queries before it
+	 * @param retry: Milliseconds replied in data, 0 for none
+	 * */
+	void reject(const char *status, const std::string &message,
+			unsigned long retry = 0);
+	/// Counts the statements of the user, owned by the server, NULL for none
+	void setRateLimiter(RateLimiter *rate_limiter);
+	RateLimiter* getRateLimiter();
+	/// Shards of the routed queries, owned by the server
+	void setShardRouter(ShardRouter *router);
+	/**
+	 * @brief Route the next pushSQL(), it goes back to NO_SHARD after
+	 * @param order_by: Column the rows of a scatter are merged on, each
+	 *        shard returning them sorted
+	 * @note Reactor thread only
+	 * */
+	void setRoute(int shard, const std::string &order_by = "",
+			bool descending = false);
+	/// Read replicas of the primary, owned by the server
+	void setReplicaSet(ReplicaSet *replicas);
+	/**
+	 * @brief Send the next pushSQL() to a replica that applied the GTIDs,
+	 * empty for the last write of the client
+	 * @note Reactor thread only
+	 * */
+	void setReplicaRoute(const std::string &gtid);
+	/**
+	 * @brief Hash the rows of the next pushSQL(), reply NOT_MODIFIED instead
+	 * of the rows when they hash to hash
+	 * @param conditional: false to reply the rows as usual
+	 * @note Reactor thread only
+	 * */
+	void setIfNoneMatch(bool conditional, const std::string &hash = "");
+	/**
+	 * @brief Queue a row of a batch, takes over a reference of the batch
+	 * Hand the client to the manager once the batch is closed.
+	 * */
+	void pushBatch(InsertBatch *batch, unsigned int row);
+	/**
+	 * @brief Batch the client waits for to close, NULL for none
+	 * @note Reactor thread only
+	 * */
+	void setOpenBatch(InsertBatch *batch);
+	InsertBatch* getOpenBatch();
+	/// Spool of the SPOOL statements, owned by the server
+	void setWriteSpool(WriteSpool *spool);
+	/**
+	 * @brief Data of the next BULK statement, the client owns it
+	 * Replaces the last one, which has to be closed.
+	 * @note Reactor thread only
+	 * */
+	void setBulkLoad(BulkLoad *bulk);
+	BulkLoad* getBulkLoad();
+	/// Compression of the result frames, owned by the server
+	void setCompressor(FrameCompressor *compressor);
+	/**
+	 * @brief FrameCompressor::* codec of the rows of the next statements
+	 * @note Reactor thread only
+	 * */
+	void setCodec(unsigned char codec);
 	void setSocket(int s); /// Set socket;
+	/**
+	 * @brief Socket closed, keep the session until the grace period ends
+	 * @note Reactor thread only
+	 * */
+	void detach(time_t grace);
 	int getSocket(); /// Return TCP socket;
+	void setUring(IOUring *uring); /// Send through io_uring, NULL to write directly;
+	/// Send through shared memory, the client owns it, NULL to use the socket;
+	void setShm(ShmChannel *shm);
+	ShmChannel* getShm();
 	void setDBConnection(DB *db_con);
 	DB* getDBConnection();
-	void doWork();
-	void wait();
-	bool isTimeout();
-	void setTimeout();
+	/// Borrow a connection per statement when no connection is pinned;
+	void setDBPool(DBPool *db_pool);
+	DBPool* getDBPool();
+	/**
+	 * @brief Run the next statement
+	 * @param heartbeat: Of the worker, refreshed while a long work progresses
+	 * */
+	void doWork(time_t *heartbeat = NULL);
+	/// MPOOL_WIRE_*, replies are encoded for it;
+	void setWire(unsigned char wire);
+	/**
+	 * @brief Responses larger than threshold are spilled to a temp file
+	 * @param threshold: Bytes, 0 keeps them in memory
+	 * @param dir: Directory of the temp files, kept by the caller
+	 * */
+	void setSpill(size_t threshold, const char *dir);
+	/// Results larger than limit bytes are replied as RESULT_TOO_LARGE, 0 for no limit
+	void setResultLimit(size_t limit);
+	/// Queued SQL & results in memory, call setParent() before the first query
+	MemoryAccount* getMemory();
+	/// Send a package to the socket;
+	void sendData(const std::string &str);
+	/// Send a spilled package with sendfile(), file_fd is closed;
+	void sendFile(int file_fd, size_t length);
+	void done(); /// Finish a work;
 	bool isBusy();
+	/// Mark busy before handing over to a worker, false when already busy;
+	bool acquire();
 	unsigned long getWorks();
+protected:
+	/// Append to the queue, counted by the rate limiter when limited; mutex held
+	void enqueue(Statement &statement);
+	/**
+	 * @brief Encode the rows straight into the frame, false past the result limit or on fetch errors
+	 * @param hash: Hash of the rows, also added to the frame, NULL to skip it
+	 * */
+	bool encodeResult(MYSQL_RES *res, SpillBuffer &frame,
+			std::string *hash = NULL);
+	/// Send an encoded frame, compressed with the codec when it pays;
+	void sendFrame(SpillBuffer &frame, unsigned char codec);
+	/// Send a reply without rows;
+	void sendMessage(const std::string &status, const std::string &code,
+			const std::string &message, const std::string &data = "",
+			const std::string &gtid = "");
+	/// Connection of a replica read, NULL to read from the primary;
+	DB* openReplica(const std::string &gtid, DBPool *&db_pool,
+			bool &entered);
+	/// Open, fetch & close cursors, replies in JSON;
+	void doCursorWork(Statement &statement);
+	/// Encode up to rows rows of the cursor, false past the result limit or on fetch errors;
+	bool encodeCursor(Cursor *cursor, unsigned long rows, SpillBuffer &frame,
+			bool &end);
+	Cursor* findCursor(unsigned long id);
+	/// Unlink & delete the cursor, give its connection back;
+	void closeCursor(Cursor *cursor);
+	/**
+	 * @brief Wait for the concurrency limit of the backend
+	 * The pinned session waits at most MPOOL_LIMIT_WAIT, its row locks may
+	 * be what the statements in the slots wait on.
+	 * @param entered: A slot is taken, false as well without a pool
+	 * @return false when the session gave up, reply OVERLOADED
+	 * */
+	bool enterBackend(DBPool *db_pool, bool &entered);
+	/// Statement done, rtt is DB::getRtt() of its execute, 0 for no sample;
+	void leaveBackend(DBPool *db_pool, bool entered, unsigned long long rtt);
+	/// Run a query on all the shards at once, reply the rows of all;
+	void doScatterWork(const std::string &sql, Statement &statement);
+	/// Same column names in the same order;
+	bool sameColumns(MYSQL_RES *res, MYSQL_RES *other);
+	/// Encode the rows of the shards, merged on the column when not -1, false past the result limit;
+	bool encodeShards(std::vector<ShardResult> &results, int column,
+			bool descending, SpillBuffer &frame, std::string *hash);
+	/// Run the batch when first to claim it, reply the result of the row, false when parked;
+	bool doBatchWork(Statement &statement);
+	/// Append to the write spool, reply once it is spooled;
+	void doSpoolWork(const std::string &sql);
+	/// Stream the frames of the bulk load into MySQL, one reply per frame & the result;
+	void doBulkWork(const std::string &sql, time_t *heartbeat);
+	/// Local infile source of doBulkWork(), replies the frames read;
+	static int readBulk(void *feed, char *buffer, unsigned int length);
+	/// Run a COM_QUERY, reply a MySQL resultset, OK or ERR packet;
+	void doMySQLWork(const std::string &sql);
+	/// Stream a MySQL text resultset into the frame, false past the result limit;
+	bool encodeMySQLResult(MYSQL_RES *res, unsigned char &seq,
+			SpillBuffer &frame);
 protected:
 	int socket; /// Socket file descriptor;
 	std::string username; /// Just store the username
 	std::string token; /// Token which is generated by server
-	std::queue<std::string> sqls; /// Current query string;
+	std::list<Statement> sqls; /// Pending statements, no allocation when empty;
 	time_t connect_time; /// Connection Time
-	time_t last_hb_time; /// Last Heart Break
+	time_t last_hb_time; /// Last Heart Break, TimerWheel::now() seconds
 	unsigned long queries; /// Number of queries sent by client
 	unsigned long success_queries; /// Number of executed queries
 	unsigned long failed_queries; /// Number of failed queries
 	DB *db_con; /// DB connection;
-	pthread_mutex_t work_mutex;
-	pthread_mutex_t sql_mutex;
-	Json::Reader *jsonReader;
-	Json::FastWriter *jsonWriter;
+	DBPool *db_pool; /// Shared mode pool;
+	pthread_mutex_t mutex; /// Protects sqls, works & working;
+	bool working; /// doWork() is running;
 	unsigned long works;
+	unsigned long limited_works; /// Works counted by the rate limiter;
+	bool limited; /// The running work is counted by the rate limiter;
+	IOUring *uring; /// io_uring backend;
+	ShmChannel *shm; /// Shared memory transport;
+	unsigned char wire; /// Protocol of the replies;
+	TimerWheel *wheel; /// Idle timeouts, owned by the reactor;
+	TimerNode timer; /// Entry in the wheel;
+	size_t spill_threshold; /// Response bytes kept in memory, 0 for all;
+	const char *spill_dir; /// Owned by the server;
+	size_t max_result_size; /// 0 for no limit;
+	MemoryAccount memory; /// Charged to the server account;
+	Cursor *cursors; /// Open cursors, used by the worker only;
+	unsigned long last_cursor; /// Id of the last opened cursor;
+	unsigned int cursor_count; /// Read by the reactor, atomic;
+	unsigned int max_cursors;
+	TimerNode cursor_timer; /// Closes the cursors unused for a timeout;
+	unsigned char priority; /// MPOOL_PRIORITY_* of the next statements;
+	unsigned char user_priority; /// MPOOL_PRIORITY_* of the user;
+	unsigned int weight; /// Share of the user in its priority class;
+	RateLimiter *rate_limiter; /// Limits of the user;
+	ShardRouter *router; /// NULL without shards;
+	int route_shard; /// Route of the next pushSQL();
+	std::string route_order_by;
+	bool route_descending;
+	std::string route_gtid;
+	bool route_conditional;
+	std::string route_hash;
+	ReplicaSet *replicas; /// NULL without replicas;
+	std::string last_gtid; /// GTIDs of the last write, used by the worker only;
+	InsertBatch *open_batch; /// Not closed yet, reactor thread only;
+	WriteSpool *spool; /// NULL without spool_file;
+	BulkLoad *bulk; /// The last bulk load, NULL before the first;
+	FrameCompressor *compressor; /// NULL to never compress;
+	unsigned char codec; /// Codec of the statements pushed next;
 };
 
 }
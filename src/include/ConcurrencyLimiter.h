@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef CONCURRENCYLIMITER_H_
+#define CONCURRENCYLIMITER_H_
+
+namespace MPool {
+
+/**
+ * @brief Adaptive limit of the statements running on a backend
+ * Gradient algorithm: the limit follows limit * min(1, tolerance * min RTT /
+ * RTT) plus a small queue allowance, so it grows while the latency stays near
+ * its minimum and shrinks once the backend starts queueing. The minimum RTT
+ * is probed again every MPOOL_LIMIT_PROBE samples. Thread safe.
+ * */
+class ConcurrencyLimiter {
+public:
+	ConcurrencyLimiter();
+	~ConcurrencyLimiter();
+	/**
+	 * @brief Bounds of the limit, adaptive false keeps it at max_limit
+	 * and never blocks
+	 * */
+	void setLimits(bool adaptive, unsigned int min_limit,
+			unsigned int max_limit);
+	/**
+	 * @brief Wait for a slot before running a statement
+	 * @param timeout: Milliseconds, 0 waits as long as it takes
+	 * @return false when the timeout expired, no slot is taken
+	 * */
+	bool acquire(unsigned long timeout = 0);
+	/**
+	 * @brief Statement done, frees the slot
+	 * @param rtt: Microseconds MySQL took to answer it, DB::getRtt(); not the
+	 *        wait for a connection nor the encoding of the rows, 0 for no
+	 *        sample
+	 * */
+	void release(unsigned long long rtt);
+	unsigned int getLimit();
+	unsigned int getInflight();
+	/// acquire() calls that had to wait for a slot
+	unsigned long long getWaits();
+	/// Microseconds
+	unsigned long long getMinRtt();
+	/// Microseconds, moving average
+	unsigned long long getRtt();
+	/// Monotonic clock in microseconds
+	static unsigned long long now();
+protected:
+	bool adaptive;
+	double limit;
+	unsigned int min_limit;
+	unsigned int max_limit;
+	unsigned int inflight;
+	double rtt; /// Moving average of the samples
+	unsigned long long min_rtt;
+	unsigned long long probe_rtt; /// Minimum since the last probe
+	unsigned long samples; /// Since the last probe of min_rtt
+	unsigned long long waits;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+}
+
+#endif /* CONCURRENCYLIMITER_H_ */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef CONNECTIONTABLE_H_
+#define CONNECTIONTABLE_H_
+
+/// Generations wrap at 2^29, so fd + generation + op fit in io_uring user_data
+#define MPOOL_GENERATION_MASK 0x1fffffff
+
+namespace MPool {
+
+/**
+ * @brief Connection slot, indexed by socket fd
+ * */
+class Connection {
+public:
+	Client *client; /// NULL until the first query
+	std::string *buffer; /// Partial package, only allocated while one is pending
+	unsigned int generation; /// Bumped whenever the fd is opened or closed
+	unsigned char wire; /// MPOOL_WIRE_*, protocol of the listener
+};
+
+/**
+ * @brief Flat fd-indexed connection table
+ * Lookups are O(1) array accesses. A handle (generation << 32 | fd) is given
+ * to the I/O backend, events carrying a stale handle belong to a closed
+ * socket whose fd has been reused and must be ignored.
+ * Only the reactor thread mutates the table.
+ * */
+class ConnectionTable {
+public:
+	/// @param capacity: Initial slots, usually RLIMIT_NOFILE
+	ConnectionTable(unsigned long capacity = 1024);
+	~ConnectionTable();
+	/**
+	 * @brief Start tracking an accepted socket
+	 * @param wire: MPOOL_WIRE_*, protocol spoken on the socket
+	 * @return Handle of the connection
+	 * */
+	unsigned long long open(int fd, unsigned char wire = MPOOL_WIRE_JSON);
+	/// Stop tracking the socket, issued handles become stale
+	void close(int fd);
+	/// @return false when the fd has been closed since the handle was issued
+	bool isValid(unsigned long long handle);
+	Client* get(int fd);
+	void attach(int fd, Client *client);
+	unsigned int getGeneration(int fd);
+	unsigned char getWire(int fd);
+	/// Prepend the partial package kept before to data, then free it
+	void takeBuffer(int fd, std::string &data);
+	/// Keep the partial package from offset until the rest arrives
+	void keepBuffer(int fd, const std::string &data, size_t offset);
+	/// Bytes held by all receive buffers
+	unsigned long long getBuffered();
+	/// Number of attached clients
+	unsigned long size();
+	/// Upper bound of the fds in the table, for iterating with get()
+	unsigned long capacity();
+	static unsigned long long makeHandle(int fd, unsigned int generation);
+	static int getHandleFd(unsigned long long handle);
+	static unsigned int getHandleGeneration(unsigned long long handle);
+protected:
+	Connection *slots;
+	unsigned long nslots;
+	unsigned long count;
+	unsigned long long buffered;
+protected:
+	bool grow(int fd);
+	void dropBuffer(Connection *c);
+};
+
+}
+
+#endif /* CONNECTIONTABLE_H_ */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef CURSOR_H_
+#define CURSOR_H_
+
+namespace MPool {
+
+/**
+ * @brief Read only server side cursor of a client
+ * Wraps a prepared statement opened with DB::openCursor() on a connection
+ * borrowed for the cursor's lifetime. The server keeps the rows, fetch()
+ * brings them over MPOOL_CURSOR_PREFETCH at a time, so memory stays
+ * constant whatever the size of the result.
+ * Only the worker running the client uses it.
+ * */
+class Cursor {
+public:
+	/**
+	 * @param account: Charged with the column buffers
+	 * */
+	Cursor(unsigned long id, DB *db, MYSQL_STMT *stmt,
+			MemoryAccount *account = NULL);
+	/// Closes the statement, the caller gives the connection back
+	~Cursor();
+	/// Bind the columns as strings, false when the statement has no rows
+	bool bind();
+	/**
+	 * @brief Fetch the next row
+	 * @return The values, NULL for SQL NULL; NULL at the end or on errors
+	 * */
+	char** fetch();
+	/// The last fetch() failed
+	bool isFailed();
+	std::string getError();
+	MYSQL_FIELD* getFields();
+	unsigned int getFieldCount();
+	unsigned long getId();
+	DB* getDB();
+	/// Opened or fetched at now, TimerWheel::now() seconds
+	void touch(time_t now);
+	time_t getUsed();
+public:
+	Cursor *next; /// Next cursor of the client
+protected:
+	unsigned long id;
+	DB *db;
+	MYSQL_STMT *stmt;
+	MYSQL_RES *meta; /// Column definitions
+	MemoryAccount *account;
+	std::vector<MYSQL_BIND> binds;
+	std::vector<std::string> buffers; /// One per column, grown on truncation
+	std::vector<unsigned long> lengths;
+	std::vector<my_bool> nulls;
+	std::vector<char*> row;
+	size_t held; /// Bytes of the buffers
+	bool failed;
+	std::string error;
+	time_t used; /// Last open or fetch
+protected:
+	void resize(unsigned int column, size_t size);
+};
+
+}
+
+#endif /* CURSOR_H_ */
@@ -25,6 +25,7 @@
 #ifndef DBPOOL_H_
 #define DBPOOL_H_
 namespace MPool {
+class ConcurrencyLimiter;
 typedef std::map<std::string, std::string> DBDataRow;
 typedef std::vector<DBDataRow> DBDataSet;
 class DBResult {
@@ -38,6 +39,12 @@ protected:
 	unsigned int db_errno;
 	std::string db_error;
 	unsigned long long affected_rows;
+	unsigned long long insert_id;
+	std::string gtid; /// GTIDs of the last statement, from session tracking
+	unsigned long long rtt; /// Microseconds of the last statement
+	/// Source of LOAD DATA LOCAL INFILE, refused when NULL
+	int (*local_read)(void *source, char *buffer, unsigned int length);
+	void *local_source;
 	pthread_mutex_t mutex;
 	unsigned long id;
 public:
@@ -47,6 +54,48 @@ public:
 	std::string getError();
 	unsigned long long getAffectedRows();
 	DBResult* query(std::string sql);
+	/**
+	 * @brief Run a statement and keep the raw result
+	 * @param res: Result set to free with mysql_free_result(), NULL when the
+	 *        statement returns no rows
+	 * @param stream: Fetch rows from the server one by one instead of
+	 *        storing them all, the connection is busy until res is freed
+	 * @return false on error
+	 * */
+	bool execute(const std::string &sql, MYSQL_RES **res, bool stream = false);
+	/// After fetching the last row of a stream, @return true when it failed
+	bool checkFetch();
+	/// Id of the server thread, for KILL QUERY
+	unsigned long getThreadId();
+	/**
+	 * @brief Microseconds MySQL took to answer the last execute() or
+	 *        openCursor(), until the first row of a stream
+	 * */
+	unsigned long long getRtt();
+	/**
+	 * @brief Prepare & execute a statement with a read only server cursor
+	 * @param prefetch: Rows brought over by each fetch from the server
+	 * @return Statement to close with mysql_stmt_close(), NULL on error
+	 * */
+	MYSQL_STMT* openCursor(const std::string &sql, unsigned long prefetch);
+	unsigned long long getInsertId();
+	/**
+	 * @brief Run a LOAD DATA LOCAL INFILE, the file is read from source
+	 * @param read: Copies up to length bytes, returns 0 at the end and -1
+	 *        to fail the statement
+	 * @return false on error
+	 * */
+	bool loadLocal(const std::string &sql,
+			int (*read)(void *source, char *buffer, unsigned int length),
+			void *source);
+	/// A loadLocal() is running
+	bool hasLocal();
+	/// Read by the local infile handler, -1 without a loadLocal() source
+	int readLocal(char *buffer, unsigned int length);
+	/// GTIDs committed by the last statement, empty unless tracked
+	std::string getGtid();
+	/// Report the GTIDs of the session with each OK packet, false on error
+	bool trackGtids();
 	void freeResult(DBResult *result);
 	unsigned long getId();
 	void setId(unsigned long);
@@ -63,15 +112,42 @@ protected:
 	unsigned int min_alives;
 	pthread_mutex_t mutex;
 	unsigned long current_id;
+	ConcurrencyLimiter *limiter; /// Statements running on this backend
+	unsigned long long hits; /// allocDB() served by an idle connection
+	unsigned long long misses; /// allocDB() that had to connect
+	bool track_gtids; /// New connections report their GTIDs
+	unsigned int held; /// Connections of allocHeldDB() not given back
 public:
 	DBPool();
 	~DBPool();
 	bool start(std::string host, std::string user, std::string pass,
 			std::string database, unsigned int port);
 	void setMinAlives(unsigned int ma);
+	/// Call before start(), the connections then report the GTIDs of writes
+	void setTrackGtids(bool track_gtids);
 	unsigned int getMinAlives();
 	DB* allocDB();
 	void freeDB(DB *db);
+	/**
+	 * @brief Borrow a connection kept across statements, e.g. by a cursor
+	 * At most half of the pool size (at least one) at once, so statements
+	 * keep a share of the pool.
+	 * @return NULL past that or when no connection is available
+	 * */
+	DB* allocHeldDB();
+	/// Give back a connection of allocHeldDB()
+	void freeHeldDB(DB *db);
+	/**
+	 * @brief Stop the statement running on db with KILL QUERY from another
+	 *        connection, e.g. before freeing a stream that is not read to
+	 *        the end; the rest of its rows need not be drained then
+	 * @return false when no connection could run it
+	 * */
+	bool killQuery(DB *db);
+	/// Acquire before allocDB() and release after freeDB(), pinned mode too
+	ConcurrencyLimiter* getLimiter();
+	unsigned long long getHits();
+	unsigned long long getMisses();
 protected:
 	DB* newDB();
 	void doCleanWorks();
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef FNVHASH_H_
+#define FNVHASH_H_
+
+namespace MPool {
+
+/**
+ * @brief FNV-1a, the hash of the shard keys, the result hashes and the
+ * spool records; the values are part of the wire & file formats
+ * */
+class FnvHash {
+public:
+	/// Offset bases, the start of a hash
+	const static unsigned long long OFFSET64 = 14695981039346656037ULL;
+	const static unsigned int OFFSET32 = 2166136261u;
+	/// Fold the bytes into the hash
+	static void hash64(unsigned long long &hash, const void *data,
+			size_t length);
+	static void hash32(unsigned int &hash, const void *data, size_t length);
+};
+
+}
+
+#endif /* FNVHASH_H_ */
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef FRAMECOMPRESSOR_H_
+#define FRAMECOMPRESSOR_H_
+
+namespace MPool {
+
+class SpillBuffer;
+
+/**
+ * @brief Compression of the result frames
+ * The JSON after the length header is deflated (zlib format, RFC 1950) in
+ * chunks, so a spilled frame is read back from its file and the output may
+ * spill too. The compressed frame has the header "z" & its length on 15
+ * digits. Frames below the threshold or that do not shrink are sent as they
+ * are. Thread safe, the counters are shared by the workers.
+ * */
+class FrameCompressor {
+public:
+	/// Codecs
+	const static unsigned char NONE = 0x00;
+	const static unsigned char ZLIB = 0x01;
+	FrameCompressor();
+	~FrameCompressor();
+	/**
+	 * @param threshold: Bytes of JSON below which frames are not compressed
+	 * @param level: zlib level, 1 (fastest) to 9
+	 * */
+	void setLimits(size_t threshold, int level);
+	/// Codec of the name of a request, NONE when it is not supported
+	static unsigned char parseCodec(const std::string &name);
+	/// Whether compress() would try the frame: codec set & above the threshold
+	bool accepts(unsigned char codec, SpillBuffer &frame);
+	/**
+	 * @brief Compress the frame into out
+	 * @return false when it stays as it is: NONE, below the threshold, not
+	 *         smaller or on errors
+	 * */
+	bool compress(unsigned char codec, SpillBuffer &frame, SpillBuffer &out);
+	/// Frames compressed
+	unsigned long long getFrames();
+	/// JSON bytes of the frames compressed
+	unsigned long long getBytesIn();
+	/// Bytes of the compressed frames
+	unsigned long long getBytesOut();
+	/// Microseconds spent compressing, also on frames sent as they are
+	unsigned long long getTime();
+protected:
+	size_t threshold;
+	int level;
+	unsigned long long frames;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long time;
+	pthread_mutex_t mutex;
+protected:
+	/// Deflate the JSON of the frame, false on errors or when it does not shrink
+	bool deflateFrame(SpillBuffer &frame, SpillBuffer &out);
+};
+
+}
+
+#endif /* FRAMECOMPRESSOR_H_ */
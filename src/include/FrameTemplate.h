@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef FRAMETEMPLATE_H_
+#define FRAMETEMPLATE_H_
+
+namespace MPool {
+
+/**
+ * @brief Pre-serialized response frame with numeric slots
+ * Serialize the response once with slot(i) markers in place of the dynamic
+ * numbers, then render() only concatenates strings, no JSON work is needed.
+ * */
+class FrameTemplate {
+public:
+	/// Marker of the i-th numeric value, as a JSON string
+	static std::string slot(unsigned int i);
+	/**
+	 * @brief Prepend the data length (16 bytes)
+	 * @param json: Serialized response
+	 * */
+	static std::string frame(const std::string &json);
+	/// @param json: Serialized response, slots may be nested in string values
+	void compile(const std::string &json);
+	/// @return Data length (16 bytes) + JSON
+	std::string render(const std::vector<unsigned long long> &values);
+	bool isEmpty();
+protected:
+	std::vector<std::string> segments;
+	std::vector<unsigned int> slots; /// Slot index between two segments
+};
+
+}
+
+#endif /* FRAMETEMPLATE_H_ */
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef IOURING_H_
+#define IOURING_H_
+
+struct io_uring;
+struct io_uring_sqe;
+struct io_uring_buf_ring;
+
+namespace MPool {
+
+class SendOp;
+
+/**
+ * @brief Completion returned by IOUring::wait()
+ * */
+class IOEvent {
+public:
+	/// Event types
+	const static int ACCEPT = 0x01; /// fd is the listener, res is the new socket
+	const static int RECV = 0x02; /// data holds the received bytes
+	const static int CLOSED = 0x03; /// Connection closed by peer
+	const static int ERROR = 0x04; /// res holds -errno
+	const static int READY = 0x05; /// The polled fd of the socket is readable
+	int type;
+	int fd;
+	unsigned int generation; /// Generation given to recv()
+	int res;
+	std::string data;
+};
+
+/**
+ * @brief io_uring I/O backend
+ * Multishot accept, multishot recv with a provided buffer ring and batched
+ * send submissions. Only the reactor thread may call wait(), accept(), recv()
+ * and forget(); send() can be called from any thread.
+ * */
+class IOUring {
+public:
+	IOUring();
+	~IOUring();
+	/**
+	 * @brief Set up the ring and register the provided buffers
+	 * @return false when io_uring is not available, use epoll instead
+	 * */
+	bool init(unsigned int entries = 1024, unsigned int buffers = 256,
+			unsigned int buffer_size = 4096);
+	/// Arm a multishot accept on the listening socket
+	void accept(int fd);
+	/// Arm a multishot recv on the socket, events carry the generation
+	void recv(int fd, unsigned int generation = 0);
+	/**
+	 * @brief Wait once for another fd of the socket, e.g. an eventfd
+	 * The READY event carries fd and generation of the socket, re-arm it
+	 * after handling. forget() the polled fd before closing it.
+	 * */
+	void poll(int polled_fd, int fd, unsigned int generation = 0);
+	/// Queue data to be sent, thread safe
+	void send(int fd, const std::string &data);
+	/**
+	 * @brief Queue a spill file to be sent after the data queued before, thread safe
+	 * Read in chunks of MPOOL_SPILL_CHUNK, the ring has no sendfile. The
+	 * file is closed when it is sent or the socket is forgotten.
+	 * */
+	void sendFile(int fd, int file_fd, size_t length);
+	/// Bytes of queued and in flight sends held in memory, thread safe
+	unsigned long long getPending();
+	/// Cancel pending operations and drop queued data of the socket
+	void forget(int fd);
+	/**
+	 * @brief Close the socket once the data queued for it is sent
+	 * The caller shuts the read side down, which ends the recv.
+	 * @return false when nothing is queued, forget() and close() it then
+	 * */
+	bool linger(int fd);
+	/**
+	 * @brief Submit pending operations and reap completions
+	 * @param events: completions are stored here
+	 * @param timeout: milliseconds
+	 * @return Number of events
+	 * */
+	int wait(std::vector<IOEvent> &events, int timeout);
+	/// Compiled with liburing?
+	static bool isSupported();
+protected:
+	struct io_uring *ring;
+	struct io_uring_buf_ring *buf_ring;
+	char *buffers;
+	unsigned int nbuffers;
+	unsigned int buffer_size;
+	int wake_fd; /// eventfd, wakes the reactor when send() is called
+	unsigned long long wake_value;
+	std::map<int, std::deque<SendOp*> > outbound; /// Queued sends per socket
+	std::map<int, SendOp*> inflight; /// At most one send in flight per socket
+	std::vector<int> dirty; /// Sockets with new queued data
+	std::vector<int> lingering; /// Sockets closed after their sends
+	unsigned long long pending; /// Bytes held by all send operations
+	pthread_mutex_t mutex;
+protected:
+	struct io_uring_sqe* getSqe();
+	void armWake();
+	void flushSends();
+	void queue(SendOp *op);
+	/// Delete the queued sends of the socket, mutex held
+	void dropQueue(int fd);
+	/// Delete a send, mutex held
+	void release(SendOp *op);
+	/// Load the next chunk of a spill file, mutex held
+	bool refill(SendOp *op);
+	/// Close a lingering socket without sends left, mutex held
+	void closeSent(int fd);
+	void submitSend(SendOp *op);
+	void recycleBuffer(unsigned short bid);
+};
+
+}
+
+#endif /* IOURING_H_ */
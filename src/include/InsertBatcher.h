@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef INSERTBATCHER_H_
+#define INSERTBATCHER_H_
+
+namespace MPool {
+
+class Client;
+
+/**
+ * @brief Single-row INSERTs of several clients run as one statement
+ * Filled by the reactor while open. Once closed, the first member to reach
+ * it on a worker runs it for all. A member reaching it while it runs is
+ * parked without holding its worker, and woken once the results are in.
+ * Deleted by the last release().
+ * */
+class InsertBatch {
+public:
+	/// States
+	const static unsigned char OPEN = 0x00; /// Taking rows
+	const static unsigned char READY = 0x01; /// Closed, waits for a member
+	const static unsigned char RUNNING = 0x02;
+	const static unsigned char DONE = 0x03;
+	/// @param wake: Hands a parked member back to the workers, thread safe
+	InsertBatch(DBPool *pool, const std::string &prefix,
+			unsigned long long deadline,
+			void (*wake)(void *target, Client *client), void *target);
+	~InsertBatch();
+	/**
+	 * @brief Add the row of a member, takes a reference for its statement
+	 * @return Index of the row
+	 * @note Reactor thread only
+	 * */
+	unsigned int add(const std::string &tuple, Client *client);
+	/// Drop a member destroyed before the batch closed, its row still runs
+	void forget(Client *client);
+	/// Members to hand to the workers once closed
+	std::vector<Client*>& getMembers();
+	void close();
+	/**
+	 * @brief Claim the batch for a member, never waits
+	 * @return RUNNING for the first member, it has to execute() the batch;
+	 *         DONE once another member ran it; OPEN when the member is
+	 *         parked until it is done
+	 * */
+	unsigned char claim(Client *client);
+	/// Drop a parked member whose statement never runs
+	void unpark(Client *client);
+	/**
+	 * @brief Run the rows as one INSERT, then one by one when it fails so
+	 * each row gets its own result, and wake the parked members
+	 * @param db_con: NULL fails all the rows
+	 * */
+	void execute(DB *db_con);
+	/// Error of the row, empty on success
+	const std::string& getError(unsigned int row);
+	/// GTIDs of the statement that inserted the row
+	const std::string& getGtid(unsigned int row);
+	DBPool* getPool();
+	const std::string& getPrefix();
+	unsigned long long getDeadline();
+	size_t getRows();
+	/// Bytes of the merged statement
+	size_t getBytes();
+	void retain();
+	/// @return true when it was the last reference, delete the batch
+	bool release();
+protected:
+	DBPool *pool;
+	std::string prefix; /// INSERT INTO table (columns) VALUES
+	std::vector<std::string> tuples;
+	std::vector<std::string> errors;
+	std::vector<std::string> gtids;
+	size_t bytes;
+	std::vector<Client*> members; /// Reactor thread only
+	std::vector<Client*> parked; /// Waiting for the results
+	void (*wake)(void *target, Client *client);
+	void *target;
+	unsigned long long deadline; /// Milliseconds, Manager::now()
+	unsigned char state;
+	unsigned int refs;
+	pthread_mutex_t mutex;
+};
+
+/**
+ * @brief Collects the INSERTs of the idle clients into batches
+ * INSERTs into the same table with the same column list on the same pool
+ * join one batch for up to window milliseconds, max_rows rows or
+ * MPOOL_BATCH_BYTES bytes. Reactor thread only.
+ * */
+class InsertBatcher {
+public:
+	InsertBatcher();
+	~InsertBatcher();
+	void setLimits(unsigned long window, unsigned int max_rows);
+	/// Hands the parked members of the batches back to the workers
+	void setWake(void (*wake)(void *target, Client *client), void *target);
+	/**
+	 * @brief Split a single-row INSERT INTO t (columns) VALUES (...)
+	 * @param prefix: The statement up to the row, normalized
+	 * @param tuple: The row in parentheses
+	 * @return false for any other statement, e.g. INSERT ... SELECT or
+	 *         ON DUPLICATE KEY UPDATE
+	 * */
+	static bool parse(const std::string &sql, std::string &prefix,
+			std::string &tuple);
+	/**
+	 * @brief Add the row to the open batch of the prefix on the pool
+	 * @param now: Milliseconds, Manager::now()
+	 * @param row: Index of the row in the batch
+	 * @param ready: Members to push when the batch is full
+	 * @return The batch, with a reference for the statement of the client
+	 * */
+	InsertBatch* add(DBPool *pool, const std::string &prefix,
+			const std::string &tuple, Client *client, unsigned long long now,
+			unsigned int &row, std::vector<Client*> &ready);
+	/// Close an open batch, ready gets its members
+	void close(InsertBatch *batch, std::vector<Client*> &ready);
+	/// Close the batches whose window ended
+	void expire(unsigned long long now, std::vector<Client*> &ready);
+	/// Milliseconds until the next window ends, at most def
+	int getTimeout(unsigned long long now, int def);
+	unsigned long long getBatches();
+	/// Rows that went through a batch
+	unsigned long long getBatchedRows();
+protected:
+	unsigned long window;
+	unsigned int max_rows;
+	void (*wake)(void *target, Client *client);
+	void *target;
+	/// Open batches by pool & prefix
+	std::map<std::pair<DBPool*, std::string>, InsertBatch*> open;
+	unsigned long long batches;
+	unsigned long long rows;
+};
+
+}
+
+#endif /* INSERTBATCHER_H_ */
@@ -27,24 +27,42 @@
 
 namespace MPool {
 
+/**
+ * @brief Worker share of a user, the bulkhead
+ * */
+class UserShare {
+public:
+	unsigned int running; /// Statements on a worker
+	unsigned int max_workers; /// 0 for no limit
+	unsigned long queued; /// Statements waiting for a worker
+};
+
 class Worker {
 protected:
 	pthread_t tid;
 	/// Running status: I - idle, N - stopped, B - busy
 	char status;
 	Client *client;
+	UserShare *share; /// Released when the work is done
 	pthread_mutex_t mutex;
-	time_t last_run_time;
+	time_t last_run_time; /// Refreshed by long works while they progress
+	bool retired; /// Replaced, the thread ends after its work & deletes it
 public:
 	Worker();
 	~Worker();
 	void start();
 	void run();
 	void stop();
+	/**
+	 * @brief Let the running work finish on this thread, which then exits
+	 * The work gives its share back as usual, the Worker deletes itself.
+	 * @return false when no work is running, the worker is still in use
+	 * */
+	bool retire();
 	pthread_t getTid();
 	void setTid(pthread_t tid);
 	char getStatus();
-	void setClient(Client *c);
+	void setClient(Client *c, UserShare *share = NULL);
 	time_t getLastRunTime();
 	static void* threadStart(void *t) {
 		if (!t) {
@@ -53,10 +71,38 @@ public:
 		Worker *m = (Worker*) t;
 		//m->setTid(pthread_self());
 		m->run();
+		if (m->retired) {
+			// Out of the manager since retire();
+			delete m;
+		}
 		return NULL;
 	}
 };
 
+class PendingFlow;
+
+/**
+ * @brief Entry of the pending queue, one per queued statement
+ * */
+class PendingWork {
+public:
+	Client *client;
+	PendingFlow *flow; /// Queue of the user & priority class
+	unsigned long long queued; /// Monotonic milliseconds when queued
+};
+
+/**
+ * @brief Pending statements of one user in one priority class
+ * */
+class PendingFlow {
+public:
+	std::deque<PendingWork> works;
+	unsigned long quantum; /// Statements per round
+	unsigned long deficit; /// Statements left in this round
+	bool active; /// In the round robin list
+	UserShare *share;
+};
+
 class Manager {
 public:
 	Manager(unsigned int workers = 4);
@@ -81,6 +127,23 @@ public:
 	void stop();
 	pthread_t getTid();
 	void setTid(pthread_t tid);
+	/**
+	 * @brief Load of the workers, for admission control;
+	 * @param pending: Statements waiting for a worker;
+	 * @param inflight: Statements waiting or running;
+	 * @param delay: Milliseconds the oldest pending one has waited;
+	 * */
+	void getLoad(size_t &pending, size_t &inflight, unsigned long long &delay);
+	/// Monotonic clock in milliseconds;
+	static unsigned long long now();
+	/// Workers the user may occupy at once, 0 for no limit;
+	void setMaxWorkers(const std::string &username, unsigned int max_workers);
+	/// Statements of the user waiting for & running on a worker;
+	void getUserLoad(const std::string &username, unsigned long &queued,
+			unsigned int &running);
+	/// MPOOL_PRIORITY_* of interactive, normal or batch, def otherwise;
+	static unsigned char parsePriority(const std::string &name,
+			unsigned char def);
 	/**
 	 * @brief blocked running, used for pthread;
 	 * @param t, the this pointer;
@@ -98,9 +161,21 @@ protected:
 	pthread_t tid;
 	unsigned nWorkers;
 	Worker **workers;
-	std::queue<Client*> pending; /// Pending process queries;
+	std::map<std::string, PendingFlow*> flows; /// By priority class & username;
+	std::map<std::string, UserShare*> shares; /// By username;
+	std::list<PendingFlow*> active; /// Flows with pending works, round robin;
+	size_t pending; /// Pending process queries;
 	bool running;
 	pthread_mutex_t mutex;
+protected:
+	/// Share of the user, created on first use, mutex held;
+	UserShare* getShare(const std::string &username);
+	/// Append to the flow of the work, mutex held;
+	void enqueue(PendingWork &work);
+	/// Deficit round robin over the active flows, skips full bulkheads, mutex held;
+	bool dequeue(PendingWork &work);
+	/// Replace a worker stuck in a work by a new one, mutex held;
+	void restart(unsigned int i);
 };
 
 }
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef MEMORYACCOUNT_H_
+#define MEMORYACCOUNT_H_
+
+namespace MPool {
+
+/**
+ * @brief Bytes held by a client, or by all clients when it is the parent
+ * Updated by the reactor and the workers without locks, every change is
+ * forwarded to the parent.
+ * */
+class MemoryAccount {
+public:
+	/// Account types
+	const static int QUEUED = 0x00; /// SQL waiting for a worker
+	const static int RESULT = 0x01; /// Encoded results held in memory
+	const static int TYPES = 0x02;
+	MemoryAccount();
+	/// Gives the bytes still held back to the parent
+	~MemoryAccount();
+	/// Set before the first add()
+	void setParent(MemoryAccount *parent);
+	void add(int type, size_t bytes);
+	void sub(int type, size_t bytes);
+	unsigned long long get(int type);
+	/// Bytes of all types
+	unsigned long long total();
+protected:
+	MemoryAccount *parent;
+	unsigned long long used[TYPES];
+};
+
+}
+
+#endif /* MEMORYACCOUNT_H_ */
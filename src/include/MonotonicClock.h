@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef MONOTONICCLOCK_H_
+#define MONOTONICCLOCK_H_
+
+namespace MPool {
+
+/**
+ * @brief CLOCK_MONOTONIC readings & timed waits of the background threads
+ * Wall clock steps never shorten nor stretch a measure.
+ * */
+class MonotonicClock {
+public:
+	static unsigned long long millis();
+	static unsigned long long micros();
+	/// Wait on the condition for up to ms milliseconds, mutex held
+	static void waitFor(pthread_cond_t *cond, pthread_mutex_t *mutex,
+			unsigned long long ms);
+};
+
+}
+
+#endif /* MONOTONICCLOCK_H_ */
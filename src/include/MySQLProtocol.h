@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef MYSQLPROTOCOL_H_
+#define MYSQLPROTOCOL_H_
+
+/// Capabilities offered in the handshake
+#define MPOOL_MYSQL_CAPABILITIES 0x0028a20f
+#define MPOOL_MYSQL_SCRAMBLE_LENGTH 20
+#define MPOOL_MYSQL_MAX_PAYLOAD 0xffffff
+
+namespace MPool {
+
+/**
+ * @brief MySQL client/server protocol, the parts needed by a front-end
+ * Packets are | payload length (3 bytes) | sequence id | payload |, results
+ * are encoded straight from MYSQL_RES as text resultsets.
+ * */
+class MySQLProtocol {
+public:
+	/// Commands
+	const static unsigned char COM_QUIT = 0x01;
+	const static unsigned char COM_INIT_DB = 0x02;
+	const static unsigned char COM_QUERY = 0x03;
+	const static unsigned char COM_PING = 0x0e;
+	/**
+	 * @brief Append a packet, split when the payload reaches 16M
+	 * @param seq: Sequence id of the packet, advanced
+	 * */
+	static void appendPacket(std::string &out, unsigned char &seq,
+			const std::string &payload);
+	static void appendLength(std::string &out, unsigned long long n);
+	static void appendString(std::string &out, const char *str,
+			unsigned long length);
+	/// Initial handshake (protocol 10), sent with sequence id 0
+	static std::string handshake(unsigned int connection_id,
+			const std::string &scramble);
+	/**
+	 * @brief Parse a HandshakeResponse41
+	 * @return false when the packet is malformed or older than 4.1
+	 * */
+	static bool parseHandshakeResponse(const std::string &payload,
+			std::string &user, std::string &auth, std::string &plugin);
+	/// AuthSwitchRequest to mysql_native_password
+	static std::string authSwitch(const std::string &scramble);
+	/// Check a mysql_native_password auth response
+	static bool checkNativePassword(const std::string &scramble,
+			const std::string &password, const std::string &auth);
+	/// Per connection scramble, derived from a server secret
+	static std::string scramble(const std::string &secret,
+			unsigned long long handle);
+	static std::string ok(unsigned long long affected_rows = 0,
+			unsigned long long insert_id = 0);
+	static std::string error(unsigned int code, const char *state,
+			const std::string &message);
+	static std::string eof();
+	/**
+	 * @brief Append the column count, definitions & EOF of a text resultset
+	 * The rows follow with appendRow(), then an eof() packet.
+	 * @param seq: Sequence id of the first packet, advanced
+	 * */
+	static void appendColumns(std::string &out, unsigned char &seq,
+			MYSQL_RES *res);
+	/// Append the text row packet of a row just fetched from res
+	static void appendRow(std::string &out, unsigned char &seq,
+			MYSQL_RES *res, MYSQL_ROW row);
+};
+
+}
+
+#endif /* MYSQLPROTOCOL_H_ */
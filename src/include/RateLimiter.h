@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef RATELIMITER_H_
+#define RATELIMITER_H_
+
+namespace MPool {
+
+/**
+ * @brief Query rate & concurrency limits of a user
+ * A token bucket refilled at qps tokens per second, holding at most burst
+ * tokens, and a cap on the statements of the user queued or running. The
+ * bucket belongs to the reactor thread and takes no lock; the statement
+ * count is kept with atomic operations by the workers.
+ * */
+class RateLimiter {
+public:
+	RateLimiter();
+	~RateLimiter();
+	/**
+	 * @brief qps 0 for no rate limit, burst 0 for one second of qps,
+	 * max_queries 0 for no cap
+	 * */
+	void setLimits(double qps, double burst, unsigned int max_queries);
+	/**
+	 * @brief Take a token for a new statement
+	 * @return 0 when admitted, else milliseconds to wait before a retry
+	 * @note Reactor thread only
+	 * */
+	unsigned long admit(const char *&reason);
+	/// Statement queued, thread safe
+	void enter();
+	/// Statements done, thread safe
+	void leave(unsigned long count = 1);
+	/// Statements queued or running
+	unsigned long getQueries();
+	/// Statements refused by admit()
+	unsigned long long getLimited();
+protected:
+	double rate; /// Tokens per microsecond
+	double burst;
+	double tokens;
+	unsigned long long refilled; /// Microseconds, time of the last refill
+	unsigned long max_queries;
+	unsigned long queries;
+	unsigned long long limited;
+};
+
+}
+
+#endif /* RATELIMITER_H_ */
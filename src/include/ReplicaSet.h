@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef REPLICASET_H_
+#define REPLICASET_H_
+
+namespace MPool {
+
+/**
+ * @brief Read replicas of the primary backend
+ * Reads go to the replicas in turn. A read holding a consistency token runs
+ * on a replica only once it applied the GTIDs: the replicas are asked in
+ * turn with GTID_SUBSET(), the last one may wait up to the wait time (1 ms
+ * at least) in WAIT_FOR_EXECUTED_GTID_SET(), the caller falls back to the
+ * primary after.
+ * Thread safe.
+ * */
+class ReplicaSet {
+public:
+	ReplicaSet();
+	~ReplicaSet();
+	/// Append a replica, the set deletes the pool, NULL when it cannot connect
+	void addReplica(DBPool *pool);
+	size_t size();
+	/// Milliseconds a read waits for a replica to apply its token
+	void setWait(unsigned long wait);
+	/// The next replica in turn, NULL when none is up
+	DBPool* pick();
+	/**
+	 * @brief Check that the replica of the connection applied the GTIDs
+	 * @param wait: Wait up to the wait time, else answer at once
+	 * @return false on timeout or error
+	 * */
+	bool waitFor(DB *db_con, const std::string &gtid, bool wait);
+	/// Count a read, replica false when it went back to the primary
+	void record(bool replica);
+	/// Reads run on a replica
+	unsigned long long getReads();
+	/// Reads sent back to the primary
+	unsigned long long getFallbacks();
+	/// Only GTID set characters, safe to quote in a statement
+	static bool isGtidSet(const std::string &gtid);
+protected:
+	std::vector<DBPool*> replicas;
+	unsigned long next;
+	unsigned long wait;
+	unsigned long long reads;
+	unsigned long long fallbacks;
+};
+
+}
+
+#endif /* REPLICASET_H_ */
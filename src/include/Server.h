@@ -51,39 +51,86 @@ public:
 	 * */
 	void run();
 	void stop();
-	void gc(); /// Garbage Collection;
-	void startGc();
-	static void* threadStart(void *t) {
-		if (!t) {
-			return NULL;
-		}
-		Server *m = (Server*) t;
-		m->gc();
-		return NULL;
-	}
+	/**
+	 * @brief Garbage Collection, reaps the timed out clients
+	 * @note Called by the reactor on every loop
+	 * */
+	void gc();
 protected:
 	std::list<std::string> support_protocol_versions; /// Support protocol versions
-	std::map<int, MPool::Client*> *clients; /// Connected clients, use TCP socket fd as keys
+	ConnectionTable *clients; /// Connected clients, indexed by socket fd
 	std::map<std::string, std::string> config; /// Server configurations
 	std::map<std::string, std::string> user_list; // User list, username & password
+	std::map<std::string, unsigned char> user_priorities; /// MPOOL_PRIORITY_* by username
+	std::map<std::string, unsigned int> user_weights; /// Scheduling weight by username
+	std::map<std::string, unsigned int> user_workers; /// Worker bulkhead by username
+	/// Backend settings (mysql_host ... pool_size) of users with their own pool
+	std::map<std::string, std::map<std::string, std::string> > user_backends;
+	std::map<std::string, DBPool*> user_pools; /// NULL when the backend failed
+	std::map<std::string, RateLimiter*> user_rates; /// Users with qps or max_queries
+	/// Backend settings of the shards, with their range_end
+	std::vector<std::map<std::string, std::string> > shard_backends;
+	ShardRouter *router; /// NULL without shards
+	/// Backend settings of the read replicas of the primary
+	std::vector<std::map<std::string, std::string> > replica_backends;
+	ReplicaSet *replicas; /// NULL without replicas
+	InsertBatcher *batcher; /// NULL when insert_batch_window is 0
+	WriteSpool *spool; /// NULL without spool_file
+	/// Registered snapshot queries: name, sql & refresh
+	std::vector<std::map<std::string, std::string> > snapshot_queries;
+	SnapshotCache *snapshots; /// NULL without snapshot queries
+	FrameCompressor *compressor; /// Compression of the result frames
 	std::string config_file; /// Path of configuration file
 	std::string user_list_file; /// Path of user list file
 	Manager *manager; /// Process manager;
 	DBPool *db_pool; /// DB Connection Pool;
 	bool running; /// Running status;
-	bool gc_running;
 	int socket_fd;
+	int unix_fd; /// AF_UNIX listener, 0 when disabled
+	int mysql_fd; /// MySQL protocol listener, 0 when disabled
+	std::string mysql_secret; /// Random seed of the handshake scrambles
+	std::map<int, std::string> mysql_auth_switch; /// Users waiting for the auth switch response, by fd
 	Json::Reader *jsonReader;
 	Json::FastWriter *jsonWriter;
 	unsigned long max_connections;
+	int listen_backlog;
 	unsigned int pool_size;
 	unsigned int workers;
 	int port;
-	pthread_t gc_tid;
 	pthread_mutex_t client_mutex;
 	int epoll_fd;
+	IOUring *uring; /// io_uring backend, NULL when epoll is used
+	TimerWheel *timers; /// Idle timeouts of the clients
+	std::string heartbeat_frame; /// Pre-serialized heartbeat reply
+	FrameTemplate *status_template; /// Pre-serialized status reply
+	std::map<std::string, Client*> sessions; /// Authorized clients by token
+	time_t session_grace; /// Seconds a detached session is kept, 0 to disable
+	size_t spill_threshold; /// Response bytes kept in memory, 0 to disable spilling
+	MemoryAccount memory; /// Queued SQL & results of all clients
+	size_t max_request_size; /// Bytes of a request package, 0 for no limit
+	size_t max_result_size; /// Bytes of a result, 0 for no limit
+	size_t max_client_memory; /// Bytes held for one client, 0 for no limit
+	size_t max_memory; /// Bytes held for all connections, 0 for no limit
+	time_t cursor_timeout; /// Seconds the cursors of a client stay open unused
+	unsigned int max_cursors; /// Open cursors per client
+	unsigned long long queue_wait_target; /// Milliseconds a statement may wait for a worker, 0 for no limit
+	size_t max_queue_depth; /// Statements waiting for a worker, 0 for no limit
+	size_t max_inflight; /// Statements waiting or running, 0 for no limit
+	size_t max_client_inflight; /// Statements of one client, 0 for no limit
+	unsigned long long shed; /// Requests refused as OVERLOADED
+	size_t bulk_window; /// Bytes of bulk load frames buffered per client
+	unsigned long bulk_timeout; /// Seconds a whole bulk load may take
 protected:
 	bool setNoBlock(int fd);
+	bool isListener(int fd);
+	/// Bind & listen the AF_UNIX socket of unix_socket
+	void listenUnix();
+	/// Bind & listen the MySQL protocol port of mysql_listen_port
+	void listenMySQL();
+	/// Track an accepted socket, greets MySQL protocol clients
+	unsigned long long openConnection(int listener, int fd);
+	/// Raise RLIMIT_NOFILE, returns false when the limit stays lower
+	bool setFileLimit(unsigned long files);
 	void readConfigFile(const char *config_file = NULL);
 	void readUserListFile(const char *user_list_file = NULL);
 	void doCleanWorks();
@@ -91,14 +138,100 @@ protected:
 			const char *msg, const char *data = "");
 	void clientMessage(Client *client, const char *status, const char *code,
 			const char *msg, const char *data = "");
+	/// Send a framed package from the reactor thread
+	void sendFrame(int s, const std::string &str);
+	/// Serialize the replies answered on the reactor thread
+	void buildTemplates();
+	/// Token of a session attached to the socket, or username & password
+	bool authenticate(int fd, Json::Value &root);
+	/// Empty sql is a heartbeat package
+	bool isHeartbeat(Json::Value &root);
 	bool isSocketVal(int fd);
 	bool setReuseaddr(int fd);
 	bool setNoReuseaddr(int fd);
+	/// Token of the session, or username & password, AUTH_FAIL replied
+	bool authorizeClient(Client *client, Json::Value &root);
 	bool clientQueryAction(Client *client, Json::Value root);
+	/// Open, fetch & close server side cursors
+	bool clientCursorAction(Client *client, Json::Value root);
+	/// Start a bulk load, or pass it a data frame
+	bool clientBulkAction(Client *client, Json::Value root);
+	/// Reply the last rows of a snapshot query, in order with the queries queued before
+	bool clientSnapshotAction(Client *client, Json::Value root);
+	/**
+	 * @brief Queue the SQL and wake a worker, a MEMORY_LIMIT reply past the limits
+	 * @return false when it was refused
+	 * */
+	bool queueSQL(Client *client, const std::string &sql,
+			unsigned char type = Statement::QUERY, unsigned long cursor = 0,
+			unsigned long rows = 0);
+	/**
+	 * @brief Add an INSERT of an idle client to a batch
+	 * @return false when it has to run on its own
+	 * */
+	bool batchInsert(Client *client, const std::string &sql);
+	/// Close the batch the client waits for, e.g. before its next statement
+	void flushBatch(Client *client);
+	/// Hand the members of closed batches to the workers
+	void pushReady(std::vector<Client*> &ready);
+	/// Hand a member parked on a running batch back to the workers, any thread
+	static void wakeMember(void *server, Client *client);
+	/// Reason to refuse a new statement of the client, NULL to admit it
+	const char* checkOverload(Client *client);
+	/**
+	 * @brief Refuse a request with the status, e.g. OVERLOADED or
+	 * RATE_LIMITED, at once when nothing is queued before it
+	 * @param retry: Milliseconds replied in data, 0 for none
+	 * */
+	void refuseRequest(Client *client, const char *status, const char *reason,
+			unsigned long retry = 0);
+	/// Bytes of receive buffers, queued SQL, results & pending output
+	unsigned long long getMemoryUsed();
+	/// Reply REQUEST_TOO_LARGE and stop reading the socket
+	void rejectRequest(int fd);
 	bool clientExitAction(Client *client, Json::Value root);
-	bool clientServerStatusAction(Client *client, Json::Value root);
+	/// Authorize once, replies the session token
+	bool clientAuthAction(int fd, Client *client, Json::Value root);
+	/// Move the connection to a shared memory ring, unix socket only
+	bool clientShmAction(int fd, Client *client, Json::Value root);
+	bool clientHeartbeatAction(int fd, Json::Value root);
+	bool clientServerStatusAction(int fd, Json::Value root);
 	void closeSocket(int fd);
-	void goToGc(Client *client);
+	/// Stop watching the doorbell and free the shared memory
+	void closeShm(Client *client);
+	/// Requests written to the shared memory ring of the socket
+	void onDoorbell(int fd);
+	void epollLoop(); /// epoll reactor
+	void uringLoop(); /// io_uring reactor
+	/**
+	 * @brief Handle a package received from the socket
+	 * @param buffer: Data length (16 bytes) + JSON
+	 * */
+	void onMessage(int fd, std::string &buffer, bool client_close,
+			bool error_end);
+	/// Reassemble packages from the received data
+	void onData(int fd, std::string &data);
+	/// Reassemble MySQL packets, a payload of 16M continues in the next one
+	void onMySQLData(int fd, std::string &data);
+	void onMySQLPacket(int fd, unsigned char seq, const std::string &payload);
+	/// Handshake response or auth switch response
+	void mysqlAuthAction(int fd, unsigned char seq, const std::string &payload);
+	Client* findClient(int fd);
+	/// Backend settings (mysql_host ... pool_size), missing ones from the mysql section
+	void readBackend(Json::Value &json,
+			std::map<std::string, std::string> &backend);
+	/// Start a pool on the backend settings, NULL when it cannot connect
+	DBPool* openPool(std::map<std::string, std::string> &backend);
+	/// Pool of the user, the default one unless the user has a backend
+	DBPool* getPool(const std::string &username);
+	/// New client attached to the socket, NULL when no DB connection is left
+	Client* createClient(int fd, const std::string &username);
+	/// Re-attach a session to a new socket, NULL when unknown or busy
+	Client* resumeSession(int fd, const std::string &token);
+	/// Free the client, its session and DB connection
+	void destroyClient(Client *client);
+	/// Close the socket, or end the client when it is idle
+	void dropConnection(int fd, Client *client);
 	void normalEnd(Client *client);
 };
 
@@ -51,6 +51,8 @@ public:
 	const static int EPOLL_CREATE_FAIL = 0x0b;
 	const static int EPOLL_CTL_FAIL = 0x0c;
 	const static int DBPOLL_GETCON_FAIL = 0x0d;
+	const static int SOCKET_BIND_FAIL = 0x0e;
+	const static int SPOOL_OPEN_FAIL = 0x0f;
 protected:
 	int error_no;
 };
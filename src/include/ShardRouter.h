@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef SHARDROUTER_H_
+#define SHARDROUTER_H_
+
+namespace MPool {
+
+/**
+ * @brief Result of a statement on one shard
+ * */
+class ShardResult {
+public:
+	MYSQL_RES *res; /// Stored rows, NULL when the statement returns none
+	bool failed;
+	std::string error;
+	unsigned long long affected_rows;
+};
+
+class ScatterTask;
+
+/**
+ * @brief Partitions keys over the pools of the shards
+ * In hash mode a key goes to FNV-1a(key) % shards, integers hashed without
+ * sign + and leading zeros, in range mode to the first shard whose
+ * range_end is above the numeric key, the last shard taking the rest. A
+ * shard whose backend failed to start has a NULL pool.
+ * */
+class ShardRouter {
+public:
+	/// Modes
+	const static unsigned char HASH = 0x00;
+	const static unsigned char RANGE = 0x01;
+	ShardRouter();
+	~ShardRouter();
+	void setMode(unsigned char mode);
+	/// Column compared to the key in the statements, for extractKey()
+	void setColumn(const std::string &column);
+	/**
+	 * @brief Append a shard, the router deletes the pool
+	 * @param range_end: Keys below it, range mode only
+	 * */
+	void addShard(DBPool *pool, long long range_end);
+	/// Start the threads of scatter(), after the shards are added
+	void start(size_t threads);
+	void stop();
+	size_t size();
+	DBPool* getShard(size_t index);
+	/// Index of the shard of the key, -1 when not a key of the mode
+	int route(const std::string &key);
+	/**
+	 * @brief Find "WHERE/AND column = literal" at the top level
+	 * @param key: The literal, unquoted
+	 * @return false without exactly one such equality, or with an OR, XOR
+	 * or UNION anywhere in the statement
+	 * */
+	bool extractKey(const std::string &sql, std::string &key);
+	/**
+	 * @brief Run the statement on all the shards at once
+	 * The first shard runs on the calling thread, the others on the threads
+	 * of the router, the caller running queued ones while it waits.
+	 * @param results: One per shard, free res with mysql_free_result()
+	 * */
+	void scatter(const std::string &sql, std::vector<ShardResult> &results);
+protected:
+	unsigned char mode;
+	std::string column;
+	std::vector<DBPool*> shards;
+	std::vector<long long> range_ends;
+	bool running;
+	std::vector<pthread_t> threads;
+	std::vector<ScatterTask*> queue;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready; /// A task is queued
+	pthread_cond_t finished; /// A task is done
+	static void* runThread(void *router);
+	/// Run the next queued task, mutex held, false when none
+	bool runQueued();
+};
+
+}
+
+#endif /* SHARDROUTER_H_ */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef SHMCHANNEL_H_
+#define SHMCHANNEL_H_
+
+namespace MPool {
+
+/**
+ * @brief Ring header in shared memory, positions only grow
+ * Each position has its own cache line, the producer writes tail and the
+ * consumer writes head.
+ * */
+struct ShmRingHeader {
+	unsigned long long head; /// Bytes consumed
+	char head_pad[56];
+	unsigned long long tail; /// Bytes produced
+	char tail_pad[56];
+};
+
+/**
+ * @brief Single producer, single consumer byte ring
+ * Carries the usual packages (data length + JSON) as a byte stream, a package
+ * may wrap around the end of the data area.
+ * */
+class ShmRing {
+public:
+	ShmRing();
+	/// @param capacity: Power of 2, the data follows the header
+	void attach(void *base, size_t capacity);
+	/**
+	 * @brief Write up to length bytes
+	 * @param length: Set to the bytes written, less when the ring is full
+	 * @return false when head is past tail or more than capacity behind it
+	 * */
+	bool write(const char *data, size_t &length);
+	/**
+	 * @brief Wait up to ms for the consumer while the ring is full
+	 * A futex on the low half of head, ends early when the consumer wakes it.
+	 * */
+	void waitRead(unsigned long ms);
+	/// Append all readable bytes to data, @return Bytes read
+	size_t read(std::string &data);
+protected:
+	ShmRingHeader *header;
+	char *data;
+	size_t capacity;
+};
+
+/**
+ * @brief Shared memory transport of a client on the unix socket
+ * The region holds the request ring (client to server) followed by the
+ * response ring (server to client). The client rings the request eventfd
+ * after writing, the server rings the response eventfd. The socket stays open
+ * as the control channel, the transport ends when it is closed.
+ * */
+class ShmChannel {
+public:
+	ShmChannel();
+	~ShmChannel();
+	/**
+	 * @brief Create the region and the eventfds
+	 * @param ring_size: Bytes per ring, rounded up to a power of 2
+	 * */
+	bool create(size_t ring_size);
+	/**
+	 * @brief Pass the memfd and eventfds to the client with SCM_RIGHTS
+	 * @param s: unix socket
+	 * @param str: Package sent along with the fds
+	 * */
+	bool offer(int s, const std::string &str);
+	/**
+	 * @brief Write a package into the response ring and ring the client
+	 * Waits while the ring is full, thread safe.
+	 * @return false when the client reads nothing for MPOOL_SHM_STALL or
+	 *         corrupted the ring, the channel stays broken
+	 * */
+	bool send(const std::string &str);
+	/**
+	 * @brief Clear the doorbell and drain the request ring
+	 * @note Reactor thread only
+	 * */
+	void receive(std::string &data);
+	/// Request eventfd, readable when the client has written requests
+	int getDoorbell();
+	size_t getRingSize();
+protected:
+	void *region;
+	size_t region_size;
+	size_t ring_size;
+	int mem_fd;
+	int request_fd; /// Rung by the client
+	int response_fd; /// Rung by the server
+	ShmRing requests;
+	ShmRing responses;
+	pthread_mutex_t mutex; /// One producer of the response ring at a time
+	bool broken;
+};
+
+}
+
+#endif /* SHMCHANNEL_H_ */
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef SNAPSHOTCACHE_H_
+#define SNAPSHOTCACHE_H_
+
+namespace MPool {
+
+/**
+ * @brief Framed reply of a run, shared by the requests sending it
+ * Never changes once built. Deleted by the last release().
+ * */
+class SnapshotFrame {
+public:
+	/// Takes the content of frame, with the reference of the cache
+	SnapshotFrame(std::string &frame);
+	const std::string& getData();
+	void retain();
+	/// @return true when it was the last reference, delete the frame
+	bool release();
+protected:
+	std::string data;
+	unsigned int refs;
+};
+
+/**
+ * @brief A registered query & its last reply
+ * */
+class Snapshot {
+public:
+	std::string name;
+	std::string sql;
+	std::vector<std::string> users; /// Allowed to read it, empty for all
+	unsigned long refresh; /// Milliseconds between two runs
+	unsigned long long due; /// Monotonic milliseconds of the next run
+	SnapshotFrame *frame; /// Last successful run, NULL before
+};
+
+/**
+ * @brief Replies of registered queries, refreshed in the background
+ * One refresher thread runs each query every refresh milliseconds on a
+ * connection of the pool and keeps the framed reply; requests for the name
+ * get a reference to it without touching MySQL. A failed run keeps the last
+ * reply until the next one. Thread safe.
+ * */
+class SnapshotCache {
+public:
+	SnapshotCache();
+	~SnapshotCache();
+	/**
+	 * @brief Register a query, before start()
+	 * @param users: Allowed to read it, empty for all
+	 * */
+	void add(const std::string &name, const std::string &sql,
+			unsigned long refresh, const std::vector<std::string> &users);
+	/// Pool of the queries
+	void setPool(DBPool *pool);
+	/// Start the refresher, each query runs at once
+	void start();
+	void stop();
+	/**
+	 * @brief Last reply of the query, release() it once sent
+	 * @param error: Why there is none
+	 * @return NULL when the name is unknown, not allowed for the user or the
+	 *         query never succeeded
+	 * */
+	SnapshotFrame* get(const std::string &name, const std::string &username,
+			std::string &error);
+	/// Runs of the queries
+	unsigned long long getRefreshes();
+	/// Runs that failed, their last reply was kept
+	unsigned long long getFailures();
+	/// Requests served from the replies
+	unsigned long long getHits();
+protected:
+	std::map<std::string, Snapshot*> snapshots;
+	DBPool *pool;
+	unsigned long long refreshes;
+	unsigned long long failures;
+	unsigned long long hits;
+	bool running;
+	pthread_t refresher;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+protected:
+	static void* refresh(void *cache);
+	void refreshLoop();
+	/**
+	 * @brief Run the query & frame its reply
+	 * @return false on errors, logged
+	 * */
+	bool run(const std::string &name, const std::string &sql,
+			std::string &frame);
+};
+
+}
+
+#endif /* SNAPSHOTCACHE_H_ */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef SPILLBUFFER_H_
+#define SPILLBUFFER_H_
+
+namespace MPool {
+
+/**
+ * @brief Response buffer, moves to an unlinked temp file past a threshold
+ * Up to threshold bytes are kept in memory. Beyond it the content goes to a
+ * file in the spill directory and only MPOOL_SPILL_CHUNK bytes stay buffered,
+ * the file is then sent with sendfile().
+ * */
+class SpillBuffer {
+public:
+	/**
+	 * @param threshold: Bytes kept in memory, 0 never spills
+	 * @param dir: Directory of the temp files
+	 * @param account: Charged with the bytes held in memory
+	 * */
+	SpillBuffer(size_t threshold = 0, const char *dir = NULL,
+			MemoryAccount *account = NULL);
+	~SpillBuffer();
+	void append(const char *data, size_t length);
+	void append(const std::string &str);
+	/// Overwrite bytes appended before, e.g. the length header
+	bool patch(size_t offset, const std::string &str);
+	/// Write the buffered bytes to the file, false on I/O errors
+	bool flush();
+	bool isSpilled();
+	/// A write to the file failed, the content is lost
+	bool isFailed();
+	size_t length(); /// Bytes appended
+	std::string& getData(); /// The content when not spilled
+	/**
+	 * @brief Copy content from the offset, also when spilled
+	 * @return Bytes copied, 0 past the end or on I/O errors
+	 * */
+	size_t read(size_t offset, char *buffer, size_t length);
+	/// Hand over the file, the caller closes it
+	int release();
+protected:
+	bool spill();
+protected:
+	size_t threshold;
+	const char *dir;
+	MemoryAccount *account;
+	std::string data; /// Not yet written to the file
+	size_t size;
+	int fd; /// -1 while in memory
+	bool failed;
+};
+
+}
+
+#endif /* SPILLBUFFER_H_ */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+namespace MPool {
+
+/**
+ * @brief Timer entry, embedded in the object it times
+ * */
+class TimerNode {
+public:
+	TimerNode();
+	bool isLinked();
+public:
+	TimerNode *prev;
+	TimerNode *next;
+	time_t deadline;
+	void *data; /// Owner of the node
+};
+
+/**
+ * @brief Hashed timer wheel with one second ticks
+ * schedule() and cancel() are O(1), advance() only visits the slots of the
+ * elapsed seconds. Not thread safe, it belongs to the reactor thread.
+ * */
+class TimerWheel {
+public:
+	/// @param slots: Rounded up to a power of 2
+	TimerWheel(unsigned int slots = 64);
+	~TimerWheel();
+	/// Arm or re-arm the node
+	void schedule(TimerNode *node, time_t deadline);
+	void cancel(TimerNode *node);
+	/**
+	 * @brief Move the wheel to now
+	 * @param expired: Nodes whose deadline has passed, already unlinked
+	 * */
+	void advance(time_t now, std::vector<TimerNode*> &expired);
+	unsigned long size();
+	/// CLOCK_MONOTONIC seconds, the clock of the deadlines
+	static time_t now();
+protected:
+	TimerNode *slots; /// Sentinels of the circular lists
+	unsigned int mask;
+	time_t current; /// Last processed second
+	unsigned long count;
+};
+
+}
+
+#endif /* TIMERWHEEL_H_ */
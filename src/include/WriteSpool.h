@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) Lei.Peng, All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#ifndef WRITESPOOL_H_
+#define WRITESPOOL_H_
+
+namespace MPool {
+
+/**
+ * @brief Durable write-behind spool of fire-and-forget statements
+ * A memory-mapped file used as a ring: a header page with the position &
+ * sequence of the first statement not applied yet, then records of
+ * [length][checksum][sequence][username\0sql]. append() is acknowledged once
+ * the record is in the map (and on disk with SYNC_ALWAYS); one drainer thread
+ * applies the records in order, a run of the same user in one transaction,
+ * then moves the header on. Records left after a crash are found again by
+ * their sequence & checksum and replayed, at least once. Thread safe.
+ * */
+class WriteSpool {
+public:
+	/// Sync policies
+	const static unsigned char SYNC_NONE = 0x00; /// Left to the OS, survives a crash of mPool only
+	const static unsigned char SYNC_INTERVAL = 0x01; /// msync() by the drainer every interval
+	const static unsigned char SYNC_ALWAYS = 0x02; /// msync() before acknowledging
+	WriteSpool();
+	~WriteSpool();
+	/**
+	 * @brief Map the spool file, created with size bytes when missing
+	 * The records of an existing file are kept to be replayed.
+	 * @return false when the file cannot be opened or mapped
+	 * */
+	bool open(const std::string &path, size_t size);
+	void setSync(unsigned char sync, unsigned long interval);
+	/// Statements of a transaction of the drainer
+	void setBatch(unsigned int batch);
+	/// Pool of the statements of the user, default for the other users
+	void setPool(const std::string &username, DBPool *pool);
+	void setDefaultPool(DBPool *pool);
+	/// Start the drainer, call after the pools are set
+	void start();
+	/// Stop the drainer, the records left are replayed on the next start
+	void stop();
+	/**
+	 * @brief Spool a statement
+	 * @param error: Why it was not spooled
+	 * @return false when the spool is full or the record too large
+	 * */
+	bool append(const std::string &username, const std::string &sql,
+			std::string &error);
+	/// Records not applied yet
+	unsigned long long getPending();
+	/// Bytes of the records not applied yet
+	unsigned long long getBytes();
+	unsigned long long getApplied();
+	/// Statements dropped on SQL errors
+	unsigned long long getFailed();
+protected:
+	std::string path;
+	int fd;
+	char *map;
+	size_t size;
+	size_t tail; /// Offset of the next record
+	size_t head; /// Offset of the first record not applied
+	size_t used; /// Bytes from head to tail, wrapped ends included
+	unsigned long long next_seq; /// Sequence of the next record
+	unsigned long long head_seq; /// Sequence of the record at head
+	unsigned long long applied;
+	unsigned long long failed;
+	unsigned char sync;
+	unsigned long interval; /// Milliseconds between msync() of SYNC_INTERVAL
+	bool dirty; /// Records not synced with SYNC_INTERVAL
+	unsigned int batch;
+	std::map<std::string, DBPool*> pools;
+	DBPool *default_pool;
+	bool running;
+	pthread_t drainer;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+protected:
+	static void* drain(void *spool);
+	void drainLoop();
+	/**
+	 * @brief Apply records of one user in a transaction
+	 * @return false on a connection error, retried later
+	 * */
+	bool apply(const std::string &username, std::vector<std::string> &sqls);
+	/// Find the records after head, mutex held
+	void recover();
+	/// Record at the offset, false past the last one, mutex held
+	bool readRecord(size_t &offset, unsigned long long seq,
+			std::string &username, std::string &sql, size_t &length);
+	/// Persist head & head_seq, mutex held
+	void writeHeader();
+	void syncRange(size_t offset, size_t length);
+};
+
+}
+
+#endif /* WRITESPOOL_H_ */
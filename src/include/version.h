@@ -27,8 +27,53 @@
 
 #define MPOOL_PROTOCOL_VERSION "0.0.7" /// Current protocol version
 #define MPOOL_SERVER_VERSION "0.0.1"
+#define MPOOL_SHM_WAIT 10 /// Milliseconds a full response ring waits for a wake before checking again
+#define MPOOL_SHM_STALL 1000 /// Milliseconds a full response ring may go unread before the transport ends
 #define MPOOL_CLIENT_TIMEOUT 30
+#define MPOOL_SESSION_GRACE 60 /// Seconds a session waits for a reconnect
+#define MPOOL_TOKEN_BYTES 32 /// Random bytes of a session token
 #define MPOOL_EPOLL_LISTEN 64
+#define MPOOL_RESERVED_FILES 64 /// Listeners, pool connections, logs
 #define MPOOL_LOG_IDENT "mpool"
+#define MPOOL_WIRE_JSON 0 /// Data length (16 bytes) + JSON packages
+#define MPOOL_WIRE_MYSQL 1 /// MySQL client/server protocol
+#define MPOOL_PRIORITY_INTERACTIVE 0 /// Priority classes of the scheduler
+#define MPOOL_PRIORITY_NORMAL 1
+#define MPOOL_PRIORITY_BATCH 2
+#define MPOOL_WEIGHT_INTERACTIVE 16 /// Statements per round of a class, times the user weight
+#define MPOOL_WEIGHT_NORMAL 4
+#define MPOOL_WEIGHT_BATCH 1
+#define MPOOL_SPILL_THRESHOLD 8388608 /// Response bytes kept in memory
+#define MPOOL_SPILL_CHUNK 262144 /// Write & read size of spill files
+#define MPOOL_MAX_REQUEST_SIZE 67108864 /// Bytes of a request package
+#define MPOOL_CURSOR_TIMEOUT 60 /// Seconds an unused cursor stays open
+#define MPOOL_CURSOR_ROWS 1000 /// Rows of a fetch without a count
+#define MPOOL_MAX_CURSORS 4 /// Open cursors per client
+#define MPOOL_CURSOR_PREFETCH 100 /// Rows brought over at a time
+#define MPOOL_CURSOR_BUFFER 4096 /// Initial bytes of a TEXT/BLOB column
+#define MPOOL_LIMIT_MAX 64 /// Default upper bound of the concurrency limit
+#define MPOOL_LIMIT_PROBE 1000 /// Samples between probes of the minimum RTT
+#define MPOOL_LIMIT_TOLERANCE 1.5 /// RTT over the minimum before the limit shrinks
+#define MPOOL_LIMIT_WAIT 5000 /// Milliseconds a pinned session waits for a slot
+#define MPOOL_GTID_WAIT 50 /// Milliseconds a replica read waits for its token
+#define MPOOL_RATE_RETRY 100 /// Retry hint in ms when a user has too many queries
+#define MPOOL_BATCH_ROWS 100 /// Rows of a merged INSERT
+#define MPOOL_BATCH_BYTES 1048576 /// Bytes of a merged INSERT, below max_allowed_packet
+#define MPOOL_SPOOL_SIZE 67108864 /// Bytes of a new write spool file
+#define MPOOL_SPOOL_HEADER 4096 /// Bytes before the first record of the spool
+#define MPOOL_SPOOL_BATCH 100 /// Spooled statements applied in one transaction
+#define MPOOL_SPOOL_SYNC_INTERVAL 100 /// Milliseconds between syncs of the spool
+#define MPOOL_SPOOL_RETRY 1000 /// Milliseconds before applying again after a connection error
+#define MPOOL_BULK_WINDOW 4194304 /// Bytes of bulk load data buffered before MySQL reads them
+#define MPOOL_BULK_TIMEOUT 30 /// Seconds a bulk load waits for the next data frame
+#define MPOOL_BULK_DEADLINE 600 /// Seconds a whole bulk load may take
+#define MPOOL_SNAPSHOT_REFRESH 1000 /// Milliseconds between two runs of a snapshot query
+#define MPOOL_COMPRESS_THRESHOLD 16384 /// JSON bytes of the smallest frame compressed
+#define MPOOL_COMPRESS_LEVEL 1 /// zlib level of the compressed frames
+#define MPOOL_COMPRESS_CHUNK 65536 /// Bytes deflated at once
+#define MPOOL_URING_ENTRIES 1024
+#define MPOOL_URING_BUFFERS 256
+#define MPOOL_URING_BUFFER_SIZE 4096
+#define MPOOL_URING_BATCH 256
 
 #endif /* VERSION_H_ */
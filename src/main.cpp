@@ -23,6 +23,8 @@
  */
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <list>
 #include <map>
 #include <exception>
@@ -35,9 +37,20 @@
 #include <jsoncpp/json/json.h>
 #include <my_global.h>
 #include <mysql.h>
+#include "include/version.h"
 #include "include/ServerException.h"
 #include "include/DBPool.h"
+#include "include/RateLimiter.h"
+#include "include/InsertBatcher.h"
+#include "include/SnapshotCache.h"
+#include "include/FrameCompressor.h"
+#include "include/IOUring.h"
+#include "include/TimerWheel.h"
+#include "include/ShmChannel.h"
+#include "include/MemoryAccount.h"
 #include "include/Client.h"
+#include "include/ConnectionTable.h"
+#include "include/FrameTemplate.h"
 #include "include/Manager.h"
 #include "include/Server.h"
 